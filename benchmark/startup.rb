@@ -0,0 +1,33 @@
+# Measures the cost of `require 'mecaby'` in a fresh process.
+#
+#   $ rake compile
+#   $ ruby benchmark/startup.rb [iterations]
+
+require 'benchmark'
+require 'rbconfig'
+
+lib_dir = File.expand_path('../../lib', __FILE__)
+ruby = RbConfig.ruby
+iterations = Integer(ARGV[0] || 20)
+
+def spawn_ruby(ruby, *args)
+  system(ruby, '--disable-gems', *args) or abort "failed: #{args.join(' ')}"
+end
+
+scripts = {
+  'ruby (empty)'    => [ '-e', '' ],
+  "require 'mecaby'" => [ "-I#{lib_dir}", '-e', "require 'mecaby'" ],
+  "require 'MeCab'"  => [ "-I#{lib_dir}", '-e', "require 'MeCab'" ],
+}
+
+Benchmark.bm(scripts.keys.map(&:length).max) do |x|
+  scripts.each do |label, args|
+    x.report(label) { iterations.times { spawn_ruby(ruby, *args) } }
+  end
+end
+
+features = IO.popen([ ruby, '--disable-gems', "-I#{lib_dir}", '-e',
+                      "before = $LOADED_FEATURES.dup; require 'mecaby'; puts $LOADED_FEATURES - before" ], &:read)
+puts
+puts "features loaded by `require 'mecaby'`:"
+puts features.lines.map {|l| "  #{l}" }
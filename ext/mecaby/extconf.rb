@@ -6,5 +6,22 @@ unless have_header('mecab.h') && have_library('mecab', 'mecab_new')
 end
 
 have_func('mecab_model_new', %[mecab.h])
+have_func('mecab_get_partial', %[mecab.h])
+
+have_header('ruby/atomic.h')
+have_header('ruby/ractor.h')
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', %[ruby/thread.h])
+have_func('rb_fiber_scheduler_current', %[ruby/fiber/scheduler.h])
+have_header('pthread.h')
+have_header('unistd.h')
+have_header('sys/stat.h')
+have_header('sys/mman.h')
+have_header('fcntl.h')
+have_func('madvise', %[sys/mman.h])
+have_func('mlock', %[sys/mman.h])
+have_func('clock_gettime', %[time.h])
+have_func('rb_str_to_interned_str', %[ruby.h])
+have_func('rb_gc_mark_movable', %[ruby.h])
 
 create_makefile('mecaby/mecaby')
@@ -2,6 +2,47 @@
 
 #include <ruby/ruby.h>
 #include <ruby/encoding.h>
+#ifdef HAVE_RUBY_ATOMIC_H
+# include <ruby/atomic.h>
+#endif
+#ifdef HAVE_RUBY_RACTOR_H
+# include <ruby/ractor.h>
+#endif
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+# include <ruby/fiber/scheduler.h>
+# include <ruby/io.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_PTHREAD_H) && defined(HAVE_UNISTD_H)
+# define MECABY_USE_PARSE_WORKER 1
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_FCNTL_H) && defined(HAVE_UNISTD_H) && defined(HAVE_SYS_STAT_H)
+# define MECABY_USE_PREWARM 1
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+# define MECABY_USE_SSE2 1
+#endif
 
 #ifndef UNREACHABLE
 # define UNREACHABLE	/* unreachable */
@@ -21,6 +62,49 @@
 # define RARRAY_AREF(a, i) (RARRAY_CONST_PTR(a)[i])
 #endif
 
+#if defined(HAVE_RB_EXT_RACTOR_SAFE) && defined(HAVE_RUBY_RACTOR_H)
+# define MECABY_RACTOR_SAFE 1
+#endif
+
+/*
+ * References marked by mecaby_gc_mark_movable can be moved by GC
+ * compaction, and the compact functions of the types update them with
+ * rb_gc_location.  Without compaction support, they are marked as usual.
+ */
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+# define mecaby_gc_mark_movable(obj) rb_gc_mark_movable(obj)
+# define MECABY_GC_UPDATE(obj) ((obj) = rb_gc_location(obj))
+#else
+# define mecaby_gc_mark_movable(obj) rb_gc_mark(obj)
+#endif
+
+#ifdef HAVE_RUBY_ATOMIC_H
+typedef rb_atomic_t mecaby_atomic_t;
+# define MECABY_ATOMIC_INC(var) RUBY_ATOMIC_INC(var)
+# define MECABY_ATOMIC_DEC(var) RUBY_ATOMIC_DEC(var)
+# define MECABY_ATOMIC_FETCH_SUB(var, val) RUBY_ATOMIC_FETCH_SUB(var, val)
+#else
+typedef unsigned int mecaby_atomic_t;
+# define MECABY_ATOMIC_INC(var) ((void)++(var))
+# define MECABY_ATOMIC_DEC(var) ((void)--(var))
+# define MECABY_ATOMIC_FETCH_SUB(var, val) (((var) -= (val)) + (val))
+#endif
+
+#if defined(MECABY_RACTOR_SAFE) && defined(HAVE_PTHREAD_H)
+typedef pthread_mutex_t mecaby_lock_t;
+# define MECABY_LOCK_INIT(lock) pthread_mutex_init((lock), NULL)
+# define MECABY_LOCK_DESTROY(lock) pthread_mutex_destroy(lock)
+# define MECABY_LOCK(lock) pthread_mutex_lock(lock)
+# define MECABY_UNLOCK(lock) pthread_mutex_unlock(lock)
+#else
+/* the GVL serializes the accesses without Ractors. */
+typedef int mecaby_lock_t;
+# define MECABY_LOCK_INIT(lock) ((void)(lock))
+# define MECABY_LOCK_DESTROY(lock) ((void)(lock))
+# define MECABY_LOCK(lock) ((void)(lock))
+# define MECABY_UNLOCK(lock) ((void)(lock))
+#endif
+
 #define DEFINE_GETTER_AND_CHECKER(type, klass) \
 void \
 check_##type##_initialized(mecaby_##type##_t* ptr, VALUE obj, VALUE err) \
@@ -66,21 +150,100 @@ check_get_##type##_initialized(VALUE obj, VALUE err) \
  * Types
  */
 
+enum mecaby_feature_field {
+  MECABY_FIELD_POS,
+  MECABY_FIELD_BASE_FORM,
+  MECABY_FIELD_READING,
+  MECABY_FIELD_MAX
+};
+
+/*
+ * Maps feature pointers of nodes to frozen Strings and frozen Arrays of
+ * their fields.  Feature strings point to the dictionary memory, which is
+ * immutable while the model is alive, so each of them is converted to
+ * Ruby objects only once.  The table also has the field schema of the
+ * dictionary.  The owner is the object which marks the table, for the
+ * write barrier.
+ */
+typedef struct mecaby_feature_table {
+  VALUE owner;
+  st_table* strings;
+  st_table* fields;
+  rb_encoding* encoding;
+  VALUE field_names;
+  int field_index[MECABY_FIELD_MAX];
+  mecaby_lock_t lock;
+} mecaby_feature_table_t;
+
+/*
+ * A pool of Node wrappers owned by a tagger or a lattice.  Once enabled,
+ * the wrappers are rebound to the nodes of each parse instead of being
+ * allocated per node.  The generation is advanced whenever the owner
+ * parses, so a wrapper which has not been rebound since then is detected
+ * as stale.
+ */
+typedef struct mecaby_node_pool {
+  VALUE nodes;
+  long used;
+  unsigned long generation;
+  int enabled;
+} mecaby_node_pool_t;
+
 #ifdef HAVE_MECAB_MODEL_NEW
+/*
+ * A dictionary file mapped and locked by Model#prewarm.
+ */
+typedef struct mecaby_mapping {
+  void* addr;
+  size_t size;
+  struct mecaby_mapping* next;
+} mecaby_mapping_t;
+
+/*
+ * mecaby_model_t is reference counted, because taggers and lattices
+ * created from a model must be destroyed before the model even if they
+ * are collected in the same GC cycle.  The Ruby object holds one
+ * reference and each tagger or lattice generated by it holds another.
+ * The counters are updated atomically because a model can be shared by
+ * Ractors.
+ */
 typedef struct mecaby_model {
   VALUE arg;
   mecab_model_t* model;
+  mecaby_atomic_t refcount;
+  mecaby_atomic_t ntaggers;
+  mecaby_atomic_t nlattices;
+  mecaby_feature_table_t features;
+  size_t dictionary_bytes;
+  size_t lattice_high_water;
+  mecaby_mapping_t* locked;
+  int shared;
 } mecaby_model_t;
 
 typedef struct mecaby_lattice {
   VALUE generator;
   mecab_lattice_t* lattice;
+  mecaby_model_t* model;
+  int busy;
+  VALUE sentence;
+  long* offset_map;
+  size_t size_high_water;
+  size_t arena_high_water;
+  mecaby_node_pool_t* node_pool;
 } mecaby_lattice_t;
 #endif
 
 typedef struct mecaby_tagger {
   VALUE generator;
   mecab_t* tagger;
+#ifdef HAVE_MECAB_MODEL_NEW
+  mecaby_model_t* model;
+#endif
+  int busy;
+  mecaby_feature_table_t features;
+  size_t fast_path_min_length;
+  VALUE fast_path_feature;
+  mecaby_node_pool_t* node_pool;
 } mecaby_tagger_t;
 
 typedef struct mecaby_dictionary_info {
@@ -91,6 +254,11 @@ typedef struct mecaby_dictionary_info {
 typedef struct mecaby_node {
   VALUE generator;
   mecab_node_t const* node;
+  mecaby_feature_table_t* features;
+  mecaby_node_pool_t* pool;
+  unsigned long generation;
+  VALUE filter;
+  struct mecaby_filter_bits* filter_bits;
 } mecaby_node_t;
 
 typedef struct mecaby_path {
@@ -108,12 +276,21 @@ static VALUE mecaby_eDictNotFound;
 static VALUE mecaby_eRuntimeError;
 #ifdef HAVE_MECAB_MODEL_NEW
 static VALUE mecaby_cModel;
+static VALUE mecaby_cModelLoader;
+static VALUE mecaby_mDictionary;
 static VALUE mecaby_cLattice;
 #endif
 static VALUE mecaby_cTagger;
 static VALUE mecaby_cDictionaryInfo;
 static VALUE mecaby_cNode;
 static VALUE mecaby_cPath;
+static VALUE mecaby_cTokens;
+static VALUE mecaby_cFilter;
+#ifdef HAVE_MECAB_MODEL_NEW
+static VALUE mecaby_cDocument;
+#endif
+
+static ID id_mecaby_thread_taggers;
 
 /*
  * Pointer-to-object map
@@ -131,15 +308,104 @@ static VALUE mecaby_cPath;
 # error ---->> assume sizeof(void*) == sizeof(long) or sizeof(LONG_LONG) to be compiled. <<----
 #endif
 
+/*
+ * weakref and the pointer-to-object map are prepared at the first use,
+ * so that `require 'mecaby'` costs only the class definitions.
+ */
+
+#ifdef MECABY_RACTOR_SAFE
+/*
+ * In the Ractor-safe build, the weak references are ObjectSpace::WeakMap
+ * objects, which don't need weakref library and can be used in any
+ * Ractor, and the pointer-to-object map is held in the Ractor-local
+ * storage.  WeakMap drops the entries of the collected objects by itself,
+ * so the pointers aren't unregistered from free functions, which can run
+ * in a different Ractor.
+ */
+
+static rb_ractor_local_key_t mecaby_pointer_object_map_key;
+
+static VALUE
+mecaby_weakmap_new(void)
+{
+  return rb_class_new_instance(0, NULL, rb_path2class("ObjectSpace::WeakMap"));
+}
+
+static VALUE
+weakref_new(VALUE obj)
+{
+  VALUE wref = mecaby_weakmap_new();
+  rb_funcall(wref, rb_intern("[]="), 2, Qtrue, obj);
+  return wref;
+}
+
+static VALUE
+weakref_getobj_if_alive(VALUE wref)
+{
+  return rb_funcall(wref, rb_intern("[]"), 1, Qtrue);
+}
+
+static void
+mecaby_init_pointer_object_map_key(void)
+{
+  mecaby_pointer_object_map_key = rb_ractor_local_storage_value_newkey();
+}
+
+static VALUE
+mecaby_lookup_object(void const* ptr)
+{
+  VALUE map;
+
+  if (ptr == NULL) return Qnil;
+  if (!rb_ractor_local_storage_value_lookup(mecaby_pointer_object_map_key, &map)) return Qnil;
+
+  return rb_funcall(map, rb_intern("[]"), 1, POINTER_TO_NUM(ptr));
+}
+
+static void
+mecaby_register_pointer_object(void const* ptr, VALUE obj)
+{
+  VALUE map;
+
+  if (!rb_ractor_local_storage_value_lookup(mecaby_pointer_object_map_key, &map)) {
+    map = mecaby_weakmap_new();
+    rb_ractor_local_storage_value_set(mecaby_pointer_object_map_key, map);
+  }
+
+  rb_funcall(map, rb_intern("[]="), 2, POINTER_TO_NUM(ptr), obj);
+}
+
+static void
+mecaby_unregister_pointer(void const* ptr)
+{
+}
+
+#else /* MECABY_RACTOR_SAFE */
+
 static VALUE cWeakRef = Qnil;
+static VALUE eWeakRefRefError = Qnil;
 static VALUE mecaby_pointer_object_map = Qnil;
 
 static void
-mecaby_init_pointer_object_map()
+mecaby_init_weakref(void)
 {
+  if (!NIL_P(cWeakRef)) return;
+
   rb_require("weakref");
 
   cWeakRef = rb_path2class("WeakRef");
+  rb_gc_register_address(&cWeakRef);
+  eWeakRefRefError = rb_path2class("WeakRef::RefError");
+  rb_gc_register_address(&eWeakRefRefError);
+}
+
+static void
+mecaby_init_pointer_object_map(void)
+{
+  if (!NIL_P(mecaby_pointer_object_map)) return;
+
+  mecaby_init_weakref();
+
   mecaby_pointer_object_map = rb_hash_new();
   rb_gc_register_address(&mecaby_pointer_object_map);
 }
@@ -147,6 +413,7 @@ mecaby_init_pointer_object_map()
 static VALUE
 weakref_new(VALUE obj)
 {
+  mecaby_init_weakref();
   return rb_funcall(cWeakRef, rb_intern("new"), 1, obj);
 }
 
@@ -156,12 +423,27 @@ weakref_getobj(VALUE wref)
   return rb_funcall(wref, rb_intern("__getobj__"), 0);
 }
 
+static VALUE
+weakref_return_nil(VALUE arg, VALUE exc)
+{
+  return Qnil;
+}
+
+static VALUE
+weakref_getobj_if_alive(VALUE wref)
+{
+  mecaby_init_weakref();
+  return rb_rescue2(weakref_getobj, wref, weakref_return_nil, Qnil,
+                    eWeakRefRefError, (VALUE)0);
+}
+
 static VALUE
 mecaby_lookup_object(void const* ptr)
 {
   VALUE key, wref;
   
   if (ptr == NULL) return Qnil;
+  if (NIL_P(mecaby_pointer_object_map)) return Qnil;
 
   key = POINTER_TO_NUM(ptr);
   wref = rb_hash_aref(mecaby_pointer_object_map, key);
@@ -174,6 +456,8 @@ mecaby_register_pointer_object(void const* ptr, VALUE obj)
 {
   VALUE key, wref;
 
+  mecaby_init_pointer_object_map();
+
   key = POINTER_TO_NUM(ptr);
   wref = weakref_new(obj);
   rb_hash_aset(mecaby_pointer_object_map, key, wref);
@@ -184,873 +468,8061 @@ mecaby_unregister_pointer(void const* ptr)
 {
   VALUE key;
 
+  /* called from free functions, so never initialize the map here. */
+  if (NIL_P(mecaby_pointer_object_map)) return;
+
   key = POINTER_TO_NUM(ptr);
   rb_hash_delete(mecaby_pointer_object_map, key);
 }
+#endif /* MECABY_RACTOR_SAFE */
 
 /*
- * the following charset decoding routines are same as MeCab::decode_charset.
+ * Feature string table
  */
 
-static inline int
-charset_is_shift_jis(char const* charset)
-{
-  return strcmp("sjis",      charset) == 0
-      || strcmp("shift-jis", charset) == 0
-      || strcmp("shift_jis", charset) == 0
-      || strcmp("cp932",     charset) == 0
-      ;
-}
+static char const* const mecaby_feature_field_names[MECABY_FIELD_MAX] = {
+  "pos",
+  "base_form",
+  "reading",
+};
 
-static inline int
-charset_is_euc_jp(char const* charset)
+/*
+ * The feature fields of IPADIC, used when the dicrc doesn't have the
+ * mecaby-feature-fields entry.
+ */
+static char const* const mecaby_default_feature_fields[] = {
+  "pos", "pos_detail1", "pos_detail2", "pos_detail3",
+  "conjugated_type", "conjugated_form", "base_form", "reading", "pronunciation",
+};
+
+static int const mecaby_default_field_index[MECABY_FIELD_MAX] = { 0, 6, 7 };
+
+#ifdef MECABY_RACTOR_SAFE
+# define MECABY_MAKE_SHAREABLE(obj) rb_ractor_make_shareable(obj)
+#else
+# define MECABY_MAKE_SHAREABLE(obj) (obj)
+#endif
+
+static VALUE
+mecaby_str_intern(VALUE str)
 {
-  return strcmp("euc",    charset) == 0
-      || strcmp("euc_jp", charset) == 0
-      || strcmp("euc-jp", charset) == 0
-      ;
+#ifdef HAVE_RB_STR_TO_INTERNED_STR
+  str = rb_str_to_interned_str(str);
+#else
+  rb_obj_freeze(str);
+#endif
+  return MECABY_MAKE_SHAREABLE(str);
 }
 
-static inline int
-charset_is_utf8(char const* charset)
+static void
+mecaby_feature_table_init(mecaby_feature_table_t* table, VALUE owner)
 {
-  return strcmp("utf8",  charset) == 0
-      || strcmp("utf_8", charset) == 0
-      || strcmp("utf-8", charset) == 0
-      ;
+  int i;
+
+  table->owner = owner;
+  table->strings = NULL;
+  table->fields = NULL;
+  table->encoding = NULL;
+  table->field_names = Qnil;
+  for (i = 0; i < MECABY_FIELD_MAX; ++i) {
+    table->field_index[i] = mecaby_default_field_index[i];
+  }
+  MECABY_LOCK_INIT(&table->lock);
 }
 
-static inline int
-charset_is_utf16(char const* charset)
+static int
+mecaby_feature_table_mark_i(st_data_t key, st_data_t value, st_data_t arg)
 {
-  return strcmp("utf16",  charset) == 0
-      || strcmp("utf_16", charset) == 0
-      || strcmp("utf-16", charset) == 0
-      ;
+  mecaby_gc_mark_movable((VALUE)value);
+  return ST_CONTINUE;
 }
 
-static inline int
-charset_is_utf16be(char const* charset)
+static void
+mecaby_feature_table_mark(mecaby_feature_table_t* table)
 {
-  return strcmp("utf16be",  charset) == 0
-      || strcmp("utf_16be", charset) == 0
-      || strcmp("utf-16be", charset) == 0
-      ;
+  if (table->strings != NULL) {
+    st_foreach(table->strings, mecaby_feature_table_mark_i, 0);
+  }
+  if (table->fields != NULL) {
+    st_foreach(table->fields, mecaby_feature_table_mark_i, 0);
+  }
+  mecaby_gc_mark_movable(table->field_names);
 }
 
-static inline int
-charset_is_utf16le(char const* charset)
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static int
+mecaby_feature_table_moved_i(st_data_t key, st_data_t value, st_data_t arg, int error)
 {
-  return strcmp("utf16le",  charset) == 0
-      || strcmp("utf_16le", charset) == 0
-      || strcmp("utf-16le", charset) == 0
-      ;
+  return rb_gc_location((VALUE)value) != (VALUE)value ? ST_REPLACE : ST_CONTINUE;
 }
 
-static inline int
-charset_is_ascii(char const* charset)
+static int
+mecaby_feature_table_update_i(st_data_t* key, st_data_t* value, st_data_t arg, int existing)
 {
-  return strcmp("ascii", charset) == 0;
+  *value = (st_data_t)rb_gc_location((VALUE)*value);
+  return ST_CONTINUE;
 }
 
-static rb_encoding*
-mecaby_decode_charset_to_encoding(char const* charset)
+static void
+mecaby_feature_table_compact(mecaby_feature_table_t* table)
 {
-  VALUE vcharset = rb_external_str_new_with_enc(charset, strlen(charset), rb_usascii_encoding());
-
-  rb_funcall(vcharset, rb_intern("downcase!"), 0);
-
-  if (charset_is_shift_jis(RSTRING_PTR(vcharset))) {
-    return rb_enc_find("Windows-31J");
-  }
-  else if (charset_is_euc_jp(RSTRING_PTR(vcharset))) {
-    return rb_enc_find("EUC-JP");
-  }
-  else if (charset_is_utf8(RSTRING_PTR(vcharset))) {
-    return rb_utf8_encoding();
-  }
-  else if (charset_is_utf16(RSTRING_PTR(vcharset))) {
-    return rb_enc_find("UTF-16");
-  }
-  else if (charset_is_utf16be(RSTRING_PTR(vcharset))) {
-    return rb_enc_find("UTF-16BE");
+  if (table->strings != NULL) {
+    st_foreach_with_replace(table->strings, mecaby_feature_table_moved_i, mecaby_feature_table_update_i, 0);
   }
-  else if (charset_is_utf16le(RSTRING_PTR(vcharset))) {
-    return rb_enc_find("UTF-16LE");
-  }
-  else if (charset_is_ascii(RSTRING_PTR(vcharset))) {
-    return rb_usascii_encoding();
+  if (table->fields != NULL) {
+    st_foreach_with_replace(table->fields, mecaby_feature_table_moved_i, mecaby_feature_table_update_i, 0);
   }
-
-  return rb_utf8_encoding(); /* default is UTF-8 */
+  MECABY_GC_UPDATE(table->field_names);
+  MECABY_GC_UPDATE(table->owner);
 }
+#endif
 
-/*
- * Typed data preparations
- */
-
-#ifdef HAVE_MECAB_MODEL_NEW
 static void
-mecaby_model_mark(void *ptr)
+mecaby_feature_table_clear(mecaby_feature_table_t* table)
 {
-  mecaby_model_t* model = ptr;
-
-  if (model != NULL) {
-    rb_gc_mark(model->arg);
+  MECABY_LOCK(&table->lock);
+  if (table->strings != NULL) {
+    st_clear(table->strings);
+  }
+  if (table->fields != NULL) {
+    st_clear(table->fields);
   }
+  table->field_names = Qnil;
+  MECABY_UNLOCK(&table->lock);
 }
 
 static void
-mecaby_model_free(void *ptr)
+mecaby_feature_table_free(mecaby_feature_table_t* table)
 {
-  mecaby_model_t* model = ptr;
-
-  if (model != NULL) {
-    if (model->model != NULL) {
-      mecaby_unregister_pointer(model->model);
-      mecab_model_destroy(model->model);
-    }
-    model->arg = Qnil;
-    xfree(model);
+  if (table->strings != NULL) {
+    st_free_table(table->strings);
+    table->strings = NULL;
   }
+  if (table->fields != NULL) {
+    st_free_table(table->fields);
+    table->fields = NULL;
+  }
+  MECABY_LOCK_DESTROY(&table->lock);
 }
 
 static size_t
-mecaby_model_memsize(void const *ptr)
+mecaby_feature_table_memsize(mecaby_feature_table_t const* table)
 {
-  return sizeof(mecaby_model_t);
-}
-
-static const rb_data_type_t mecaby_model_data_type = {
-  "Mecaby::Model",
-  {
-    mecaby_model_mark,
-    mecaby_model_free,
-    mecaby_model_memsize,
-  }
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
-#endif
-};
+  size_t size = 0;
 
-#define MECABY_OBJ_IS_MODEL(obj) rb_typeddata_is_kind_of((obj), &mecaby_model_data_type)
+  if (table->strings != NULL) size += st_memsize(table->strings);
+  if (table->fields != NULL) size += st_memsize(table->fields);
 
-DEFINE_GETTER_AND_CHECKER(model, Model);
+  return size;
+}
 
 static void
-mecaby_lattice_mark(void *ptr)
+mecaby_node_pool_mark(mecaby_node_pool_t* pool)
 {
-  mecaby_lattice_t* lattice = ptr;
-
-  if (lattice != NULL) {
-    rb_gc_mark(lattice->generator);
+  if (pool != NULL) {
+    mecaby_gc_mark_movable(pool->nodes);
   }
 }
 
+#ifdef HAVE_RB_GC_MARK_MOVABLE
 static void
-mecaby_lattice_free(void *ptr)
+mecaby_node_pool_compact(mecaby_node_pool_t* pool)
 {
-  mecaby_lattice_t* lattice = ptr;
-
-  if (lattice != NULL) {
-    if (lattice->lattice != NULL) {
-      mecaby_unregister_pointer(lattice->lattice);
-      mecab_lattice_destroy(lattice->lattice);
-    }
-    lattice->generator = Qnil;
-    xfree(lattice);
+  if (pool != NULL) {
+    MECABY_GC_UPDATE(pool->nodes);
   }
 }
+#endif
 
-static size_t
-mecaby_lattice_memsize(void const *ptr)
+static void
+mecaby_node_pool_free(mecaby_node_pool_t* pool)
 {
-  return sizeof(mecaby_lattice_t);
+  if (pool != NULL) {
+    xfree(pool);
+  }
 }
 
-static const rb_data_type_t mecaby_lattice_data_type = {
-  "Mecaby::Lattice",
+/*
+ * Invalidates the wrappers bound by the last parse.  Called before the
+ * owner's MeCab nodes are released or overwritten.
+ */
+static void
+mecaby_node_pool_advance(mecaby_node_pool_t* pool)
+{
+  if (pool != NULL) {
+    ++pool->generation;
+    pool->used = 0;
+  }
+}
+
+/*
+ * Enables or disables the node pool.  Disabling keeps the pool so that
+ * the wrappers bound from it are detected as stale.
+ */
+static VALUE
+mecaby_node_pool_set(VALUE owner, mecaby_node_pool_t** ppool, VALUE venabled)
+{
+  mecaby_node_pool_t* pool = *ppool;
+
+  if (RTEST(venabled)) {
+    if (pool == NULL) {
+      pool = ALLOC(mecaby_node_pool_t);
+      pool->nodes = Qnil;
+      pool->used = 0;
+      pool->generation = 0;
+      pool->enabled = 0;
+      *ppool = pool;
+      RB_OBJ_WRITE(owner, &pool->nodes, rb_ary_new());
+    }
+    pool->enabled = 1;
+  }
+  else if (pool != NULL) {
+    pool->enabled = 0;
+    mecaby_node_pool_advance(pool);
+  }
+
+  return venabled;
+}
+
+/*
+ * Returns the end of the field of the feature CSV starting at p.  A field
+ * quoted by double quotes can contain commas.
+ */
+static char const*
+mecaby_feature_field_end(char const* p, char const* end)
+{
+  if (p < end && *p == '"') {
+    for (++p; p < end; ++p) {
+      if (*p == '"') {
+        if (p + 1 < end && p[1] == '"') {
+          ++p;
+          continue;
+        }
+        break;
+      }
+    }
+  }
+
+  while (p < end && *p != ',') ++p;
+
+  return p;
+}
+
+static VALUE
+mecaby_feature_field_str_new(char const* p, char const* q, rb_encoding* encoding)
+{
+  VALUE str;
+
+  if (q - p >= 2 && *p == '"' && q[-1] == '"') {
+    ++p;
+    --q;
+  }
+
+  str = rb_external_str_new_with_enc(p, q - p, encoding);
+  if (memchr(p, '"', q - p) != NULL) {
+    rb_funcall(str, rb_intern("gsub!"), 2, rb_str_new2("\"\""), rb_str_new2("\""));
+  }
+
+  return mecaby_str_intern(str);
+}
+
+static VALUE
+mecaby_feature_str_new(char const* feature, rb_encoding* encoding)
+{
+  return mecaby_str_intern(rb_external_str_new_with_enc(feature, strlen(feature), encoding));
+}
+
+static VALUE
+mecaby_feature_fields_new(char const* feature, rb_encoding* encoding)
+{
+  char const* p = feature;
+  char const* end = feature + strlen(feature);
+  VALUE fields = rb_ary_new();
+
+  for (;;) {
+    char const* q = mecaby_feature_field_end(p, end);
+    rb_ary_push(fields, mecaby_feature_field_str_new(p, q, encoding));
+    if (q >= end) break;
+    p = q + 1;
+  }
+
+  rb_obj_freeze(fields);
+  return MECABY_MAKE_SHAREABLE(fields);
+}
+
+/*
+ * Returns the field at the index without splitting the other fields.
+ */
+static VALUE
+mecaby_feature_field_at(char const* feature, int index, rb_encoding* encoding)
+{
+  int i;
+  char const* p = feature;
+  char const* end = feature + strlen(feature);
+
+  for (i = 0; ; ++i) {
+    char const* q = mecaby_feature_field_end(p, end);
+    if (i == index) {
+      return mecaby_feature_field_str_new(p, q, encoding);
+    }
+    if (q >= end) break;
+    p = q + 1;
+  }
+
+  return Qnil;
+}
+
+/*
+ * Returns the frozen String of the feature, or the frozen Array of its
+ * fields if fields is true.  The tables are dropped when the default
+ * external encoding is changed.  When table is NULL, a new object is
+ * created every time.
+ */
+static VALUE
+mecaby_feature_table_fetch(mecaby_feature_table_t* table, char const* feature, int fields)
+{
+  int found = 0;
+  st_data_t value;
+  st_table** cache;
+  VALUE obj;
+  rb_encoding* encoding = rb_default_external_encoding();
+
+  if (table == NULL) {
+    return fields ? mecaby_feature_fields_new(feature, encoding)
+                  : mecaby_feature_str_new(feature, encoding);
+  }
+
+  cache = fields ? &table->fields : &table->strings;
+
+  MECABY_LOCK(&table->lock);
+  if (table->encoding != encoding) {
+    if (table->strings != NULL) st_clear(table->strings);
+    if (table->fields != NULL) st_clear(table->fields);
+    table->encoding = encoding;
+  }
+  else if (*cache != NULL) {
+    found = st_lookup(*cache, (st_data_t)feature, &value);
+  }
+  MECABY_UNLOCK(&table->lock);
+
+  if (found) return (VALUE)value;
+
+  obj = fields ? mecaby_feature_fields_new(feature, encoding)
+               : mecaby_feature_str_new(feature, encoding);
+
+  MECABY_LOCK(&table->lock);
+  if (*cache == NULL) {
+    *cache = st_init_numtable();
+  }
+  if (st_lookup(*cache, (st_data_t)feature, &value)) {
+    obj = (VALUE)value;
+  }
+  else {
+    st_insert(*cache, (st_data_t)feature, (st_data_t)obj);
+    RB_OBJ_WRITTEN(table->owner, Qundef, obj);
+  }
+  MECABY_UNLOCK(&table->lock);
+
+  return obj;
+}
+
+/*
+ * Field schema
+ */
+
+static VALUE
+mecaby_default_feature_field_names(void)
+{
+  size_t i, n = sizeof(mecaby_default_feature_fields) / sizeof(mecaby_default_feature_fields[0]);
+  VALUE names = rb_ary_new2(n);
+
+  for (i = 0; i < n; ++i) {
+    rb_ary_push(names, rb_obj_freeze(rb_usascii_str_new_cstr(mecaby_default_feature_fields[i])));
+  }
+
+  return names;
+}
+
+static VALUE
+mecaby_strip_cstr(char const* p, char const* q)
+{
+  while (p < q && ISSPACE(*p)) ++p;
+  while (q > p && ISSPACE(q[-1])) --q;
+  return rb_str_new(p, q - p);
+}
+
+/*
+ * Reads the mecaby-feature-fields entry, a comma separated list of the
+ * field names, from the dicrc of the system dictionary.
+ */
+static VALUE
+mecaby_dicrc_feature_field_names(mecab_dictionary_info_t const* di)
+{
+  FILE* fp;
+  char line[BUFSIZ];
+  VALUE dicrc, names = Qnil;
+
+  for (; di != NULL; di = di->next) {
+    if (di->type == MECAB_SYS_DIC) break;
+  }
+  if (di == NULL || di->filename == NULL) return Qnil;
+
+  dicrc = rb_file_dirname(rb_str_new_cstr(di->filename));
+  rb_str_cat2(dicrc, "/dicrc");
+
+  fp = fopen(RSTRING_PTR(dicrc), "r");
+  if (fp == NULL) return Qnil;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char const* eq;
+    char const* end = line + strlen(line);
+    VALUE key;
+
+    if (line[0] == ';' || line[0] == '#') continue;
+    eq = strchr(line, '=');
+    if (eq == NULL) continue;
+
+    key = mecaby_strip_cstr(line, eq);
+    if (strcmp(RSTRING_PTR(key), "mecaby-feature-fields") == 0) {
+      names = rb_str_split(mecaby_strip_cstr(eq + 1, end), ",");
+    }
+  }
+  fclose(fp);
+
+  return names;
+}
+
+/*
+ * Sets the field names and finds the fields used by the accessors such as
+ * Node#pos.  Returns the frozen names.
+ */
+static VALUE
+mecaby_feature_table_set_field_names(mecaby_feature_table_t* table, VALUE names)
+{
+  long i, j;
+  int index[MECABY_FIELD_MAX];
+
+  names = rb_ary_dup(rb_convert_type(names, T_ARRAY, "Array", "to_ary"));
+  for (i = 0; i < RARRAY_LEN(names); ++i) {
+    VALUE name = rb_obj_as_string(RARRAY_AREF(names, i));
+    rb_ary_store(names, i, rb_str_new_frozen(mecaby_strip_cstr(RSTRING_PTR(name), RSTRING_END(name))));
+  }
+  rb_obj_freeze(names);
+  names = MECABY_MAKE_SHAREABLE(names);
+
+  for (j = 0; j < MECABY_FIELD_MAX; ++j) {
+    index[j] = -1;
+    for (i = 0; i < RARRAY_LEN(names); ++i) {
+      VALUE name = RARRAY_AREF(names, i);
+      if (strcmp(StringValueCStr(name), mecaby_feature_field_names[j]) == 0) {
+        index[j] = (int)i;
+        break;
+      }
+    }
+  }
+
+  MECABY_LOCK(&table->lock);
+  RB_OBJ_WRITE(table->owner, &table->field_names, names);
+  memcpy(table->field_index, index, sizeof(index));
+  MECABY_UNLOCK(&table->lock);
+
+  return names;
+}
+
+/*
+ * Loads the field schema from the dicrc unless it is already loaded.
+ */
+static VALUE
+mecaby_feature_table_load_field_names(mecaby_feature_table_t* table, mecab_dictionary_info_t const* di)
+{
+  VALUE names = table->field_names;
+
+  if (!NIL_P(names)) return names;
+
+  names = mecaby_dicrc_feature_field_names(di);
+  if (NIL_P(names)) {
+    names = mecaby_default_feature_field_names();
+  }
+
+  return mecaby_feature_table_set_field_names(table, names);
+}
+
+/*
+ * the following charset decoding routines are same as MeCab::decode_charset.
+ */
+
+static inline int
+charset_is_shift_jis(char const* charset)
+{
+  return strcmp("sjis",      charset) == 0
+      || strcmp("shift-jis", charset) == 0
+      || strcmp("shift_jis", charset) == 0
+      || strcmp("cp932",     charset) == 0
+      ;
+}
+
+static inline int
+charset_is_euc_jp(char const* charset)
+{
+  return strcmp("euc",    charset) == 0
+      || strcmp("euc_jp", charset) == 0
+      || strcmp("euc-jp", charset) == 0
+      ;
+}
+
+static inline int
+charset_is_utf8(char const* charset)
+{
+  return strcmp("utf8",  charset) == 0
+      || strcmp("utf_8", charset) == 0
+      || strcmp("utf-8", charset) == 0
+      ;
+}
+
+static inline int
+charset_is_utf16(char const* charset)
+{
+  return strcmp("utf16",  charset) == 0
+      || strcmp("utf_16", charset) == 0
+      || strcmp("utf-16", charset) == 0
+      ;
+}
+
+static inline int
+charset_is_utf16be(char const* charset)
+{
+  return strcmp("utf16be",  charset) == 0
+      || strcmp("utf_16be", charset) == 0
+      || strcmp("utf-16be", charset) == 0
+      ;
+}
+
+static inline int
+charset_is_utf16le(char const* charset)
+{
+  return strcmp("utf16le",  charset) == 0
+      || strcmp("utf_16le", charset) == 0
+      || strcmp("utf-16le", charset) == 0
+      ;
+}
+
+static inline int
+charset_is_ascii(char const* charset)
+{
+  return strcmp("ascii", charset) == 0;
+}
+
+static rb_encoding*
+mecaby_decode_charset_to_encoding(char const* charset)
+{
+  VALUE vcharset = rb_external_str_new_with_enc(charset, strlen(charset), rb_usascii_encoding());
+
+  rb_funcall(vcharset, rb_intern("downcase!"), 0);
+
+  if (charset_is_shift_jis(RSTRING_PTR(vcharset))) {
+    return rb_enc_find("Windows-31J");
+  }
+  else if (charset_is_euc_jp(RSTRING_PTR(vcharset))) {
+    return rb_enc_find("EUC-JP");
+  }
+  else if (charset_is_utf8(RSTRING_PTR(vcharset))) {
+    return rb_utf8_encoding();
+  }
+  else if (charset_is_utf16(RSTRING_PTR(vcharset))) {
+    return rb_enc_find("UTF-16");
+  }
+  else if (charset_is_utf16be(RSTRING_PTR(vcharset))) {
+    return rb_enc_find("UTF-16BE");
+  }
+  else if (charset_is_utf16le(RSTRING_PTR(vcharset))) {
+    return rb_enc_find("UTF-16LE");
+  }
+  else if (charset_is_ascii(RSTRING_PTR(vcharset))) {
+    return rb_usascii_encoding();
+  }
+
+  return rb_utf8_encoding(); /* default is UTF-8 */
+}
+
+/*
+ * Memory accounting
+ *
+ * MeCab maps the dictionary files into memory, so the size of a model is
+ * the size of its files: the system and user dictionaries, and unk.dic,
+ * matrix.bin and char.bin next to the system dictionary.  The nodes and
+ * paths of a lattice are allocated from free lists which are kept until
+ * the lattice is destroyed, so a lattice holds the memory of its largest
+ * parse.
+ */
+
+static size_t
+mecaby_file_size(char const* path)
+{
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;
+
+  if (stat(path, &st) == 0) {
+    return (size_t)st.st_size;
+  }
+#endif
+  return 0;
+}
+
+static void
+mecaby_add_file_size(VALUE path, size_t* total, VALUE files)
+{
+  size_t size = mecaby_file_size(StringValueCStr(path));
+
+  if (size == 0) return;
+  *total += size;
+  if (!NIL_P(files)) {
+    rb_hash_aset(files, path, SIZET2NUM(size));
+  }
+}
+
+/*
+ * Returns the total size of the dictionary files, and stores the size of
+ * each file into the files Hash unless it is nil.
+ */
+static size_t
+mecaby_dictionary_bytes(mecab_dictionary_info_t const* info, VALUE files)
+{
+  static char const* const sys_files[] = { "unk.dic", "matrix.bin", "char.bin" };
+  size_t total = 0;
+
+  for (; info != NULL; info = info->next) {
+    mecaby_add_file_size(rb_str_new_cstr(info->filename), &total, files);
+
+    if (info->type == MECAB_SYS_DIC) {
+      int i;
+      char const* sep = strrchr(info->filename, '/');
+      long dirlen = sep ? sep - info->filename + 1 : 0;
+
+      for (i = 0; i < (int)(sizeof(sys_files) / sizeof(sys_files[0])); ++i) {
+        VALUE path = rb_str_new(info->filename, dirlen);
+        rb_str_cat_cstr(path, sys_files[i]);
+        mecaby_add_file_size(path, &total, files);
+      }
+    }
+  }
+
+  return total;
+}
+
+/*
+ * Returns the size of the nodes, the paths and the node tables of the
+ * last parse of the lattice.
+ */
+static size_t
+mecaby_lattice_arena_bytes(mecab_lattice_t* lattice)
+{
+  size_t i, n, bytes;
+  mecab_node_t** begin_nodes;
+
+  n = mecab_lattice_get_size(lattice);
+  bytes = 2 * (n + 4) * sizeof(mecab_node_t*);
+
+  begin_nodes = mecab_lattice_get_all_begin_nodes(lattice);
+  if (begin_nodes == NULL || !mecab_lattice_is_available(lattice)) {
+    return bytes;
+  }
+
+  for (i = 0; i <= n; ++i) {
+    mecab_node_t const* node;
+    for (node = begin_nodes[i]; node != NULL; node = node->bnext) {
+      mecab_path_t const* path;
+      bytes += sizeof(mecab_node_t);
+      for (path = node->lpath; path != NULL; path = path->lnext) {
+        bytes += sizeof(mecab_path_t);
+      }
+    }
+  }
+
+  return bytes;
+}
+
+#ifdef HAVE_MECAB_MODEL_NEW
+/*
+ * Prewarm
+ *
+ * The pages of the dictionary files are faulted in by the first parses
+ * after a model is loaded.  Prewarming maps each file once more and reads
+ * or advises its pages, which brings them into the page cache shared with
+ * MeCab's mapping.  In the mlock mode the mapping is kept locked until the
+ * model is destroyed, so that the pages stay resident.
+ */
+
+enum mecaby_prewarm_mode {
+  MECABY_PREWARM_TOUCH,
+  MECABY_PREWARM_WILLNEED,
+  MECABY_PREWARM_MLOCK
+};
+
+typedef struct mecaby_prewarm_file {
+  char* path;
+  size_t size;
+  int error_no;
+} mecaby_prewarm_file_t;
+
+typedef struct mecaby_prewarm {
+  enum mecaby_prewarm_mode mode;
+  mecaby_prewarm_file_t* files;
+  long nfiles;
+  size_t bytes;
+  size_t locked_bytes;
+  mecaby_mapping_t* locked;
+  double seconds;
+  volatile int canceled;
+} mecaby_prewarm_t;
+
+static void
+mecaby_mappings_release(mecaby_mapping_t* mapping)
+{
+  while (mapping != NULL) {
+    mecaby_mapping_t* next = mapping->next;
+#ifdef MECABY_USE_PREWARM
+    munmap(mapping->addr, mapping->size);
+#endif
+    free(mapping);
+    mapping = next;
+  }
+}
+
+static size_t
+mecaby_mappings_bytes(mecaby_mapping_t const* mapping)
+{
+  size_t bytes = 0;
+
+  for (; mapping != NULL; mapping = mapping->next) {
+    bytes += mapping->size;
+  }
+
+  return bytes;
+}
+
+static double
+mecaby_monotonic_seconds(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+#endif
+  return (double)time(NULL);
+}
+
+#ifdef MECABY_USE_PREWARM
+/*
+ * Reads a byte of each page.  The sum is volatile so that the reads are
+ * not optimized out.
+ */
+static void
+mecaby_prewarm_touch(unsigned char const* addr, size_t size, size_t pagesize)
+{
+  size_t off;
+  volatile unsigned char sum = 0;
+
+  for (off = 0; off < size; off += pagesize) {
+    sum += addr[off];
+  }
+  sum += addr[size - 1];
+}
+
+/*
+ * Prewarms the files.  Called without the GVL, so it must not allocate
+ * Ruby objects; the mappings are allocated by malloc and moved to the
+ * model by the caller.
+ */
+static void*
+mecaby_prewarm_run(void* ptr)
+{
+  long i;
+  mecaby_prewarm_t* pw = ptr;
+  long pagesize = sysconf(_SC_PAGESIZE);
+  double start = mecaby_monotonic_seconds();
+
+  if (pagesize <= 0) pagesize = 4096;
+
+  for (i = 0; i < pw->nfiles && !pw->canceled; ++i) {
+    int fd;
+    void* addr;
+    struct stat st;
+    mecaby_prewarm_file_t* file = &pw->files[i];
+
+    fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+      file->error_no = errno;
+      continue;
+    }
+    if (fstat(fd, &st) != 0) {
+      file->error_no = errno;
+      close(fd);
+      continue;
+    }
+    if (st.st_size == 0) {
+      close(fd);
+      continue;
+    }
+    file->size = (size_t)st.st_size;
+    addr = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      file->error_no = errno;
+      continue;
+    }
+
+    switch (pw->mode) {
+    case MECABY_PREWARM_MLOCK:
+#ifdef HAVE_MLOCK
+      if (mlock(addr, file->size) == 0) {
+        mecaby_mapping_t* mapping = malloc(sizeof(mecaby_mapping_t));
+        if (mapping != NULL) {
+          mapping->addr = addr;
+          mapping->size = file->size;
+          mapping->next = pw->locked;
+          pw->locked = mapping;
+          pw->locked_bytes += file->size;
+          pw->bytes += file->size;
+          continue;
+        }
+        file->error_no = ENOMEM;
+      }
+      else {
+        file->error_no = errno;
+      }
+#else
+      file->error_no = ENOSYS;
+#endif
+      /* not permitted: fall back to touching the pages */
+      mecaby_prewarm_touch(addr, file->size, pagesize);
+      break;
+    case MECABY_PREWARM_WILLNEED:
+#if defined(HAVE_MADVISE) && defined(MADV_WILLNEED)
+      if (madvise(addr, file->size, MADV_WILLNEED) == 0) break;
+#endif
+      mecaby_prewarm_touch(addr, file->size, pagesize);
+      break;
+    case MECABY_PREWARM_TOUCH:
+      mecaby_prewarm_touch(addr, file->size, pagesize);
+      break;
+    }
+    munmap(addr, file->size);
+    pw->bytes += file->size;
+  }
+
+  pw->seconds = mecaby_monotonic_seconds() - start;
+  return NULL;
+}
+
+/*
+ * Stops mecaby_prewarm_run before the next file.
+ */
+static void
+mecaby_prewarm_unblock(void* ptr)
+{
+  mecaby_prewarm_t* pw = ptr;
+
+  pw->canceled = 1;
+}
+#endif /* MECABY_USE_PREWARM */
+#endif /* HAVE_MECAB_MODEL_NEW */
+
+/*
+ * Typed data preparations
+ */
+
+#ifdef HAVE_MECAB_MODEL_NEW
+static mecaby_model_t*
+mecaby_model_retain(mecaby_model_t* model)
+{
+  MECABY_ATOMIC_INC(model->refcount);
+  return model;
+}
+
+static void
+mecaby_model_release(mecaby_model_t* model)
+{
+  if (MECABY_ATOMIC_FETCH_SUB(model->refcount, 1) > 1) return;
+
+  if (model->model != NULL) {
+    mecab_model_destroy(model->model);
+  }
+  mecaby_mappings_release(model->locked);
+  mecaby_feature_table_free(&model->features);
+  xfree(model);
+}
+
+static void
+mecaby_model_mark(void *ptr)
+{
+  mecaby_model_t* model = ptr;
+
+  if (model != NULL) {
+    mecaby_gc_mark_movable(model->arg);
+    mecaby_feature_table_mark(&model->features);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_model_compact(void *ptr)
+{
+  mecaby_model_t* model = ptr;
+
+  MECABY_GC_UPDATE(model->arg);
+  mecaby_feature_table_compact(&model->features);
+}
+#endif
+
+static void
+mecaby_model_free(void *ptr)
+{
+  mecaby_model_t* model = ptr;
+
+  if (model != NULL) {
+    if (model->model != NULL) {
+      mecaby_unregister_pointer(model->model);
+    }
+    model->arg = Qnil;
+    mecaby_model_release(model);
+  }
+}
+
+static size_t
+mecaby_model_memsize(void const *ptr)
+{
+  mecaby_model_t const* model = ptr;
+
+  return sizeof(mecaby_model_t) + model->dictionary_bytes + mecaby_feature_table_memsize(&model->features);
+}
+
+/*
+ * A frozen Model can be shared by Ractors.  Its arg is always frozen
+ * deeply, so Ractor.make_shareable(model) succeeds.
+ */
+static const rb_data_type_t mecaby_model_data_type = {
+  "Mecaby::Model",
+  {
+    mecaby_model_mark,
+    mecaby_model_free,
+    mecaby_model_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_model_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+# ifdef RUBY_TYPED_FROZEN_SHAREABLE
+  | RUBY_TYPED_FROZEN_SHAREABLE
+# endif
+#endif
+};
+
+#define MECABY_OBJ_IS_MODEL(obj) rb_typeddata_is_kind_of((obj), &mecaby_model_data_type)
+
+DEFINE_GETTER_AND_CHECKER(model, Model);
+
+static void
+mecaby_lattice_mark(void *ptr)
+{
+  mecaby_lattice_t* lattice = ptr;
+
+  if (lattice != NULL) {
+    mecaby_gc_mark_movable(lattice->generator);
+    /* pinned, because MeCab refers to the bytes of the sentence */
+    rb_gc_mark(lattice->sentence);
+    mecaby_node_pool_mark(lattice->node_pool);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_lattice_compact(void *ptr)
+{
+  mecaby_lattice_t* lattice = ptr;
+
+  MECABY_GC_UPDATE(lattice->generator);
+  mecaby_node_pool_compact(lattice->node_pool);
+}
+#endif
+
+static void
+mecaby_lattice_free(void *ptr)
+{
+  mecaby_lattice_t* lattice = ptr;
+
+  if (lattice != NULL) {
+    if (lattice->lattice != NULL) {
+      mecaby_unregister_pointer(lattice->lattice);
+      mecab_lattice_destroy(lattice->lattice);
+    }
+    if (lattice->model != NULL) {
+      MECABY_ATOMIC_DEC(lattice->model->nlattices);
+      mecaby_model_release(lattice->model);
+    }
+    if (lattice->offset_map != NULL) {
+      xfree(lattice->offset_map);
+    }
+    mecaby_node_pool_free(lattice->node_pool);
+    lattice->generator = Qnil;
+    xfree(lattice);
+  }
+}
+
+static size_t
+mecaby_lattice_memsize(void const *ptr)
+{
+  mecaby_lattice_t const* lattice = ptr;
+
+  return sizeof(mecaby_lattice_t) + lattice->arena_high_water;
+}
+
+static const rb_data_type_t mecaby_lattice_data_type = {
+  "Mecaby::Lattice",
+  {
+    mecaby_lattice_mark,
+    mecaby_lattice_free,
+    mecaby_lattice_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_lattice_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+#define MECABY_OBJ_IS_LATTICE(obj) rb_typeddata_is_kind_of((obj), &mecaby_lattice_data_type)
+
+DEFINE_GETTER_AND_CHECKER(lattice, Lattice);
+
+static mecaby_lattice_t*
+check_get_lattice_idle(VALUE obj, VALUE err)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(obj, err);
+
+  if (lattice->busy) {
+    rb_raise(mecaby_eError, "the lattice is busy with parse_async");
+  }
+
+  return lattice;
+}
+#endif /* HAVE_MECAB_MODEL_NEW */
+
+static void
+mecaby_tagger_mark(void *ptr)
+{
+  mecaby_tagger_t* tagger = ptr;
+
+  if (tagger != NULL) {
+    mecaby_gc_mark_movable(tagger->generator);
+    mecaby_gc_mark_movable(tagger->fast_path_feature);
+    mecaby_node_pool_mark(tagger->node_pool);
+    mecaby_feature_table_mark(&tagger->features);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_tagger_compact(void *ptr)
+{
+  mecaby_tagger_t* tagger = ptr;
+
+  MECABY_GC_UPDATE(tagger->generator);
+  MECABY_GC_UPDATE(tagger->fast_path_feature);
+  mecaby_node_pool_compact(tagger->node_pool);
+  mecaby_feature_table_compact(&tagger->features);
+}
+#endif
+
+static void
+mecaby_tagger_free(void *ptr)
+{
+  mecaby_tagger_t* tagger = ptr;
+
+  if (tagger != NULL) {
+    if (tagger->tagger != NULL) {
+      mecaby_unregister_pointer(tagger->tagger);
+      mecab_destroy(tagger->tagger);
+    }
+#ifdef HAVE_MECAB_MODEL_NEW
+    if (tagger->model != NULL) {
+      MECABY_ATOMIC_DEC(tagger->model->ntaggers);
+      mecaby_model_release(tagger->model);
+    }
+#endif
+    mecaby_feature_table_free(&tagger->features);
+    mecaby_node_pool_free(tagger->node_pool);
+    tagger->generator = Qnil;
+    xfree(tagger);
+  }
+}
+
+static size_t
+mecaby_tagger_memsize(void const *ptr)
+{
+  mecaby_tagger_t const* tagger = ptr;
+
+  return sizeof(mecaby_tagger_t) + mecaby_feature_table_memsize(&tagger->features);
+}
+
+static const rb_data_type_t mecaby_tagger_data_type = {
+  "mecaby::Tagger",
+  {
+    mecaby_tagger_mark,
+    mecaby_tagger_free,
+    mecaby_tagger_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_tagger_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+#define MECABY_OBJ_IS_TAGGER(obj) rb_typeddata_is_kind_of((obj), &mecaby_tagger_data_type)
+
+DEFINE_GETTER_AND_CHECKER(tagger, Tagger);
+
+/*
+ * Returns the feature table of the tagger with its field schema loaded.
+ */
+static mecaby_feature_table_t*
+mecaby_tagger_feature_table(mecaby_tagger_t* tagger)
+{
+  mecaby_feature_table_t* table = &tagger->features;
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (tagger->model != NULL) {
+    table = &tagger->model->features;
+  }
+#endif
+
+  mecaby_feature_table_load_field_names(table, mecab_dictionary_info(tagger->tagger));
+  return table;
+}
+
+#ifdef HAVE_MECAB_MODEL_NEW
+/*
+ * Records the arena size of the last parse of the lattice.  The arena
+ * grows with the sentence, so the nodes are walked only when the
+ * sentence is longer than any before and the other parses cost one
+ * comparison.  The high water mark of the model is a statistic, so
+ * races between threads are tolerated.
+ */
+static void
+mecaby_lattice_update_usage(mecaby_lattice_t* lattice)
+{
+  size_t bytes, size = mecab_lattice_get_size(lattice->lattice);
+
+  if (size <= lattice->size_high_water) return;
+  lattice->size_high_water = size;
+
+  bytes = mecaby_lattice_arena_bytes(lattice->lattice);
+  if (lattice->arena_high_water < bytes) {
+    lattice->arena_high_water = bytes;
+  }
+  if (lattice->model != NULL && lattice->model->lattice_high_water < bytes) {
+    lattice->model->lattice_high_water = bytes;
+  }
+}
+#endif
+
+static mecaby_tagger_t*
+check_get_tagger_idle(VALUE obj)
+{
+  mecaby_tagger_t* tagger = check_get_tagger_initialized(obj, rb_eRuntimeError);
+
+  if (tagger->busy) {
+    rb_raise(mecaby_eError, "the tagger is busy with parse_async");
+  }
+
+  return tagger;
+}
+
+static void
+mecaby_dictionary_info_mark(void *ptr)
+{
+  mecaby_dictionary_info_t* di = ptr;
+
+  if (di != NULL) {
+    mecaby_gc_mark_movable(di->generator);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_dictionary_info_compact(void *ptr)
+{
+  mecaby_dictionary_info_t* di = ptr;
+
+  MECABY_GC_UPDATE(di->generator);
+}
+#endif
+
+static void
+mecaby_dictionary_info_free(void *ptr)
+{
+  mecaby_dictionary_info_t* di = ptr;
+
+  if (di != NULL) {
+    if (di->dictionary_info != NULL) {
+      mecaby_unregister_pointer(di->dictionary_info);
+      /* shouldn't free di->dictionary_info pointer. */
+    }
+    di->generator = Qnil;
+    xfree(di);
+  }
+}
+
+static size_t
+mecaby_dictionary_info_memsize(void const *ptr)
+{
+  return sizeof(mecaby_dictionary_info_t);
+}
+
+static const rb_data_type_t mecaby_dictionary_info_data_type = {
+  "Mecaby::DictionaryInfo",
+  {
+    mecaby_dictionary_info_mark,
+    mecaby_dictionary_info_free,
+    mecaby_dictionary_info_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_dictionary_info_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+#define MECABY_OBJ_IS_DICTIONARY_INFO(obj) rb_typeddata_is_kind_of((obj), &mecaby_dictionary_info_data_type)
+
+DEFINE_GETTER_AND_CHECKER(dictionary_info, DictionaryInfo);
+
+static VALUE mecaby_create_dictionary_info(mecab_dictionary_info_t const*, VALUE);
+
+static void
+mecaby_node_mark(void *ptr)
+{
+  mecaby_node_t* node = ptr;
+  if (node != NULL) {
+    mecaby_gc_mark_movable(node->generator);
+    mecaby_gc_mark_movable(node->filter);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_node_compact(void *ptr)
+{
+  mecaby_node_t* node = ptr;
+
+  MECABY_GC_UPDATE(node->generator);
+  MECABY_GC_UPDATE(node->filter);
+}
+#endif
+
+static void
+mecaby_node_free(void *ptr)
+{
+  mecaby_node_t* node = ptr;
+  if (node != NULL) {
+    if (node->node && node->pool == NULL && NIL_P(node->filter)) {
+      mecaby_unregister_pointer(node->node);
+      /* shouldn't free node->node pointer. */
+    }
+    node->generator = Qnil;
+    xfree(node);
+  }
+}
+
+static size_t
+mecaby_node_memsize(void const *ptr)
+{
+  return sizeof(mecaby_node_t);
+}
+
+static const rb_data_type_t mecaby_node_data_type = {
+  "Mecaby::Node",
+  {
+    mecaby_node_mark,
+    mecaby_node_free,
+    mecaby_node_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_node_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+#define MECABY_OBJ_IS_NODE(obj) rb_typeddata_is_kind_of((obj), &mecaby_node_data_type)
+
+DEFINE_GETTER_AND_CHECKER(node, Node);
+
+static mecaby_node_t*
+check_get_node_alive(VALUE obj)
+{
+  mecaby_node_t* node = check_get_node_initialized(obj, rb_eRuntimeError);
+
+  if (node->pool != NULL && node->generation != node->pool->generation) {
+    rb_raise(mecaby_eError, "the node is stale because its tagger or lattice parsed again");
+  }
+
+  return node;
+}
+
+static VALUE mecaby_create_node(mecab_node_t const*, VALUE);
+static VALUE mecaby_create_filtered_node(mecab_node_t const*, VALUE, VALUE, struct mecaby_filter_bits*);
+static mecaby_feature_table_t* mecaby_feature_table_for(VALUE);
+
+static void
+mecaby_path_mark(void *ptr)
+{
+  mecaby_path_t* path = ptr;
+
+  if (path != NULL) {
+    mecaby_gc_mark_movable(path->generator);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_path_compact(void *ptr)
+{
+  mecaby_path_t* path = ptr;
+
+  MECABY_GC_UPDATE(path->generator);
+}
+#endif
+
+static void
+mecaby_path_free(void *ptr)
+{
+  mecaby_path_t* path = ptr;
+
+  if (path != NULL) {
+    if (path->path != NULL) {
+      mecaby_unregister_pointer(path->path);
+      /* shouldn't free path->path pointer. */
+    }
+    path->generator = Qnil;
+    xfree(path);
+  }
+}
+
+static size_t
+mecaby_path_memsize(void const *ptr)
+{
+  return sizeof(mecaby_path_t);
+}
+
+static const rb_data_type_t mecaby_path_data_type = {
+  "Mecaby::Path",
+  {
+    mecaby_path_mark,
+    mecaby_path_free,
+    mecaby_path_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_path_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+#define MECABY_OBJ_IS_PATH(obj) rb_typeddata_is_kind_of((obj), &mecaby_path_data_type)
+
+DEFINE_GETTER_AND_CHECKER(path, Path);
+
+/*
+ * Allocate methods
+ */
+
+#ifdef HAVE_MECAB_MODEL_NEW
+static VALUE
+mecaby_model_s_allocate(VALUE klass)
+{
+  mecaby_model_t* model;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_model_t, &mecaby_model_data_type, model);
+  model->arg = Qnil;
+  model->model = NULL;
+  model->refcount = 1;
+  model->ntaggers = 0;
+  model->nlattices = 0;
+  mecaby_feature_table_init(&model->features, obj);
+  model->dictionary_bytes = 0;
+  model->lattice_high_water = 0;
+  model->locked = NULL;
+  model->shared = 0;
+  return obj;
+}
+
+static VALUE
+mecaby_lattice_s_allocate(VALUE klass)
+{
+  mecaby_lattice_t* lattice;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_lattice_t, &mecaby_lattice_data_type, lattice);
+  lattice->generator = Qnil;
+  lattice->lattice = NULL;
+  lattice->model = NULL;
+  lattice->busy = 0;
+  lattice->sentence = Qnil;
+  lattice->offset_map = NULL;
+  lattice->size_high_water = 0;
+  lattice->arena_high_water = 0;
+  lattice->node_pool = NULL;
+  return obj;
+}
+#endif /* HAVE_MECAB_MODEL_NEW */
+
+static VALUE
+mecaby_tagger_s_allocate(VALUE klass)
+{
+  mecaby_tagger_t* tagger;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_tagger_t, &mecaby_tagger_data_type, tagger);
+  tagger->generator = Qnil;
+  tagger->tagger = NULL;
+#ifdef HAVE_MECAB_MODEL_NEW
+  tagger->model = NULL;
+#endif
+  tagger->busy = 0;
+  mecaby_feature_table_init(&tagger->features, obj);
+  tagger->fast_path_min_length = 0;
+  tagger->fast_path_feature = Qnil;
+  tagger->node_pool = NULL;
+  return obj;
+}
+
+static VALUE
+mecaby_dictionary_info_s_allocate(VALUE klass)
+{
+  mecaby_dictionary_info_t* di;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_dictionary_info_t, &mecaby_dictionary_info_data_type, di);
+  di->generator = Qnil;
+  di->dictionary_info = NULL;
+  return obj;
+}
+
+static VALUE
+mecaby_node_s_allocate(VALUE klass)
+{
+  mecaby_node_t* node;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_node_t, &mecaby_node_data_type, node);
+  node->generator = Qnil;
+  node->node = NULL;
+  node->features = NULL;
+  node->pool = NULL;
+  node->generation = 0;
+  node->filter = Qnil;
+  node->filter_bits = NULL;
+  return obj;
+}
+
+static VALUE
+mecaby_path_s_allocate(VALUE klass)
+{
+  mecaby_path_t* path;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_path_t, &mecaby_path_data_type, path);
+  path->generator = Qnil;
+  path->path = NULL;
+  return obj;
+}
+
+/*
+ * Structured output
+ *
+ * Serializes the best path of a node chain into JSON or MessagePack in
+ * one pass.  The result is an array of maps, one for each token, whose
+ * keys are the selected fields.  Strings are written in the dictionary
+ * encoding as they are.
+ */
+
+enum mecaby_output_format {
+  MECABY_FORMAT_TEXT,
+  MECABY_FORMAT_JSON,
+  MECABY_FORMAT_MSGPACK
+};
+
+enum mecaby_output_field {
+  MECABY_OUTPUT_SURFACE,
+  MECABY_OUTPUT_FEATURE,
+  MECABY_OUTPUT_POS,
+  MECABY_OUTPUT_BASE_FORM,
+  MECABY_OUTPUT_READING,
+  MECABY_OUTPUT_POSID,
+  MECABY_OUTPUT_STAT,
+  MECABY_OUTPUT_COST,
+  MECABY_OUTPUT_WCOST,
+  MECABY_OUTPUT_OFFSET,
+  MECABY_OUTPUT_LENGTH,
+  MECABY_OUTPUT_MAX
+};
+
+static char const* const mecaby_output_field_names[MECABY_OUTPUT_MAX] = {
+  "surface",
+  "feature",
+  "pos",
+  "base_form",
+  "reading",
+  "posid",
+  "stat",
+  "cost",
+  "wcost",
+  "offset",
+  "length",
+};
+
+typedef struct mecaby_serializer {
+  VALUE buf;
+  long ntokens;
+  int counted;
+  enum mecaby_output_format format;
+  int nfields;
+  enum mecaby_output_field fields[MECABY_OUTPUT_MAX];
+  int field_index[MECABY_FIELD_MAX];
+  long const* offset_map;
+  rb_encoding* source;
+} mecaby_serializer_t;
+
+static void
+mecaby_serializer_init(mecaby_serializer_t* ser, VALUE opts, mecaby_feature_table_t* table)
+{
+  int i;
+  VALUE vformat, vfields;
+
+  ser->buf = Qnil;
+  ser->format = MECABY_FORMAT_TEXT;
+  ser->nfields = 0;
+  ser->offset_map = NULL;
+  ser->source = NULL;
+  for (i = 0; i < MECABY_FIELD_MAX; ++i) {
+    ser->field_index[i] = table ? table->field_index[i] : mecaby_default_field_index[i];
+  }
+
+  if (NIL_P(opts)) return;
+
+  vformat = rb_hash_lookup2(opts, ID2SYM(rb_intern("format")), Qnil);
+  if (!NIL_P(vformat)) {
+    VALUE name = rb_obj_as_string(vformat);
+    char const* format = StringValueCStr(name);
+
+    if (strcmp(format, "text") == 0) {
+      ser->format = MECABY_FORMAT_TEXT;
+    }
+    else if (strcmp(format, "json") == 0) {
+      ser->format = MECABY_FORMAT_JSON;
+    }
+    else if (strcmp(format, "msgpack") == 0) {
+      ser->format = MECABY_FORMAT_MSGPACK;
+    }
+    else {
+      rb_raise(rb_eArgError, "unknown format: %"PRIsVALUE, rb_inspect(vformat));
+    }
+  }
+
+  vfields = rb_hash_lookup2(opts, ID2SYM(rb_intern("fields")), Qnil);
+  if (NIL_P(vfields)) {
+    ser->fields[ser->nfields++] = MECABY_OUTPUT_SURFACE;
+    ser->fields[ser->nfields++] = MECABY_OUTPUT_FEATURE;
+    return;
+  }
+
+  vfields = rb_convert_type(vfields, T_ARRAY, "Array", "to_ary");
+  for (i = 0; i < RARRAY_LEN(vfields); ++i) {
+    int j;
+    VALUE name = rb_obj_as_string(RARRAY_AREF(vfields, i));
+
+    for (j = 0; j < MECABY_OUTPUT_MAX; ++j) {
+      if (strcmp(StringValueCStr(name), mecaby_output_field_names[j]) == 0) break;
+    }
+    if (j == MECABY_OUTPUT_MAX) {
+      rb_raise(rb_eArgError, "unknown field: %"PRIsVALUE, rb_inspect(RARRAY_AREF(vfields, i)));
+    }
+    if (ser->nfields == MECABY_OUTPUT_MAX) {
+      rb_raise(rb_eArgError, "too many fields");
+    }
+    ser->fields[ser->nfields++] = (enum mecaby_output_field)j;
+  }
+}
+
+/*
+ * JSON and MessagePack strings are UTF-8, so the strings of a dictionary
+ * in another charset are transcoded as they are written.
+ */
+static void
+mecaby_serializer_set_dictionary(mecaby_serializer_t* ser, mecab_dictionary_info_t const* info)
+{
+  rb_encoding* enc;
+
+  if (info == NULL || info->charset == NULL) return;
+
+  enc = mecaby_decode_charset_to_encoding(info->charset);
+  if (enc != rb_utf8_encoding() && enc != rb_usascii_encoding()) {
+    ser->source = enc;
+  }
+}
+
+static void
+mecaby_serializer_put_byte(mecaby_serializer_t* ser, unsigned char c)
+{
+  rb_str_buf_cat(ser->buf, (char const*)&c, 1);
+}
+
+static void
+mecaby_serializer_put_be(mecaby_serializer_t* ser, unsigned char tag, unsigned LONG_LONG n, int size)
+{
+  int i;
+  unsigned char bytes[9];
+
+  bytes[0] = tag;
+  for (i = 0; i < size; ++i) {
+    bytes[size - i] = (unsigned char)(n >> (8 * i));
+  }
+  rb_str_buf_cat(ser->buf, (char const*)bytes, size + 1);
+}
+
+static void
+mecaby_msgpack_put_header(mecaby_serializer_t* ser, size_t n, unsigned char fix, size_t fixmax,
+                          unsigned char tag8, unsigned char tag16, unsigned char tag32)
+{
+  if (n < fixmax) {
+    mecaby_serializer_put_byte(ser, (unsigned char)(fix | n));
+  }
+  else if (tag8 != 0 && n < 0x100) {
+    mecaby_serializer_put_be(ser, tag8, n, 1);
+  }
+  else if (n < 0x10000) {
+    mecaby_serializer_put_be(ser, tag16, n, 2);
+  }
+  else {
+    mecaby_serializer_put_be(ser, tag32, n, 4);
+  }
+}
+
+static void
+mecaby_serializer_begin_array(mecaby_serializer_t* ser, size_t n)
+{
+  if (ser->format == MECABY_FORMAT_JSON) {
+    mecaby_serializer_put_byte(ser, '[');
+  }
+  else {
+    mecaby_msgpack_put_header(ser, n, 0x90, 16, 0, 0xdc, 0xdd);
+  }
+}
+
+static void
+mecaby_serializer_end_array(mecaby_serializer_t* ser)
+{
+  if (ser->format == MECABY_FORMAT_JSON) {
+    mecaby_serializer_put_byte(ser, ']');
+  }
+}
+
+static void
+mecaby_serializer_begin_map(mecaby_serializer_t* ser, size_t n, int first)
+{
+  if (ser->format == MECABY_FORMAT_JSON) {
+    rb_str_buf_cat(ser->buf, first ? "{" : ",{", first ? 1 : 2);
+  }
+  else {
+    mecaby_msgpack_put_header(ser, n, 0x80, 16, 0, 0xde, 0xdf);
+  }
+}
+
+static void
+mecaby_serializer_end_map(mecaby_serializer_t* ser)
+{
+  if (ser->format == MECABY_FORMAT_JSON) {
+    mecaby_serializer_put_byte(ser, '}');
+  }
+}
+
+/*
+ * Writes a string.  When unquote is true, the string is a quoted CSV
+ * field without the outer quotes, and "" in it is written as ".
+ */
+static void
+mecaby_serializer_put_str(mecaby_serializer_t* ser, char const* p, size_t len, int unquote)
+{
+  volatile VALUE converted = Qnil;
+  char const* end = p + len;
+
+  if (ser->source != NULL) {
+    char const* q = p;
+
+    while (q < end && (unsigned char)*q < 0x80) ++q;
+    if (q < end || !rb_enc_asciicompat(ser->source)) {
+      converted = rb_str_conv_enc_opts(rb_enc_str_new(p, len, ser->source), ser->source, rb_utf8_encoding(),
+                                       ECONV_INVALID_REPLACE | ECONV_UNDEF_REPLACE, Qnil);
+      p = RSTRING_PTR(converted);
+      len = RSTRING_LEN(converted);
+      end = p + len;
+    }
+  }
+
+  if (ser->format == MECABY_FORMAT_MSGPACK) {
+    size_t n = len;
+    char const* q;
+
+    if (unquote) {
+      for (q = p; q + 1 < end; ++q) {
+        if (q[0] == '"' && q[1] == '"') {
+          --n;
+          ++q;
+        }
+      }
+    }
+    mecaby_msgpack_put_header(ser, n, 0xa0, 32, 0xd9, 0xda, 0xdb);
+    if (n == len) {
+      rb_str_buf_cat(ser->buf, p, len);
+      return;
+    }
+  }
+  else {
+    mecaby_serializer_put_byte(ser, '"');
+  }
+
+  while (p < end) {
+    char const* q = p;
+    unsigned char c;
+
+    while (q < end && (unsigned char)*q >= 0x20 && *q != '"' && *q != '\\') ++q;
+    rb_str_buf_cat(ser->buf, p, q - p);
+    if (q == end) break;
+
+    c = (unsigned char)*q;
+    p = q + 1;
+    if (unquote && c == '"' && p < end && *p == '"') {
+      ++p;
+    }
+    if (ser->format == MECABY_FORMAT_MSGPACK) {
+      mecaby_serializer_put_byte(ser, c);
+    }
+    else if (c == '"' || c == '\\') {
+      char escaped[2] = { '\\', (char)c };
+      rb_str_buf_cat(ser->buf, escaped, 2);
+    }
+    else {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      rb_str_buf_cat(ser->buf, escaped, 6);
+    }
+  }
+
+  if (ser->format == MECABY_FORMAT_JSON) {
+    mecaby_serializer_put_byte(ser, '"');
+  }
+}
+
+static void
+mecaby_serializer_put_nil(mecaby_serializer_t* ser)
+{
+  if (ser->format == MECABY_FORMAT_JSON) {
+    rb_str_buf_cat(ser->buf, "null", 4);
+  }
+  else {
+    mecaby_serializer_put_byte(ser, 0xc0);
+  }
+}
+
+static void
+mecaby_serializer_put_int(mecaby_serializer_t* ser, long n)
+{
+  if (ser->format == MECABY_FORMAT_JSON) {
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "%ld", n);
+    rb_str_buf_cat(ser->buf, digits, len);
+  }
+  else if (0 <= n && n < 0x80) {
+    mecaby_serializer_put_byte(ser, (unsigned char)n);
+  }
+  else if (-32 <= n && n < 0) {
+    mecaby_serializer_put_byte(ser, (unsigned char)(0xe0 | (n + 32)));
+  }
+  else if (-0x80000000L <= n && n <= 0x7fffffffL) {
+    mecaby_serializer_put_be(ser, 0xd2, (unsigned LONG_LONG)(LONG_LONG)n, 4);
+  }
+  else {
+    mecaby_serializer_put_be(ser, 0xd3, (unsigned LONG_LONG)(LONG_LONG)n, 8);
+  }
+}
+
+static void
+mecaby_serializer_put_key(mecaby_serializer_t* ser, char const* key, int first)
+{
+  if (ser->format == MECABY_FORMAT_JSON && !first) {
+    mecaby_serializer_put_byte(ser, ',');
+  }
+  mecaby_serializer_put_str(ser, key, strlen(key), 0);
+  if (ser->format == MECABY_FORMAT_JSON) {
+    mecaby_serializer_put_byte(ser, ':');
+  }
+}
+
+static void
+mecaby_serializer_put_feature_field(mecaby_serializer_t* ser, char const* feature, int index)
+{
+  int i;
+  char const* p = feature;
+  char const* end = feature + strlen(feature);
+
+  for (i = 0; index >= 0; ++i) {
+    char const* q = mecaby_feature_field_end(p, end);
+    if (i == index) {
+      if (q - p >= 2 && *p == '"' && q[-1] == '"') {
+        mecaby_serializer_put_str(ser, p + 1, q - p - 2, 1);
+      }
+      else {
+        mecaby_serializer_put_str(ser, p, q - p, 0);
+      }
+      return;
+    }
+    if (q >= end) break;
+    p = q + 1;
+  }
+
+  mecaby_serializer_put_nil(ser);
+}
+
+static void
+mecaby_serializer_put_node(mecaby_serializer_t* ser, mecab_node_t const* node, long offset, int first)
+{
+  int i;
+
+  mecaby_serializer_begin_map(ser, ser->nfields, first);
+  for (i = 0; i < ser->nfields; ++i) {
+    enum mecaby_output_field field = ser->fields[i];
+
+    mecaby_serializer_put_key(ser, mecaby_output_field_names[field], i == 0);
+    switch (field) {
+      case MECABY_OUTPUT_SURFACE:
+        mecaby_serializer_put_str(ser, node->surface, node->length, 0);
+        break;
+      case MECABY_OUTPUT_FEATURE:
+        mecaby_serializer_put_str(ser, node->feature, strlen(node->feature), 0);
+        break;
+      case MECABY_OUTPUT_POS:
+        mecaby_serializer_put_feature_field(ser, node->feature, ser->field_index[MECABY_FIELD_POS]);
+        break;
+      case MECABY_OUTPUT_BASE_FORM:
+        mecaby_serializer_put_feature_field(ser, node->feature, ser->field_index[MECABY_FIELD_BASE_FORM]);
+        break;
+      case MECABY_OUTPUT_READING:
+        mecaby_serializer_put_feature_field(ser, node->feature, ser->field_index[MECABY_FIELD_READING]);
+        break;
+      case MECABY_OUTPUT_POSID:
+        mecaby_serializer_put_int(ser, node->posid);
+        break;
+      case MECABY_OUTPUT_STAT:
+        mecaby_serializer_put_int(ser, node->stat);
+        break;
+      case MECABY_OUTPUT_COST:
+        mecaby_serializer_put_int(ser, node->cost);
+        break;
+      case MECABY_OUTPUT_WCOST:
+        mecaby_serializer_put_int(ser, node->wcost);
+        break;
+      case MECABY_OUTPUT_OFFSET:
+        if (ser->offset_map) {
+          mecaby_serializer_put_int(ser, ser->offset_map[offset]);
+        }
+        else {
+          mecaby_serializer_put_int(ser, offset);
+        }
+        break;
+      case MECABY_OUTPUT_LENGTH:
+        if (ser->offset_map) {
+          mecaby_serializer_put_int(ser, ser->offset_map[offset + node->length] - ser->offset_map[offset]);
+        }
+        else {
+          mecaby_serializer_put_int(ser, node->length);
+        }
+        break;
+      default:
+        UNREACHABLE;
+    }
+  }
+  mecaby_serializer_end_map(ser);
+}
+
+static int
+mecaby_node_is_token(mecab_node_t const* node)
+{
+  return node->stat != MECAB_BOS_NODE && node->stat != MECAB_EOS_NODE;
+}
+
+/*
+ * Starts the output array.  When the number of tokens is not known yet,
+ * n is negative and the MessagePack header is written with a 32-bit
+ * count, which mecaby_serializer_finish fills in.
+ */
+static void
+mecaby_serializer_start(mecaby_serializer_t* ser, size_t capacity, long n)
+{
+  ser->buf = rb_str_buf_new(capacity);
+  ser->ntokens = 0;
+  ser->counted = n >= 0;
+  if (ser->format == MECABY_FORMAT_MSGPACK) {
+    rb_enc_associate(ser->buf, rb_ascii8bit_encoding());
+  }
+  else {
+    rb_enc_associate(ser->buf, rb_utf8_encoding());
+  }
+
+  if (ser->counted || ser->format == MECABY_FORMAT_JSON) {
+    mecaby_serializer_begin_array(ser, n);
+  }
+  else {
+    mecaby_serializer_put_be(ser, 0xdd, 0, 4);
+  }
+}
+
+static VALUE
+mecaby_serializer_finish(mecaby_serializer_t* ser)
+{
+  mecaby_serializer_end_array(ser);
+  if (!ser->counted && ser->format == MECABY_FORMAT_MSGPACK) {
+    unsigned char* p = (unsigned char*)RSTRING_PTR(ser->buf);
+    p[1] = (unsigned char)(ser->ntokens >> 24);
+    p[2] = (unsigned char)(ser->ntokens >> 16);
+    p[3] = (unsigned char)(ser->ntokens >> 8);
+    p[4] = (unsigned char)ser->ntokens;
+  }
+  return ser->buf;
+}
+
+static void
+mecaby_serializer_put_token(mecaby_serializer_t* ser, mecab_node_t const* node, long offset)
+{
+  mecaby_serializer_put_node(ser, node, offset, ser->ntokens == 0);
+  ++ser->ntokens;
+}
+
+/*
+ * Writes the tokens following the BOS node.  The byte offset of each
+ * token is the sum of base, the rlength of the preceding tokens and the
+ * leading white spaces of the token.
+ */
+static void
+mecaby_serializer_put_nodes(mecaby_serializer_t* ser, mecab_node_t const* bos, long base)
+{
+  long offset = base;
+  mecab_node_t const* node;
+
+  for (node = bos; node != NULL; node = node->next) {
+    if (!mecaby_node_is_token(node)) continue;
+
+    offset += node->rlength - node->length;
+    mecaby_serializer_put_token(ser, node, offset);
+    offset += node->length;
+  }
+}
+
+static VALUE
+mecaby_serialize_nodes(mecaby_serializer_t* ser, mecab_node_t const* bos)
+{
+  long n = 0;
+  size_t bytes = 0;
+  mecab_node_t const* node;
+
+  for (node = bos; node != NULL; node = node->next) {
+    if (mecaby_node_is_token(node)) {
+      ++n;
+      bytes += node->length + strlen(node->feature);
+    }
+  }
+
+  mecaby_serializer_start(ser, bytes + n * 16 * ser->nfields + 2, n);
+  mecaby_serializer_put_nodes(ser, bos, 0);
+
+  return mecaby_serializer_finish(ser);
+}
+
+/*
+ * Fast path
+ *
+ * When a tagger has the fast path, long runs of ASCII letters, ASCII
+ * digits or white spaces in the input are not given to MeCab.  Letters
+ * and digits are emitted directly as tokens with the configured feature,
+ * white spaces are skipped, and the spans between the runs are parsed by
+ * MeCab one by one.  Only the structured output formats use it.
+ */
+
+enum mecaby_char_class {
+  MECABY_CHAR_OTHER,
+  MECABY_CHAR_ALPHA,
+  MECABY_CHAR_DIGIT,
+  MECABY_CHAR_SPACE
+};
+
+static enum mecaby_char_class
+mecaby_char_class(unsigned char c)
+{
+  if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')) return MECABY_CHAR_ALPHA;
+  if ('0' <= c && c <= '9') return MECABY_CHAR_DIGIT;
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return MECABY_CHAR_SPACE;
+  return MECABY_CHAR_OTHER;
+}
+
+#ifdef MECABY_USE_SSE2
+/*
+ * Returns the bit mask of the 16 bytes at p which belong to the class.
+ * Bytes >= 0x80 are negative in the signed comparisons, so they never
+ * fall in the ranges.
+ */
+static int
+mecaby_char_class_mask16(char const* p, enum mecaby_char_class cls)
+{
+  __m128i x = _mm_loadu_si128((__m128i const*)p);
+  __m128i m;
+
+  switch (cls) {
+    case MECABY_CHAR_ALPHA:
+      x = _mm_or_si128(x, _mm_set1_epi8(0x20));
+      m = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)),
+                        _mm_cmplt_epi8(x, _mm_set1_epi8('z' + 1)));
+      break;
+    case MECABY_CHAR_DIGIT:
+      m = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+                        _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+      break;
+    case MECABY_CHAR_SPACE:
+      m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                                    _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))),
+                       _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+                                    _mm_cmpeq_epi8(x, _mm_set1_epi8('\r'))));
+      break;
+    default:
+      return 0;
+  }
+
+  return _mm_movemask_epi8(m);
+}
+#endif
+
+/*
+ * Returns the end of the run of the class starting at p.
+ */
+static char const*
+mecaby_char_class_run_end(char const* p, char const* end, enum mecaby_char_class cls)
+{
+#ifdef MECABY_USE_SSE2
+  while (end - p >= 16) {
+    int mask = mecaby_char_class_mask16(p, cls);
+    if (mask != 0xffff) {
+      return p + __builtin_ctz(~mask);
+    }
+    p += 16;
+  }
+#endif
+
+  while (p < end && mecaby_char_class((unsigned char)*p) == cls) ++p;
+
+  return p;
+}
+
+static void
+mecaby_tagger_put_span(mecaby_tagger_t* tagger, mecaby_serializer_t* ser,
+                       char const* p, char const* end, char const* start)
+{
+  mecab_node_t const* node;
+
+  if (p == end) return;
+
+  node = mecab_sparse_tonode2(tagger->tagger, p, end - p);
+  if (node == NULL) {
+    rb_raise(mecaby_eError, "%s", mecab_strerror(tagger->tagger));
+  }
+
+  mecaby_serializer_put_nodes(ser, node, p - start);
+}
+
+static void
+mecaby_tagger_put_run(mecaby_tagger_t* tagger, mecaby_serializer_t* ser,
+                      char const* p, char const* end, char const* start)
+{
+  mecab_node_t token;
+
+  memset(&token, 0, sizeof(token));
+  token.feature = RSTRING_PTR(tagger->fast_path_feature);
+  token.stat = MECAB_UNK_NODE;
+
+  /* the length of a node is unsigned short */
+  while (p < end) {
+    size_t len = end - p;
+    if (len > USHRT_MAX) len = USHRT_MAX;
+
+    token.surface = p;
+    token.length = token.rlength = (unsigned short)len;
+    mecaby_serializer_put_token(ser, &token, p - start);
+    p += len;
+  }
+}
+
+static VALUE
+mecaby_tagger_serialize_fast_path(mecaby_tagger_t* tagger, mecaby_serializer_t* ser,
+                                  char const* start, long len)
+{
+  char const* end = start + len;
+  char const* span = start;
+  char const* p = start;
+
+  mecaby_serializer_start(ser, len * 4 + 2, -1);
+
+  while (p < end) {
+    char const* q;
+    enum mecaby_char_class cls = mecaby_char_class((unsigned char)*p);
+
+    if (cls == MECABY_CHAR_OTHER) {
+      ++p;
+      continue;
+    }
+
+    q = mecaby_char_class_run_end(p, end, cls);
+    if ((size_t)(q - p) >= tagger->fast_path_min_length) {
+      mecaby_tagger_put_span(tagger, ser, span, p, start);
+      if (cls != MECABY_CHAR_SPACE) {
+        mecaby_tagger_put_run(tagger, ser, p, q, start);
+      }
+      span = q;
+    }
+    p = q;
+  }
+  mecaby_tagger_put_span(tagger, ser, span, end, start);
+
+  return mecaby_serializer_finish(ser);
+}
+
+/*
+ * Output buffers
+ *
+ * The into: option of Tagger#parse and Lattice#to_s lets MeCab write the
+ * text result straight into a String given by the caller instead of a
+ * new one.  The String is grown only when MeCab reports that the result
+ * does not fit, so a buffer reused across calls soon stops allocating.
+ * With append: true the result is written after the current contents.
+ */
+
+typedef char const* (*mecaby_output_writer_t)(void* arg, char* buf, size_t size);
+typedef char const* (*mecaby_output_strerror_t)(void* arg);
+
+enum {
+  MECABY_OUTPUT_BUFFER_MIN = 8192
+};
+
+/*
+ * Returns the String of the into: option, or nil, and stores whether
+ * the append: option is given.
+ */
+static VALUE
+mecaby_output_buffer_option(VALUE opts, int* append)
+{
+  VALUE buf;
+
+  *append = 0;
+  if (NIL_P(opts)) return Qnil;
+
+  buf = rb_hash_lookup2(opts, ID2SYM(rb_intern("into")), Qnil);
+  if (NIL_P(buf)) return Qnil;
+
+  Check_Type(buf, T_STRING);
+  rb_str_modify(buf);
+  *append = RTEST(rb_hash_lookup2(opts, ID2SYM(rb_intern("append")), Qfalse));
+
+  return buf;
+}
+
+/*
+ * Raises Encoding::CompatibilityError unless the text result, which is
+ * in the default external encoding, can be appended to the buffer.
+ */
+static void
+mecaby_output_buffer_check_encoding(VALUE buf)
+{
+  rb_encoding* enc = rb_enc_get(buf);
+  rb_encoding* external = rb_default_external_encoding();
+
+  if (enc == external || RSTRING_LEN(buf) == 0) return;
+
+  if (rb_enc_asciicompat(enc) && rb_enc_asciicompat(external) &&
+      rb_enc_str_coderange(buf) == ENC_CODERANGE_7BIT) {
+    rb_enc_associate(buf, external);
+    return;
+  }
+
+  rb_raise(rb_eEncCompatError, "incompatible character encodings: %s and %s",
+      rb_enc_name(enc), rb_enc_name(external));
+}
+
+/*
+ * Lets the writer fill the buffer after its contents, doubling the space
+ * while the writer fails with an overflow, and returns the buffer.
+ * Without append the result is then moved to the start.  The contents
+ * are neither overwritten nor truncated before a successful write, so
+ * the buffer keeps them when the writer fails otherwise.
+ */
+static VALUE
+mecaby_output_buffer_write(VALUE buf, int append, size_t hint,
+    mecaby_output_writer_t writer, mecaby_output_strerror_t strerror_func, void* arg)
+{
+  long offset = RSTRING_LEN(buf);
+  size_t size, length;
+  char const* output;
+
+  if (append) {
+    mecaby_output_buffer_check_encoding(buf);
+  }
+  if (hint < MECABY_OUTPUT_BUFFER_MIN) {
+    hint = MECABY_OUTPUT_BUFFER_MIN;
+  }
+  if ((size_t)(rb_str_capacity(buf) - offset) < hint) {
+    rb_str_modify_expand(buf, offset + hint - RSTRING_LEN(buf));
+  }
+
+  for (;;) {
+    size = rb_str_capacity(buf) - offset;
+    output = writer(arg, RSTRING_PTR(buf) + offset, size);
+    if (output != NULL) break;
+
+    output = strerror_func(arg);
+    if (output == NULL || strstr(output, "buffer overflow") == NULL) {
+      rb_raise(mecaby_eError, "%s", output ? output : "failed to write the result");
+    }
+    rb_str_modify_expand(buf, offset + size * 2 - RSTRING_LEN(buf));
+  }
+
+  length = strlen(output);
+  if (!append) {
+    memmove(RSTRING_PTR(buf), RSTRING_PTR(buf) + offset, length);
+    offset = 0;
+  }
+  if (offset == 0) {
+    rb_enc_associate(buf, rb_default_external_encoding());
+  }
+  rb_str_set_len(buf, offset + length);
+  ENC_CODERANGE_CLEAR(buf);
+
+  return buf;
+}
+
+/*
+ * Normalization
+ *
+ * Folds the input in one pass before analysis: fullwidth ASCII and the
+ * ideographic space become ASCII, halfwidth katakana become fullwidth
+ * with their voiced sound marks composed, as NFKC does, and ASCII
+ * letters are downcased.  Other characters are copied as they are.  The
+ * output is never longer than the input, and the offset map gives the
+ * byte offset in the input for each byte offset in the output.
+ */
+
+enum {
+  MECABY_NORMALIZE_WIDTH = 1,
+  MECABY_NORMALIZE_CASE = 2
+};
+
+/* Fullwidth katakana for U+FF61..U+FF9F */
+static unsigned short const mecaby_halfwidth_katakana[] = {
+  0x3002, 0x300C, 0x300D, 0x3001, 0x30FB, 0x30F2, 0x30A1, 0x30A3,
+  0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5, 0x30E7, 0x30C3, 0x30FC,
+  0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA, 0x30AB, 0x30AD, 0x30AF,
+  0x30B1, 0x30B3, 0x30B5, 0x30B7, 0x30B9, 0x30BB, 0x30BD, 0x30BF,
+  0x30C1, 0x30C4, 0x30C6, 0x30C8, 0x30CA, 0x30CB, 0x30CC, 0x30CD,
+  0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8, 0x30DB, 0x30DE, 0x30DF,
+  0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6, 0x30E8, 0x30E9, 0x30EA,
+  0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3, 0x3099, 0x309A,
+};
+
+/*
+ * Returns the flags given by the normalize: option: true or :all for
+ * both foldings, :width or :case for one of them.
+ */
+static int
+mecaby_normalize_flags(VALUE opts)
+{
+  VALUE v;
+  char const* name;
+
+  if (NIL_P(opts)) return 0;
+
+  v = rb_hash_lookup2(opts, ID2SYM(rb_intern("normalize")), Qnil);
+  if (!RTEST(v)) return 0;
+  if (v == Qtrue) return MECABY_NORMALIZE_WIDTH | MECABY_NORMALIZE_CASE;
+
+  v = rb_obj_as_string(v);
+  name = StringValueCStr(v);
+  if (strcmp(name, "all") == 0) return MECABY_NORMALIZE_WIDTH | MECABY_NORMALIZE_CASE;
+  if (strcmp(name, "width") == 0) return MECABY_NORMALIZE_WIDTH;
+  if (strcmp(name, "case") == 0) return MECABY_NORMALIZE_CASE;
+
+  rb_raise(rb_eArgError, "unknown normalization: %s", name);
+}
+
+static int
+mecaby_voiced_katakana(unsigned int base, unsigned int mark)
+{
+  if (mark == 0x3099) {
+    if (base == 0x30A6) return 0x30F4;
+    if (base == 0x30EF) return 0x30F7;
+    if (base == 0x30F2) return 0x30FA;
+    if ((0x30AB <= base && base <= 0x30C2 && (base & 1)) ||
+        (0x30C4 <= base && base <= 0x30C8 && !(base & 1)) ||
+        (0x30CF <= base && base <= 0x30DB && (base - 0x30CF) % 3 == 0)) {
+      return base + 1;
+    }
+  }
+  else if (0x30CF <= base && base <= 0x30DB && (base - 0x30CF) % 3 == 0) {
+    return base + 2;
+  }
+  return 0;
+}
+
+/*
+ * Returns the code point of the halfwidth katakana at p, or 0.
+ */
+static unsigned int
+mecaby_halfwidth_katakana_at(unsigned char const* p, unsigned char const* end)
+{
+  unsigned int cp;
+
+  if (end - p < 3 || p[0] != 0xEF) return 0;
+  cp = 0xF000 | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+  if (0xFF61 <= cp && cp <= 0xFF9F) return cp;
+  return 0;
+}
+
+static char*
+mecaby_put_utf8_3(char* q, unsigned int cp)
+{
+  q[0] = (char)(0xE0 | (cp >> 12));
+  q[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+  q[2] = (char)(0x80 | (cp & 0x3F));
+  return q + 3;
+}
+
+#ifdef MECABY_USE_SSE2
+/*
+ * Returns the length of the prefix of the 16 bytes at p which is copied
+ * as is: ASCII bytes, except uppercase letters when folding case.
+ */
+static int
+mecaby_normalize_plain16(char const* p, int flags)
+{
+  __m128i x = _mm_loadu_si128((__m128i const*)p);
+  int mask = _mm_movemask_epi8(x);
+
+  if (flags & MECABY_NORMALIZE_CASE) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    mask |= _mm_movemask_epi8(upper);
+  }
+
+  return mask == 0 ? 16 : __builtin_ctz(mask);
+}
+#endif
+
+/*
+ * Normalizes UTF-8 str of len bytes into out, and fills map with len + 1
+ * entries at most.  Returns the length of the output.
+ */
+static long
+mecaby_normalize_utf8(char const* str, long len, int flags, char* out, long* map)
+{
+  unsigned char const* const start = (unsigned char const*)str;
+  unsigned char const* const end = start + len;
+  unsigned char const* p = start;
+  char* q = out;
+
+  while (p < end) {
+    unsigned char const* src = p;
+    char* dst = q;
+    unsigned int cp;
+
+#ifdef MECABY_USE_SSE2
+    while (end - p >= 16) {
+      int n = mecaby_normalize_plain16((char const*)p, flags);
+      int i;
+      memcpy(q, p, n);
+      for (i = 0; i < n; ++i) {
+        map[q - out + i] = p - start + i;
+      }
+      p += n;
+      q += n;
+      if (n < 16) break;
+    }
+    if (p == end) break;
+    src = p;
+    dst = q;
+#endif
+
+    if (*p < 0x80) {
+      unsigned char c = *p++;
+      if ((flags & MECABY_NORMALIZE_CASE) && 'A' <= c && c <= 'Z') {
+        c += 'a' - 'A';
+      }
+      *q++ = (char)c;
+    }
+    else if (!(flags & MECABY_NORMALIZE_WIDTH)) {
+      *q++ = (char)*p++;
+    }
+    else if (end - p >= 3 && p[0] == 0xE3 && p[1] == 0x80 && p[2] == 0x80) {
+      /* U+3000 IDEOGRAPHIC SPACE */
+      *q++ = ' ';
+      p += 3;
+    }
+    else if (end - p >= 3 && p[0] == 0xEF &&
+             ((p[1] == 0xBC && p[2] >= 0x81) || (p[1] == 0xBD && p[2] <= 0x9E))) {
+      /* U+FF01..U+FF5E FULLWIDTH ASCII */
+      unsigned char c = (unsigned char)((((p[1] & 0x3F) << 6) | (p[2] & 0x3F)) - 0xF00 + 0x20);
+      if ((flags & MECABY_NORMALIZE_CASE) && 'A' <= c && c <= 'Z') {
+        c += 'a' - 'A';
+      }
+      *q++ = (char)c;
+      p += 3;
+    }
+    else if ((cp = mecaby_halfwidth_katakana_at(p, end)) != 0) {
+      unsigned int kana = mecaby_halfwidth_katakana[cp - 0xFF61];
+      unsigned int mark = mecaby_halfwidth_katakana_at(p + 3, end);
+      unsigned int voiced = 0;
+
+      if (mark == 0xFF9E || mark == 0xFF9F) {
+        voiced = mecaby_voiced_katakana(kana, mecaby_halfwidth_katakana[mark - 0xFF61]);
+      }
+      if (voiced) {
+        q = mecaby_put_utf8_3(q, voiced);
+        p += 6;
+      }
+      else {
+        q = mecaby_put_utf8_3(q, kana);
+        p += 3;
+      }
+    }
+    else {
+      *q++ = (char)*p++;
+      while (p < end && (*p & 0xC0) == 0x80) {
+        *q++ = (char)*p++;
+      }
+    }
+
+    for (; dst < q; ++dst) {
+      map[dst - out] = src - start;
+    }
+  }
+
+  map[q - out] = len;
+
+  return q - out;
+}
+
+/*
+ * Raises ArgumentError unless vstr is in UTF-8 or US-ASCII.
+ */
+static void
+mecaby_check_normalizable(VALUE vstr)
+{
+  rb_encoding* enc = rb_enc_get(vstr);
+
+  if (enc != rb_utf8_encoding() && enc != rb_usascii_encoding()) {
+    rb_raise(rb_eArgError, "normalize: requires UTF-8 input but %s is given", rb_enc_name(enc));
+  }
+}
+
+/*
+ * Returns the normalized String of vstr, and fills map, which has
+ * RSTRING_LEN(vstr) + 1 entries.  The caller checks vstr with
+ * mecaby_check_normalizable first.
+ */
+static VALUE
+mecaby_normalize(VALUE vstr, int flags, long* map)
+{
+  long len;
+  VALUE out;
+  rb_encoding* enc = rb_enc_get(vstr);
+
+  out = rb_str_buf_new(RSTRING_LEN(vstr));
+  len = mecaby_normalize_utf8(RSTRING_PTR(vstr), RSTRING_LEN(vstr), flags, RSTRING_PTR(out), map);
+  rb_str_set_len(out, len);
+  rb_enc_associate(out, enc);
+
+  return out;
+}
+
+/*
+ * Mecaby::Filter
+ *
+ * A token filter compiled once and applied in C by the token-producing
+ * methods, so rejected tokens never become Ruby objects.  POS prefixes
+ * are resolved to posids the first time each posid is seen, and the
+ * verdicts are kept in a bitset per system dictionary because posids are
+ * only meaningful within a dictionary.  A posid only determines the POS
+ * columns of the feature, so the verdicts are not cached when a prefix
+ * reaches past them.  Stopwords are a hashed set of surfaces.
+ */
+
+#define MECABY_POSID_MAX 0x10000
+#define MECABY_POS_COLUMNS 4
+#define MECABY_BIT_TEST(bits, i) ((bits)[(i) >> 3] & (1 << ((i) & 7)))
+#define MECABY_BIT_SET(bits, i) ((bits)[(i) >> 3] |= (unsigned char)(1 << ((i) & 7)))
+
+typedef struct mecaby_filter_bits {
+  unsigned char known[MECABY_POSID_MAX / 8];
+  unsigned char accepted[MECABY_POSID_MAX / 8];
+} mecaby_filter_bits_t;
+
+typedef struct mecaby_filter {
+  VALUE pos;
+  unsigned char* posids;
+  st_table* stopwords;
+  int unknown;
+  st_table* bits;
+  int initialized;
+} mecaby_filter_t;
+
+typedef struct mecaby_span {
+  char const* ptr;
+  long len;
+} mecaby_span_t;
+
+static int
+mecaby_span_cmp(st_data_t a, st_data_t b)
+{
+  mecaby_span_t const* x = (mecaby_span_t const*)a;
+  mecaby_span_t const* y = (mecaby_span_t const*)b;
+
+  return x->len != y->len || memcmp(x->ptr, y->ptr, x->len) != 0;
+}
+
+static st_index_t
+mecaby_span_hash(st_data_t a)
+{
+  mecaby_span_t const* x = (mecaby_span_t const*)a;
+
+  return rb_memhash(x->ptr, x->len);
+}
+
+static const struct st_hash_type mecaby_span_hash_type = {
+  mecaby_span_cmp,
+  mecaby_span_hash,
+};
+
+static int
+mecaby_filter_free_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  xfree((void*)key);
+  if (value != 0) {
+    xfree((void*)value);
+  }
+  return ST_CONTINUE;
+}
+
+static void
+mecaby_filter_mark(void *ptr)
+{
+  mecaby_filter_t* filter = ptr;
+
+  if (filter != NULL) {
+    mecaby_gc_mark_movable(filter->pos);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_filter_compact(void *ptr)
+{
+  mecaby_filter_t* filter = ptr;
+
+  MECABY_GC_UPDATE(filter->pos);
+}
+#endif
+
+static void
+mecaby_filter_free(void *ptr)
+{
+  mecaby_filter_t* filter = ptr;
+
+  if (filter != NULL) {
+    if (filter->posids != NULL) {
+      xfree(filter->posids);
+    }
+    if (filter->stopwords != NULL) {
+      st_foreach(filter->stopwords, mecaby_filter_free_i, 0);
+      st_free_table(filter->stopwords);
+    }
+    if (filter->bits != NULL) {
+      st_foreach(filter->bits, mecaby_filter_free_i, 0);
+      st_free_table(filter->bits);
+    }
+    xfree(filter);
+  }
+}
+
+static size_t
+mecaby_filter_memsize(void const *ptr)
+{
+  mecaby_filter_t const* filter = ptr;
+  size_t size = sizeof(mecaby_filter_t);
+
+  if (filter->posids != NULL) size += MECABY_POSID_MAX / 8;
+  if (filter->stopwords != NULL) size += st_memsize(filter->stopwords);
+  if (filter->bits != NULL) {
+    size += st_memsize(filter->bits) + filter->bits->num_entries * sizeof(mecaby_filter_bits_t);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t mecaby_filter_data_type = {
+  "Mecaby::Filter",
+  {
+    mecaby_filter_mark,
+    mecaby_filter_free,
+    mecaby_filter_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_filter_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+static mecaby_filter_t*
+check_get_filter(VALUE obj)
+{
+  if (!rb_typeddata_is_kind_of(obj, &mecaby_filter_data_type)) {
+    rb_raise(rb_eTypeError, "%"PRIsVALUE" object is required but %"PRIsVALUE" is given",
+             RB_CLASSNAME(mecaby_cFilter), RB_CLASSNAME(rb_obj_class(obj)));
+  }
+  return DATA_PTR(obj);
+}
+
+static VALUE
+mecaby_filter_s_allocate(VALUE klass)
+{
+  mecaby_filter_t* filter;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_filter_t, &mecaby_filter_data_type, filter);
+  filter->pos = Qnil;
+  filter->posids = NULL;
+  filter->stopwords = NULL;
+  filter->unknown = 1;
+  filter->bits = NULL;
+  filter->initialized = 0;
+  return obj;
+}
+
+static VALUE
+mecaby_filter_list(VALUE obj)
+{
+  VALUE ary = rb_check_array_type(obj);
+
+  if (!NIL_P(ary)) return ary;
+  if (rb_respond_to(obj, rb_intern("to_a")) && !RB_TYPE_P(obj, T_STRING)) {
+    return rb_convert_type(obj, T_ARRAY, "Array", "to_a");
+  }
+  return rb_ary_new3(1, obj);
+}
+
+/*
+ * Returns the POS prefixes of a String or a list as a frozen Array of
+ * frozen Strings in the default external encoding.
+ */
+static VALUE
+mecaby_pos_prefixes_new(VALUE list)
+{
+  long i;
+  VALUE prefixes;
+
+  list = mecaby_filter_list(list);
+  prefixes = rb_ary_new2(RARRAY_LEN(list));
+  for (i = 0; i < RARRAY_LEN(list); ++i) {
+    VALUE prefix = rb_str_export_to_enc(rb_obj_as_string(RARRAY_AREF(list, i)), rb_default_external_encoding());
+    rb_ary_push(prefixes, rb_str_new_frozen(prefix));
+  }
+
+  return rb_obj_freeze(prefixes);
+}
+
+/*
+ * Returns whether the feature starts with one of the POS prefixes, at
+ * the boundary of a field.
+ */
+static int
+mecaby_pos_prefixes_match(VALUE prefixes, char const* feature)
+{
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(prefixes); ++i) {
+    VALUE prefix = RARRAY_AREF(prefixes, i);
+    long len = RSTRING_LEN(prefix);
+
+    if (strncmp(feature, RSTRING_PTR(prefix), len) == 0 &&
+        (feature[len] == '\0' || feature[len] == ',' || (len > 0 && feature[len - 1] == ','))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Returns whether every prefix lies within the POS columns, so that the
+ * posid of a token determines whether it matches.
+ */
+static int
+mecaby_pos_prefixes_within_pos_columns(VALUE prefixes)
+{
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(prefixes); ++i) {
+    VALUE prefix = RARRAY_AREF(prefixes, i);
+    char const* p = RSTRING_PTR(prefix);
+    char const* end = p + RSTRING_LEN(prefix);
+    int columns = 1;
+
+    for (; p < end; ++p) {
+      if (*p == ',' && p + 1 < end) ++columns;
+    }
+    if (columns > MECABY_POS_COLUMNS) return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * call-seq:
+ *   Mecaby::Filter.new(pos: nil, posids: nil, stopwords: nil, unknown: true)
+ *
+ * Creates a filter which accepts a token when all of these hold:
+ *
+ * pos:       :: its feature starts with one of the POS prefixes, such as
+ *               "名詞" or "動詞,自立", or its posid is one of posids:.
+ * stopwords: :: its surface is not one of the stopwords.
+ * unknown:   :: it is not an unknown word, unless this is true.
+ */
+static VALUE
+mecaby_filter_initialize(int argc, VALUE* argv, VALUE self)
+{
+  long i;
+  VALUE opts, vpos, vposids, vstopwords, vunknown;
+  mecaby_filter_t* filter = check_get_filter(self);
+
+  if (filter->initialized) {
+    rb_raise(rb_eRuntimeError, "already initialized");
+  }
+  filter->initialized = 1;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  if (NIL_P(opts)) {
+    opts = rb_hash_new();
+  }
+  vpos = rb_hash_lookup2(opts, ID2SYM(rb_intern("pos")), Qnil);
+  vposids = rb_hash_lookup2(opts, ID2SYM(rb_intern("posids")), Qnil);
+  vstopwords = rb_hash_lookup2(opts, ID2SYM(rb_intern("stopwords")), Qnil);
+  vunknown = rb_hash_lookup2(opts, ID2SYM(rb_intern("unknown")), Qtrue);
+
+  if (!NIL_P(vpos)) {
+    RB_OBJ_WRITE(self, &filter->pos, mecaby_pos_prefixes_new(vpos));
+    if (mecaby_pos_prefixes_within_pos_columns(filter->pos)) {
+      filter->bits = st_init_strtable();
+    }
+  }
+
+  if (!NIL_P(vposids)) {
+    VALUE ary = mecaby_filter_list(vposids);
+    filter->posids = ZALLOC_N(unsigned char, MECABY_POSID_MAX / 8);
+    for (i = 0; i < RARRAY_LEN(ary); ++i) {
+      long posid = NUM2LONG(RARRAY_AREF(ary, i));
+      if (posid < 0 || posid >= MECABY_POSID_MAX) {
+        rb_raise(rb_eArgError, "posid out of range: %ld", posid);
+      }
+      MECABY_BIT_SET(filter->posids, posid);
+    }
+  }
+
+  if (!NIL_P(vstopwords)) {
+    VALUE ary = mecaby_filter_list(vstopwords);
+    filter->stopwords = st_init_table(&mecaby_span_hash_type);
+    for (i = 0; i < RARRAY_LEN(ary); ++i) {
+      VALUE word = rb_str_export_to_enc(rb_obj_as_string(RARRAY_AREF(ary, i)), rb_default_external_encoding());
+      mecaby_span_t* span = xmalloc(sizeof(mecaby_span_t) + RSTRING_LEN(word));
+      char* p = (char*)(span + 1);
+
+      memcpy(p, RSTRING_PTR(word), RSTRING_LEN(word));
+      span->ptr = p;
+      span->len = RSTRING_LEN(word);
+      if (st_lookup(filter->stopwords, (st_data_t)span, NULL)) {
+        xfree(span);
+      }
+      else {
+        st_insert(filter->stopwords, (st_data_t)span, 0);
+      }
+    }
+  }
+
+  filter->unknown = RTEST(vunknown);
+
+  return self;
+}
+
+/*
+ * Returns the verdict bitset of the filter for the dictionary, or NULL
+ * when the filter has no POS prefixes.
+ */
+static mecaby_filter_bits_t*
+mecaby_filter_bits_for(mecaby_filter_t* filter, mecab_dictionary_info_t const* info)
+{
+  st_data_t value;
+  char* key;
+
+  if (filter->bits == NULL) return NULL;
+
+  for (; info != NULL; info = info->next) {
+    if (info->type == MECAB_SYS_DIC) break;
+  }
+  if (info == NULL || info->filename == NULL) return NULL;
+
+  if (st_lookup(filter->bits, (st_data_t)info->filename, &value)) {
+    return (mecaby_filter_bits_t*)value;
+  }
+
+  key = ALLOC_N(char, strlen(info->filename) + 1);
+  strcpy(key, info->filename);
+  value = (st_data_t)ZALLOC(mecaby_filter_bits_t);
+  st_insert(filter->bits, (st_data_t)key, value);
+
+  return (mecaby_filter_bits_t*)value;
+}
+
+/*
+ * Returns whether the filter accepts the token.  MeCab gives the same
+ * posid to every POS missing from pos-id.def, so the verdicts of posid 0
+ * and of the unsigned -1 are not cached.
+ */
+static int
+mecaby_filter_accepts(mecaby_filter_t* filter, mecaby_filter_bits_t* bits, mecab_node_t const* node)
+{
+  if (!filter->unknown && node->stat == MECAB_UNK_NODE) {
+    return 0;
+  }
+
+  if (filter->posids != NULL || !NIL_P(filter->pos)) {
+    unsigned int posid = node->posid;
+    int accepted = 0;
+
+    if (filter->posids != NULL && MECABY_BIT_TEST(filter->posids, posid)) {
+      accepted = 1;
+    }
+    else if (!NIL_P(filter->pos)) {
+      if (bits != NULL && MECABY_BIT_TEST(bits->known, posid)) {
+        accepted = MECABY_BIT_TEST(bits->accepted, posid) != 0;
+      }
+      else {
+        accepted = mecaby_pos_prefixes_match(filter->pos, node->feature);
+        if (bits != NULL && posid != 0 && posid != MECABY_POSID_MAX - 1) {
+          MECABY_BIT_SET(bits->known, posid);
+          if (accepted) MECABY_BIT_SET(bits->accepted, posid);
+        }
+      }
+    }
+    if (!accepted) return 0;
+  }
+
+  if (filter->stopwords != NULL) {
+    mecaby_span_t span;
+    span.ptr = node->surface;
+    span.len = node->length;
+    if (st_lookup(filter->stopwords, (st_data_t)&span, NULL)) return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Returns the filter of the filter: option, or nil.
+ */
+static VALUE
+mecaby_filter_option(VALUE opts)
+{
+  VALUE vfilter;
+
+  if (NIL_P(opts)) return Qnil;
+
+  opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+  vfilter = rb_hash_lookup2(opts, ID2SYM(rb_intern("filter")), Qnil);
+  if (!NIL_P(vfilter)) {
+    check_get_filter(vfilter);
+  }
+
+  return vfilter;
+}
+
+/*
+ * Returns the verdict bitset of the filter for the dictionary of the
+ * tagger or the lattice.
+ */
+static mecaby_filter_bits_t*
+mecaby_filter_bind(VALUE vfilter, VALUE owner)
+{
+  mecab_dictionary_info_t const* info = NULL;
+
+  if (NIL_P(vfilter)) return NULL;
+
+  if (MECABY_OBJ_IS_TAGGER(owner)) {
+    info = mecab_dictionary_info(get_tagger(owner)->tagger);
+  }
+#ifdef HAVE_MECAB_MODEL_NEW
+  else if (MECABY_OBJ_IS_LATTICE(owner)) {
+    mecaby_lattice_t* lattice = get_lattice(owner);
+    if (lattice->model != NULL) {
+      info = mecab_model_dictionary_info(lattice->model->model);
+    }
+  }
+#endif
+
+  return mecaby_filter_bits_for(check_get_filter(vfilter), info);
+}
+
+/*
+ * call-seq:
+ *   filter.accept?(node) -> true or false
+ *
+ * Returns whether the filter accepts the node.  BOS and EOS nodes are
+ * always accepted.
+ */
+static VALUE
+mecaby_filter_is_accepted(VALUE self, VALUE vnode)
+{
+  mecaby_filter_t* filter = check_get_filter(self);
+  mecaby_node_t* node = check_get_node_alive(vnode);
+
+  if (!mecaby_node_is_token(node->node)) {
+    return Qtrue;
+  }
+
+  return mecaby_filter_accepts(filter, NULL, node->node) ? Qtrue : Qfalse;
+}
+
+/*
+ * Mecaby::Tokens
+ *
+ * A snapshot of the best path.  The token records and the surface and
+ * feature strings are copied into one block, so a Tokens object doesn't
+ * refer to the lattice or the tagger and stays valid after they parse
+ * again.
+ */
+
+typedef struct mecaby_token {
+  size_t surface;
+  size_t surface_length;
+  size_t feature;
+  long offset;
+  long cost;
+  unsigned short posid;
+  short wcost;
+  unsigned char stat;
+} mecaby_token_t;
+
+typedef struct mecaby_tokens {
+  mecaby_token_t* tokens;
+  size_t ntokens;
+  char const* blob;
+  size_t size;
+  int field_index[MECABY_FIELD_MAX];
+} mecaby_tokens_t;
+
+static void
+mecaby_tokens_free(void *ptr)
+{
+  xfree(ptr);
+}
+
+static size_t
+mecaby_tokens_memsize(void const *ptr)
+{
+  mecaby_tokens_t const* tokens = ptr;
+
+  return tokens->size;
+}
+
+static const rb_data_type_t mecaby_tokens_data_type = {
+  "Mecaby::Tokens",
+  {
+    NULL,
+    mecaby_tokens_free,
+    mecaby_tokens_memsize,
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+/* Tokens can't be allocated from Ruby, so they are always initialized */
+static mecaby_tokens_t*
+get_tokens(VALUE obj)
+{
+  mecaby_tokens_t* ptr;
+  TypedData_Get_Struct(obj, mecaby_tokens_t, &mecaby_tokens_data_type, ptr);
+  return ptr;
+}
+
+static mecaby_tokens_t*
+check_get_tokens(VALUE obj)
+{
+  if (!rb_typeddata_is_kind_of(obj, &mecaby_tokens_data_type)) {
+    rb_raise(rb_eTypeError, "%"PRIsVALUE" object is required but %"PRIsVALUE" is given",
+             RB_CLASSNAME(mecaby_cTokens), RB_CLASSNAME(rb_obj_class(obj)));
+  }
+  return DATA_PTR(obj);
+}
+
+/*
+ * Lays out the header, the records and the blob of n tokens in the
+ * block of the allocator, or returns NULL if it fails.  The block is
+ * freed as a whole.
+ */
+static mecaby_tokens_t*
+mecaby_tokens_alloc(size_t n, size_t blob_size, int const* field_index, void* (*alloc)(size_t))
+{
+  size_t header_size = sizeof(mecaby_tokens_t) + n * sizeof(mecaby_token_t);
+  mecaby_tokens_t* tokens = alloc(header_size + blob_size);
+
+  if (tokens == NULL) return NULL;
+
+  tokens->tokens = (mecaby_token_t*)(tokens + 1);
+  tokens->ntokens = n;
+  tokens->blob = (char*)tokens + header_size;
+  tokens->size = header_size + blob_size;
+  memcpy(tokens->field_index, field_index ? field_index : mecaby_default_field_index,
+         sizeof(tokens->field_index));
+
+  return tokens;
+}
+
+static size_t
+mecaby_tokens_blob_size(mecaby_tokens_t const* tokens)
+{
+  return tokens->size - (sizeof(mecaby_tokens_t) + tokens->ntokens * sizeof(mecaby_token_t));
+}
+
+/*
+ * Copies the tokens following the BOS node which the filter accepts, or
+ * all of them if it is NULL, into a block of the allocator.  This doesn't
+ * need the GVL when the filter is NULL and the allocator is malloc.
+ */
+static mecaby_tokens_t*
+mecaby_tokens_build(mecab_node_t const* bos, int const* field_index,
+                    mecaby_filter_t* filter, mecaby_filter_bits_t* bits, void* (*alloc)(size_t))
+{
+  size_t n = 0, blob_size = 0, i = 0;
+  long offset = 0;
+  char* blob;
+  mecaby_tokens_t* tokens;
+  mecab_node_t const* node;
+
+  for (node = bos; node != NULL; node = node->next) {
+    if (!mecaby_node_is_token(node)) continue;
+    if (filter != NULL && !mecaby_filter_accepts(filter, bits, node)) continue;
+    ++n;
+    blob_size += node->length + strlen(node->feature) + 2;
+  }
+
+  tokens = mecaby_tokens_alloc(n, blob_size, field_index, alloc);
+  if (tokens == NULL) return NULL;
+  blob = (char*)tokens->blob;
+
+  for (node = bos; node != NULL; node = node->next) {
+    mecaby_token_t* token;
+    size_t feature_length;
+
+    offset += node->rlength - node->length;
+    if (!mecaby_node_is_token(node)) {
+      offset += node->length;
+      continue;
+    }
+    if (filter != NULL && !mecaby_filter_accepts(filter, bits, node)) {
+      offset += node->length;
+      continue;
+    }
+
+    token = &tokens->tokens[i++];
+    token->offset = offset;
+    offset += node->length;
+
+    token->surface = blob - tokens->blob;
+    token->surface_length = node->length;
+    memcpy(blob, node->surface, node->length);
+    blob[node->length] = '\0';
+    blob += node->length + 1;
+
+    feature_length = strlen(node->feature);
+    token->feature = blob - tokens->blob;
+    memcpy(blob, node->feature, feature_length + 1);
+    blob += feature_length + 1;
+
+    token->cost = node->cost;
+    token->posid = node->posid;
+    token->wcost = node->wcost;
+    token->stat = node->stat;
+  }
+
+  return tokens;
+}
+
+/*
+ * Copies the tokens following the BOS node which the filter accepts, or
+ * all of them if it is NULL.  The schema of the feature fields is taken
+ * from the table, or the default one if it is NULL.
+ */
+static VALUE
+mecaby_tokens_new(mecab_node_t const* bos, mecaby_feature_table_t const* table,
+                  mecaby_filter_t* filter, mecaby_filter_bits_t* bits)
+{
+  mecaby_tokens_t* tokens = mecaby_tokens_build(bos, table ? table->field_index : NULL,
+                                                filter, bits, ruby_xmalloc);
+
+  return TypedData_Wrap_Struct(mecaby_cTokens, &mecaby_tokens_data_type, tokens);
+}
+
+/*
+ * Joins the tokens of the parts, each analyzed from the byte at its base
+ * of the whole text, into one Tokens whose offsets point into the text.
+ */
+static VALUE
+mecaby_tokens_join(mecaby_tokens_t const* const* parts, long const* bases, long nparts,
+                   int const* field_index)
+{
+  size_t n = 0, blob_size = 0, i = 0;
+  long j;
+  char* blob;
+  mecaby_tokens_t* tokens;
+
+  for (j = 0; j < nparts; ++j) {
+    n += parts[j]->ntokens;
+    blob_size += mecaby_tokens_blob_size(parts[j]);
+  }
+
+  tokens = mecaby_tokens_alloc(n, blob_size, field_index, ruby_xmalloc);
+  blob = (char*)tokens->blob;
+
+  for (j = 0; j < nparts; ++j) {
+    size_t k;
+    mecaby_tokens_t const* part = parts[j];
+    size_t part_blob_size = mecaby_tokens_blob_size(part);
+    size_t base = blob - tokens->blob;
+
+    for (k = 0; k < part->ntokens; ++k) {
+      mecaby_token_t* token = &tokens->tokens[i++];
+      *token = part->tokens[k];
+      token->surface += base;
+      token->feature += base;
+      token->offset += bases[j];
+    }
+    memcpy(blob, part->blob, part_blob_size);
+    blob += part_blob_size;
+  }
+
+  return TypedData_Wrap_Struct(mecaby_cTokens, &mecaby_tokens_data_type, tokens);
+}
+
+/*
+ * A part of a text analyzed separately: the tokens of the bytes from
+ * begin to end, whose offsets are relative to begin.
+ */
+typedef struct mecaby_tokens_part {
+  VALUE tokens;
+  long begin;
+  long end;
+} mecaby_tokens_part_t;
+
+/*
+ * Concatenates the tokens of the parts into one Tokens whose offsets
+ * point into the whole text.
+ */
+static VALUE
+mecaby_tokens_concat(mecaby_tokens_part_t const* parts, long nparts)
+{
+  long j;
+  VALUE vparts = 0, vbases = 0, result;
+  mecaby_tokens_t const** ptrs = ALLOCV_N(mecaby_tokens_t const*, vparts, nparts);
+  long* bases = ALLOCV_N(long, vbases, nparts);
+
+  for (j = 0; j < nparts; ++j) {
+    ptrs[j] = get_tokens(parts[j].tokens);
+    bases[j] = parts[j].begin;
+  }
+  result = mecaby_tokens_join(ptrs, bases, nparts, nparts > 0 ? ptrs[0]->field_index : NULL);
+  ALLOCV_END(vparts);
+  ALLOCV_END(vbases);
+
+  return result;
+}
+
+/*
+ * Returns the token at the index, which can be negative as Array, or NULL
+ * if it is out of range.
+ */
+static mecaby_token_t const*
+mecaby_tokens_at(VALUE self, VALUE vindex, mecaby_tokens_t** ptokens)
+{
+  long index = NUM2LONG(vindex);
+  mecaby_tokens_t* tokens = check_get_tokens(self);
+
+  if (ptokens != NULL) *ptokens = tokens;
+  if (index < 0) index += (long)tokens->ntokens;
+  if (index < 0 || (size_t)index >= tokens->ntokens) return NULL;
+
+  return &tokens->tokens[index];
+}
+
+static VALUE
+mecaby_tokens_size(VALUE self)
+{
+  mecaby_tokens_t* tokens = check_get_tokens(self);
+
+  return SIZET2NUM(tokens->ntokens);
+}
+
+static VALUE
+mecaby_tokens_is_empty(VALUE self)
+{
+  mecaby_tokens_t* tokens = check_get_tokens(self);
+
+  return tokens->ntokens == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE
+mecaby_tokens_surface(VALUE self, VALUE index)
+{
+  mecaby_tokens_t* tokens;
+  mecaby_token_t const* token = mecaby_tokens_at(self, index, &tokens);
+
+  if (token == NULL) return Qnil;
+
+  return rb_external_str_new_with_enc(tokens->blob + token->surface, token->surface_length,
+                                      rb_default_external_encoding());
+}
+
+static VALUE
+mecaby_tokens_feature(VALUE self, VALUE index)
+{
+  mecaby_tokens_t* tokens;
+  mecaby_token_t const* token = mecaby_tokens_at(self, index, &tokens);
+  char const* feature;
+
+  if (token == NULL) return Qnil;
+
+  feature = tokens->blob + token->feature;
+  return rb_external_str_new_with_enc(feature, strlen(feature), rb_default_external_encoding());
+}
+
+static VALUE
+mecaby_tokens_feature_field(VALUE self, VALUE index, enum mecaby_feature_field field)
+{
+  mecaby_tokens_t* tokens;
+  mecaby_token_t const* token = mecaby_tokens_at(self, index, &tokens);
+
+  if (token == NULL) return Qnil;
+
+  return mecaby_feature_field_at(tokens->blob + token->feature, tokens->field_index[field],
+                                 rb_default_external_encoding());
+}
+
+static VALUE
+mecaby_tokens_pos(VALUE self, VALUE index)
+{
+  return mecaby_tokens_feature_field(self, index, MECABY_FIELD_POS);
+}
+
+static VALUE
+mecaby_tokens_base_form(VALUE self, VALUE index)
+{
+  return mecaby_tokens_feature_field(self, index, MECABY_FIELD_BASE_FORM);
+}
+
+static VALUE
+mecaby_tokens_reading(VALUE self, VALUE index)
+{
+  return mecaby_tokens_feature_field(self, index, MECABY_FIELD_READING);
+}
+
+#define DEFINE_TOKENS_INTEGER_READER(name, conv) \
+static VALUE \
+mecaby_tokens_##name(VALUE self, VALUE index) \
+{ \
+  mecaby_token_t const* token = mecaby_tokens_at(self, index, NULL); \
+ \
+  return token == NULL ? Qnil : conv(token->name); \
+}
+
+DEFINE_TOKENS_INTEGER_READER(offset, LONG2NUM)
+DEFINE_TOKENS_INTEGER_READER(cost, LONG2NUM)
+DEFINE_TOKENS_INTEGER_READER(posid, INT2FIX)
+DEFINE_TOKENS_INTEGER_READER(wcost, INT2FIX)
+DEFINE_TOKENS_INTEGER_READER(stat, INT2FIX)
+
+#undef DEFINE_TOKENS_INTEGER_READER
+
+static VALUE
+mecaby_tokens_bytesize(VALUE self, VALUE index)
+{
+  mecaby_token_t const* token = mecaby_tokens_at(self, index, NULL);
+
+  return token == NULL ? Qnil : SIZET2NUM(token->surface_length);
+}
+
+static VALUE
+mecaby_tokens_surfaces(VALUE self)
+{
+  size_t i;
+  VALUE ary;
+  mecaby_tokens_t* tokens = check_get_tokens(self);
+
+  ary = rb_ary_new2(tokens->ntokens);
+  for (i = 0; i < tokens->ntokens; ++i) {
+    mecaby_token_t const* token = &tokens->tokens[i];
+    rb_ary_push(ary, rb_external_str_new_with_enc(tokens->blob + token->surface, token->surface_length,
+                                                  rb_default_external_encoding()));
+  }
+
+  return ary;
+}
+
+/*
+ * Yields the surface and the feature of each token.
+ */
+static VALUE
+mecaby_tokens_each(VALUE self)
+{
+  size_t i;
+  mecaby_tokens_t* tokens = check_get_tokens(self);
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  for (i = 0; i < tokens->ntokens; ++i) {
+    VALUE index = SIZET2NUM(i);
+    rb_yield_values(2, mecaby_tokens_surface(self, index), mecaby_tokens_feature(self, index));
+  }
+
+  return self;
+}
+
+/*
+ * Term frequencies
+ *
+ * A term is made of the fields of a token joined by "/".  Terms are
+ * counted in an st_table keyed by C strings, so a Ruby String is created
+ * only once for each distinct term when the result is converted to a
+ * Hash.
+ */
+
+typedef struct mecaby_term_counter {
+  int nfields;
+  enum mecaby_output_field fields[MECABY_OUTPUT_MAX];
+  int field_index[MECABY_FIELD_MAX];
+  VALUE pos_filter;
+  mecaby_filter_t* filter;
+  mecaby_filter_bits_t* filter_bits;
+  VALUE buf;
+  st_table* counts;
+} mecaby_term_counter_t;
+
+static void
+mecaby_term_counter_init(mecaby_term_counter_t* counter, VALUE opts, mecaby_feature_table_t* table)
+{
+  int i;
+  VALUE vfields = Qnil, vfilter = Qnil;
+
+  counter->nfields = 0;
+  counter->pos_filter = Qnil;
+  counter->filter = NULL;
+  counter->filter_bits = NULL;
+  counter->buf = Qnil;
+  counter->counts = NULL;
+  for (i = 0; i < MECABY_FIELD_MAX; ++i) {
+    counter->field_index[i] = table ? table->field_index[i] : mecaby_default_field_index[i];
+  }
+
+  if (!NIL_P(opts)) {
+    vfields = rb_hash_lookup2(opts, ID2SYM(rb_intern("fields")), Qnil);
+    vfilter = rb_hash_lookup2(opts, ID2SYM(rb_intern("pos_filter")), Qnil);
+  }
+
+  if (NIL_P(vfields)) {
+    counter->fields[counter->nfields++] = MECABY_OUTPUT_BASE_FORM;
+  }
+  else {
+    VALUE ary = rb_check_array_type(vfields);
+    if (NIL_P(ary)) {
+      ary = rb_ary_new3(1, vfields);
+    }
+    for (i = 0; i < RARRAY_LEN(ary); ++i) {
+      int j;
+      VALUE name = rb_obj_as_string(RARRAY_AREF(ary, i));
+
+      for (j = 0; j <= MECABY_OUTPUT_READING; ++j) {
+        if (strcmp(StringValueCStr(name), mecaby_output_field_names[j]) == 0) break;
+      }
+      if (j > MECABY_OUTPUT_READING) {
+        rb_raise(rb_eArgError, "unknown term field: %"PRIsVALUE, rb_inspect(RARRAY_AREF(ary, i)));
+      }
+      if (counter->nfields == MECABY_OUTPUT_MAX) {
+        rb_raise(rb_eArgError, "too many fields");
+      }
+      counter->fields[counter->nfields++] = (enum mecaby_output_field)j;
+    }
+    if (counter->nfields == 0) {
+      rb_raise(rb_eArgError, "no fields");
+    }
+  }
+
+  if (!NIL_P(vfilter)) {
+    counter->pos_filter = mecaby_pos_prefixes_new(vfilter);
+  }
+
+  counter->buf = rb_str_buf_new(64);
+  counter->counts = st_init_strtable();
+}
+
+static int
+mecaby_term_counter_free_key_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  xfree((char*)key);
+  return ST_DELETE;
+}
+
+static void
+mecaby_term_counter_clear(mecaby_term_counter_t* counter)
+{
+  if (counter->counts != NULL) {
+    st_foreach(counter->counts, mecaby_term_counter_free_key_i, 0);
+  }
+}
+
+static void
+mecaby_term_counter_free(mecaby_term_counter_t* counter)
+{
+  if (counter->counts != NULL) {
+    mecaby_term_counter_clear(counter);
+    st_free_table(counter->counts);
+    counter->counts = NULL;
+  }
+}
+
+/*
+ * Appends the field at the index of the feature to the term, without the
+ * CSV quotes.  Returns 0 if the field is missing or "*".
+ */
+static int
+mecaby_term_counter_put_feature_field(mecaby_term_counter_t* counter, char const* feature, int index)
+{
+  int i;
+  char const* p = feature;
+  char const* end = feature + strlen(feature);
+
+  for (i = 0; index >= 0; ++i) {
+    char const* q = mecaby_feature_field_end(p, end);
+    if (i == index) {
+      if (q == p || (q - p == 1 && *p == '*')) return 0;
+      if (q - p >= 2 && *p == '"' && q[-1] == '"') {
+        for (++p, --q; p < q; ++p) {
+          rb_str_buf_cat(counter->buf, p, 1);
+          if (*p == '"' && p + 1 < q && p[1] == '"') ++p;
+        }
+      }
+      else {
+        rb_str_buf_cat(counter->buf, p, q - p);
+      }
+      return 1;
+    }
+    if (q >= end) break;
+    p = q + 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Counts the term in one lookup: a new term is copied with the length
+ * given by arg.
+ */
+static int
+mecaby_term_counter_update_i(st_data_t* key, st_data_t* value, st_data_t arg, int existing)
+{
+  if (existing) {
+    ++*value;
+  }
+  else {
+    long len = (long)arg;
+    char* copy = ALLOC_N(char, len + 1);
+    memcpy(copy, (char const*)*key, len + 1);
+    *key = (st_data_t)copy;
+    *value = 1;
+  }
+
+  return ST_CONTINUE;
+}
+
+static void
+mecaby_term_counter_put_node(mecaby_term_counter_t* counter, mecab_node_t const* node)
+{
+  int i;
+
+  rb_str_set_len(counter->buf, 0);
+  for (i = 0; i < counter->nfields; ++i) {
+    int index = -1;
+
+    if (i > 0) {
+      rb_str_buf_cat(counter->buf, "/", 1);
+    }
+    switch (counter->fields[i]) {
+      case MECABY_OUTPUT_SURFACE:
+        rb_str_buf_cat(counter->buf, node->surface, node->length);
+        continue;
+      case MECABY_OUTPUT_FEATURE:
+        rb_str_buf_cat(counter->buf, node->feature, strlen(node->feature));
+        continue;
+      case MECABY_OUTPUT_POS:
+        index = counter->field_index[MECABY_FIELD_POS];
+        break;
+      case MECABY_OUTPUT_BASE_FORM:
+        index = counter->field_index[MECABY_FIELD_BASE_FORM];
+        break;
+      case MECABY_OUTPUT_READING:
+        index = counter->field_index[MECABY_FIELD_READING];
+        break;
+      default:
+        UNREACHABLE;
+    }
+    /* unknown words have no base form or reading; use the surface */
+    if (!mecaby_term_counter_put_feature_field(counter, node->feature, index)) {
+      rb_str_buf_cat(counter->buf, node->surface, node->length);
+    }
+  }
+
+  st_update(counter->counts, (st_data_t)StringValueCStr(counter->buf),
+            mecaby_term_counter_update_i, (st_data_t)RSTRING_LEN(counter->buf));
+}
+
+static void
+mecaby_term_counter_put_nodes(mecaby_term_counter_t* counter, mecab_node_t const* bos)
+{
+  mecab_node_t const* node;
+
+  for (node = bos; node != NULL; node = node->next) {
+    if (mecaby_node_is_token(node) && (NIL_P(counter->pos_filter) || mecaby_pos_prefixes_match(counter->pos_filter, node->feature)) &&
+        (counter->filter == NULL || mecaby_filter_accepts(counter->filter, counter->filter_bits, node))) {
+      mecaby_term_counter_put_node(counter, node);
+    }
+  }
+}
+
+static int
+mecaby_term_counter_to_hash_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  char const* term = (char const*)key;
+  VALUE str = rb_external_str_new_with_enc(term, strlen(term), rb_default_external_encoding());
+
+  rb_hash_aset((VALUE)arg, str, ULONG2NUM((unsigned long)value));
+  xfree((char*)key);
+  return ST_DELETE;
+}
+
+/*
+ * Returns the counts as a Hash of terms to counts, and clears them.
+ */
+static VALUE
+mecaby_term_counter_take(mecaby_term_counter_t* counter)
+{
+  VALUE hash = rb_hash_new();
+
+  st_foreach(counter->counts, mecaby_term_counter_to_hash_i, (st_data_t)hash);
+
+  return hash;
+}
+
+/*
+ * Parse jobs
+ *
+ * parse_async runs MeCab without the GVL.  When the current fiber has a
+ * scheduler, only the calling fiber waits: the scheduler's
+ * blocking_operation_wait hook offloads the job if it has one, otherwise
+ * the job runs on a native worker thread and the fiber waits for a pipe
+ * to become readable.  Without a scheduler the calling thread runs the
+ * job with the GVL released.  MeCab can't stop in the middle of a
+ * sentence, so an interrupt cancels a job which hasn't started yet and
+ * otherwise is raised when the running parse returns.
+ */
+
+typedef struct mecaby_parse_job {
+  mecab_t* tagger;
+#ifdef HAVE_MECAB_MODEL_NEW
+  mecab_lattice_t* lattice;
+#endif
+  char const* input;
+  size_t length;
+  char const* output;
+  int result;
+  int notify;
+  int skipped;
+  volatile int canceled;
+} mecaby_parse_job_t;
+
+static void*
+mecaby_parse_job_run(void* ptr)
+{
+  mecaby_parse_job_t* job = ptr;
+
+  if (job->canceled) {
+    job->skipped = 1;
+    job->result = 0;
+  }
+#ifdef HAVE_MECAB_MODEL_NEW
+  else if (job->lattice != NULL) {
+    job->result = mecab_parse_lattice(job->tagger, job->lattice);
+  }
+  else
+#endif
+  {
+    job->output = mecab_sparse_tostr2(job->tagger, job->input, job->length);
+    job->result = job->output != NULL;
+  }
+
+#ifdef MECABY_USE_PARSE_WORKER
+  if (job->notify >= 0) {
+    char c = 0;
+    while (write(job->notify, &c, 1) < 0 && errno == EINTR);
+  }
+#endif
+
+  return NULL;
+}
+
+static void
+mecaby_parse_job_unblock(void* ptr)
+{
+  mecaby_parse_job_t* job = ptr;
+
+  job->canceled = 1;
+}
+
+#ifdef MECABY_USE_PARSE_WORKER
+struct mecaby_parse_worker {
+  mecaby_parse_job_t* job;
+  pthread_t thread;
+  int fds[2];
+  VALUE io;
+};
+
+static VALUE
+mecaby_parse_worker_wait(VALUE ptr)
+{
+  struct mecaby_parse_worker* worker = (struct mecaby_parse_worker*)ptr;
+
+  worker->io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2NUM(worker->fds[0]));
+  rb_io_wait(worker->io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+
+  return Qnil;
+}
+
+static void*
+mecaby_parse_worker_join(void* ptr)
+{
+  struct mecaby_parse_worker* worker = ptr;
+
+  pthread_join(worker->thread, NULL);
+  return NULL;
+}
+
+static VALUE
+mecaby_parse_worker_ensure(VALUE ptr)
+{
+  struct mecaby_parse_worker* worker = (struct mecaby_parse_worker*)ptr;
+
+  /* the worker must finish even if the fiber is interrupted, because it
+     uses the tagger and the input string.  Canceling the job skips the
+     parse if the worker hasn't started it yet, so that the join waits
+     for one sentence at most. */
+  worker->job->canceled = 1;
+  rb_thread_call_without_gvl(mecaby_parse_worker_join, worker, mecaby_parse_job_unblock, worker->job);
+
+  if (NIL_P(worker->io)) {
+    close(worker->fds[0]);
+  }
+  else {
+    rb_io_close(worker->io);
+  }
+  close(worker->fds[1]);
+
+  return Qnil;
+}
+
+static int
+mecaby_run_parse_job_on_worker(mecaby_parse_job_t* job)
+{
+  struct mecaby_parse_worker worker;
+
+  if (pipe(worker.fds) != 0) {
+    rb_sys_fail("pipe");
+  }
+
+  worker.job = job;
+  worker.io = Qnil;
+  job->notify = worker.fds[1];
+
+  if (pthread_create(&worker.thread, NULL, mecaby_parse_job_run, job) != 0) {
+    close(worker.fds[0]);
+    close(worker.fds[1]);
+    job->notify = -1;
+    return 0;
+  }
+
+  rb_ensure(mecaby_parse_worker_wait, (VALUE)&worker, mecaby_parse_worker_ensure, (VALUE)&worker);
+  return 1;
+}
+#endif /* MECABY_USE_PARSE_WORKER */
+
+static void
+mecaby_run_parse_job_blocking(mecaby_parse_job_t* job)
+{
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  {
+    VALUE scheduler = rb_fiber_scheduler_current();
+
+    if (!NIL_P(scheduler)) {
+#ifdef RB_NOGVL_OFFLOAD_SAFE
+      if (rb_respond_to(scheduler, rb_intern("blocking_operation_wait"))) {
+        rb_nogvl(mecaby_parse_job_run, job, mecaby_parse_job_unblock, job, RB_NOGVL_OFFLOAD_SAFE);
+        return;
+      }
+#endif
+#ifdef MECABY_USE_PARSE_WORKER
+      if (mecaby_run_parse_job_on_worker(job)) {
+        return;
+      }
+#endif
+    }
+  }
+#endif
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(mecaby_parse_job_run, job, mecaby_parse_job_unblock, job);
+#else
+  mecaby_parse_job_run(job);
+#endif
+}
+
+static void
+mecaby_run_parse_job(mecaby_parse_job_t* job)
+{
+  job->notify = -1;
+  job->skipped = 0;
+  job->canceled = 0;
+
+  mecaby_run_parse_job_blocking(job);
+
+  if (job->skipped) {
+    /* raises the pending exception, if the interrupt has one */
+    rb_thread_check_ints();
+    rb_raise(rb_eInterrupt, "parse_async was interrupted");
+  }
+}
+
+struct mecaby_parse_async_args {
+  mecaby_tagger_t* tagger;
+#ifdef HAVE_MECAB_MODEL_NEW
+  mecaby_lattice_t* lattice;
+#endif
+  mecaby_parse_job_t job;
+};
+
+static VALUE
+mecaby_parse_async_body(VALUE ptr)
+{
+  struct mecaby_parse_async_args* args = (struct mecaby_parse_async_args*)ptr;
+
+  mecaby_run_parse_job(&args->job);
+
+  return Qnil;
+}
+
+static VALUE
+mecaby_parse_async_ensure(VALUE ptr)
+{
+  struct mecaby_parse_async_args* args = (struct mecaby_parse_async_args*)ptr;
+
+  args->tagger->busy = 0;
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (args->lattice != NULL) {
+    args->lattice->busy = 0;
+  }
+#endif
+
+  return Qnil;
+}
+
+/*
+ * Runs the parse job while the tagger and the lattice are marked busy,
+ * so that other fibers and threads can't use them meanwhile.
+ */
+static void
+mecaby_parse_async(struct mecaby_parse_async_args* args)
+{
+  args->tagger->busy = 1;
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (args->lattice != NULL) {
+    args->lattice->busy = 1;
+    mecaby_node_pool_advance(args->lattice->node_pool);
+  }
+  else
+#endif
+  mecaby_node_pool_advance(args->tagger->node_pool);
+
+  rb_ensure(mecaby_parse_async_body, (VALUE)args, mecaby_parse_async_ensure, (VALUE)args);
+}
+
+#ifdef HAVE_MECAB_MODEL_NEW
+static VALUE
+mecaby_parse_lattice_async(VALUE vtagger, VALUE vlattice)
+{
+  struct mecaby_parse_async_args args;
+
+  args.tagger = check_get_tagger_idle(vtagger);
+  args.lattice = check_get_lattice_idle(vlattice, rb_eArgError);
+  args.job.tagger = args.tagger->tagger;
+  args.job.lattice = args.lattice->lattice;
+  args.job.input = NULL;
+  args.job.length = 0;
+  args.job.output = NULL;
+
+  mecaby_parse_async(&args);
+  if (args.job.result) {
+    mecaby_lattice_update_usage(args.lattice);
+  }
+  RB_GC_GUARD(vtagger);
+  RB_GC_GUARD(vlattice);
+
+  return args.job.result ? Qtrue : Qfalse;
+}
+#endif
+
+/*
+ * Loading
+ *
+ * Loading a dictionary reads and maps its files, which takes a while for
+ * a large one.  The options are copied out of the Ruby strings into a
+ * load job so that MeCab can run without the GVL.  Model.load_async runs
+ * the job on a native thread; the thread and the Loader object share the
+ * job, and whichever releases it last frees it.
+ */
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+# define MECABY_USE_LOAD_THREAD 1
+#endif
+
+#define MECABY_LOAD_ERROR_SIZE 256
+
+typedef struct mecaby_load_job {
+  int argc;
+  char** argv;
+  char* str;
+  int tagger;
+  void* result;
+  char error[MECABY_LOAD_ERROR_SIZE];
+#ifdef MECABY_USE_LOAD_THREAD
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int refcount;
+  int done;
+#endif
+} mecaby_load_job_t;
+
+/*
+ * Creates a load job of a tagger or a model from nil, a String or an
+ * Array of Strings.  The job is allocated by malloc in a block because it
+ * may be freed by the loading thread.
+ */
+static mecaby_load_job_t*
+mecaby_load_job_new(VALUE arg, int tagger)
+{
+  long i, n = 0;
+  size_t size;
+  char* p;
+  mecaby_load_job_t* job;
+  VALUE ary = NIL_P(arg) ? Qnil : rb_check_array_type(arg);
+
+  if (NIL_P(arg)) {
+    size = sizeof("-C");
+  }
+  else if (NIL_P(ary)) {
+    StringValueCStr(arg);
+    size = RSTRING_LEN(arg) + 1;
+  }
+  else {
+    VALUE strs = rb_ary_new2(RARRAY_LEN(ary));
+    for (i = 0; i < RARRAY_LEN(ary); ++i) {
+      VALUE item = RARRAY_AREF(ary, i);
+      StringValueCStr(item);
+      rb_ary_push(strs, item);
+    }
+    ary = strs;
+    n = RARRAY_LEN(ary);
+    size = n * sizeof(char*);
+    for (i = 0; i < n; ++i) {
+      size += RSTRING_LEN(RARRAY_AREF(ary, i)) + 1;
+    }
+  }
+
+  job = malloc(sizeof(mecaby_load_job_t) + size);
+  if (job == NULL) {
+    rb_memerror();
+  }
+  job->tagger = tagger;
+  job->result = NULL;
+  job->error[0] = '\0';
+  p = (char*)(job + 1);
+  if (NIL_P(ary)) {
+    job->argc = -1;
+    job->argv = NULL;
+    job->str = p;
+    strcpy(p, NIL_P(arg) ? "-C" : RSTRING_PTR(arg));
+  }
+  else {
+    job->argc = (int)n;
+    job->argv = (char**)p;
+    job->str = NULL;
+    p += n * sizeof(char*);
+    for (i = 0; i < n; ++i) {
+      VALUE item = RARRAY_AREF(ary, i);
+      job->argv[i] = p;
+      strcpy(p, RSTRING_PTR(item));
+      p += RSTRING_LEN(item) + 1;
+    }
+  }
+
+#ifdef MECABY_USE_LOAD_THREAD
+  pthread_mutex_init(&job->mutex, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  job->refcount = 1;
+  job->done = 0;
+#endif
+
+  return job;
+}
+
+static void*
+mecaby_load_job_run(void* ptr)
+{
+  mecaby_load_job_t* job = ptr;
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (!job->tagger) {
+    job->result = job->argc < 0 ? mecab_model_new2(job->str) : mecab_model_new(job->argc, job->argv);
+  }
+  else
+#endif
+  {
+    job->result = job->argc < 0 ? mecab_new2(job->str) : mecab_new(job->argc, job->argv);
+  }
+
+  if (job->result == NULL) {
+    char const* error = mecab_strerror(NULL);
+    strncpy(job->error, error ? error : "", MECABY_LOAD_ERROR_SIZE - 1);
+    job->error[MECABY_LOAD_ERROR_SIZE - 1] = '\0';
+  }
+
+  return NULL;
+}
+
+/*
+ * Runs the job on the calling thread with the GVL released.
+ */
+static void
+mecaby_load_job_call(mecaby_load_job_t* job)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(mecaby_load_job_run, job, NULL, NULL);
+#else
+  mecaby_load_job_run(job);
+#endif
+}
+
+/*
+ * Releases the job.  A result nobody has taken is destroyed with it.
+ * Called with or without the GVL.
+ */
+static void
+mecaby_load_job_release(mecaby_load_job_t* job)
+{
+#ifdef MECABY_USE_LOAD_THREAD
+  int refcount;
+
+  pthread_mutex_lock(&job->mutex);
+  refcount = --job->refcount;
+  pthread_mutex_unlock(&job->mutex);
+  if (refcount > 0) return;
+
+  pthread_mutex_destroy(&job->mutex);
+  pthread_cond_destroy(&job->cond);
+#endif
+
+  if (job->result != NULL) {
+#ifdef HAVE_MECAB_MODEL_NEW
+    if (!job->tagger) {
+      mecab_model_destroy(job->result);
+    }
+    else
+#endif
+    {
+      mecab_destroy(job->result);
+    }
+  }
+  free(job);
+}
+
+static void
+mecaby_load_job_raise(mecaby_load_job_t* job, char const* func)
+{
+  char error[MECABY_LOAD_ERROR_SIZE];
+
+  memcpy(error, job->error, MECABY_LOAD_ERROR_SIZE);
+  mecaby_load_job_release(job);
+  if (strstr(error, "load_dictionary_resource")) {
+    rb_raise(mecaby_eDictNotFound, "%s:%d: %s: %s", __FILE__, __LINE__, func, error);
+  }
+  else {
+    rb_raise(rb_eRuntimeError, "%s:%d: %s: %s", __FILE__, __LINE__, func, error);
+  }
+}
+
+/*
+ * Loads a tagger or a model without the GVL, and returns it or raises
+ * the error of MeCab.
+ */
+static void*
+mecaby_load(VALUE arg, int tagger, char const* func)
+{
+  void* result;
+  mecaby_load_job_t* job = mecaby_load_job_new(arg, tagger);
+
+  mecaby_load_job_call(job);
+  if (job->result == NULL) {
+    mecaby_load_job_raise(job, func);
+  }
+
+  result = job->result;
+  job->result = NULL;
+  mecaby_load_job_release(job);
+
+  return result;
+}
+
+#ifdef HAVE_MECAB_MODEL_NEW
+/*
+ * Mecaby::Model
+ */
+
+static VALUE mecaby_model_prewarm_with(VALUE, enum mecaby_prewarm_mode);
+
+static enum mecaby_prewarm_mode
+mecaby_prewarm_mode_from(VALUE vmode)
+{
+  VALUE name;
+  char const* mode;
+
+  if (NIL_P(vmode) || vmode == Qtrue) {
+    return MECABY_PREWARM_TOUCH;
+  }
+
+  name = rb_obj_as_string(vmode);
+  mode = StringValueCStr(name);
+  if (strcmp(mode, "touch") == 0) {
+    return MECABY_PREWARM_TOUCH;
+  }
+  else if (strcmp(mode, "willneed") == 0) {
+    return MECABY_PREWARM_WILLNEED;
+  }
+  else if (strcmp(mode, "mlock") == 0) {
+    return MECABY_PREWARM_MLOCK;
+  }
+
+  rb_raise(rb_eArgError, "unknown prewarm mode: %"PRIsVALUE, rb_inspect(vmode));
+  UNREACHABLE;
+}
+
+/*
+ * Returns a frozen copy of the String or the Array of Strings given to
+ * Model.new.
+ */
+static VALUE
+mecaby_model_arg(VALUE arg)
+{
+  long i, n;
+  VALUE copy, ary = rb_check_array_type(arg);
+
+  if (NIL_P(ary)) {
+    StringValueCStr(arg);
+    return rb_str_new_frozen(arg);
+  }
+
+  n = RARRAY_LEN(ary);
+  copy = rb_ary_new2(n);
+  for (i = 0; i < n; ++i) {
+    VALUE item = RARRAY_AREF(ary, i);
+    StringValueCStr(item);
+    rb_ary_push(copy, rb_str_new_frozen(item));
+  }
+
+  return rb_obj_freeze(copy);
+}
+
+/*
+ * Makes the model object own the loaded MeCab model.
+ */
+static void
+mecaby_model_setup(VALUE self, mecab_model_t* mecab_model, VALUE vprewarm)
+{
+  mecaby_model_t* model = get_model(self);
+
+  /* another thread may have initialized it while the GVL was released */
+  if (model->model != NULL) {
+    mecab_model_destroy(mecab_model);
+    rb_raise(rb_eRuntimeError, "already initialized");
+  }
+  model->model = mecab_model;
+  model->dictionary_bytes = mecaby_dictionary_bytes(mecab_model_dictionary_info(model->model), Qnil);
+
+  mecaby_register_pointer_object(model->model, self);
+
+  if (RTEST(vprewarm)) {
+    mecaby_model_prewarm_with(self, mecaby_prewarm_mode_from(vprewarm));
+  }
+}
+
+/*
+ * call-seq:
+ *   Mecaby::Model.new(prewarm: nil)
+ *   Mecaby::Model.new(arg, prewarm: nil)
+ *
+ * Loads the model.  With prewarm: (true, :touch, :willneed or :mlock)
+ * the dictionary files are prewarmed as Model#prewarm before returning.
+ */
+static VALUE
+mecaby_model_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE arg, opts, vprewarm = Qnil;
+  mecaby_model_t* model = check_get_model(self);
+
+  if (model->model != NULL) {
+    rb_raise(rb_eRuntimeError, "already initialized");
+  }
+
+  /* an explicit nil is a TypeError, as a String or an Array is expected */
+  if (rb_scan_args(argc, argv, "01:", &arg, &opts) > 0) {
+    RB_OBJ_WRITE(self, &model->arg, mecaby_model_arg(arg));
+  }
+  if (!NIL_P(opts)) {
+    vprewarm = rb_hash_lookup2(opts, ID2SYM(rb_intern("prewarm")), Qnil);
+  }
+  mecaby_model_setup(self, mecaby_load(model->arg, 0, "mecab_model_initialize"), vprewarm);
+
+  return self;
+}
+
+static VALUE
+mecaby_model_inspect(VALUE self)
+{
+  VALUE str, cname;
+  mecaby_model_t* model = check_get_model(self);
+
+  if (NIL_P(model->arg)) {
+    return rb_call_super(0, NULL);
+  }
+
+  cname = rb_class_name(CLASS_OF(self));
+  if (model->model != NULL) {
+    str = rb_sprintf("#<%"PRIsVALUE":%p arg=%"PRIsVALUE">", cname, (void*)self, rb_inspect(model->arg));
+  }
+  else {
+    str = rb_sprintf("#<%"PRIsVALUE":%p uninitialized>", cname, (void*)self);
+  }
+  OBJ_INFECT(str, self);
+
+  return str;
+}
+
+static VALUE
+mecaby_model_dictionary_info(VALUE self)
+{
+  VALUE obj;
+  mecab_dictionary_info_t const* mecab_di;
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+
+  mecab_di = mecab_model_dictionary_info(model->model);
+  return mecaby_create_dictionary_info(mecab_di, self);
+}
+
+static VALUE
+mecaby_model_transition_cost(VALUE self, VALUE rc_attr, VALUE lc_attr)
+{
+  return Qnil;
+}
+
+static VALUE
+mecaby_model_create_tagger(VALUE self)
+{
+  VALUE obj;
+
+  obj = rb_obj_alloc(mecaby_cTagger);
+  rb_funcall(obj, rb_intern("initialize"), 1, self);
+
+  return obj;
+}
+
+static VALUE
+mecaby_model_create_lattice(VALUE self)
+{
+  VALUE obj;
+
+  obj = rb_obj_alloc(mecaby_cLattice);
+  rb_funcall(obj, rb_intern("initialize"), 1, self);
+
+  return obj;
+}
+
+/*
+ * Returns the tagger of this model dedicated to the current thread.
+ * The tagger is created at the first call in each thread and kept in a
+ * thread variable, which unlike Thread#[] is shared by the fibers of the
+ * thread, so all threads share one dictionary and the fibers of a
+ * thread share one tagger.  The tagger lives as long as the thread.
+ */
+static VALUE
+mecaby_model_tagger_for_current_thread(VALUE self)
+{
+  VALUE thread, taggers, tagger;
+
+  check_get_model_initialized(self, rb_eRuntimeError);
+
+  thread = rb_thread_current();
+  taggers = rb_funcall(thread, rb_intern("thread_variable_get"), 1, ID2SYM(id_mecaby_thread_taggers));
+  if (NIL_P(taggers)) {
+    taggers = rb_hash_new();
+    rb_funcall(taggers, rb_intern("compare_by_identity"), 0);
+    rb_funcall(thread, rb_intern("thread_variable_set"), 2, ID2SYM(id_mecaby_thread_taggers), taggers);
+  }
+
+  tagger = rb_hash_lookup(taggers, self);
+  if (NIL_P(tagger)) {
+    tagger = mecaby_model_create_tagger(self);
+    rb_hash_aset(taggers, self, tagger);
+  }
+
+  return tagger;
+}
+
+struct mecaby_score_args {
+  mecab_t* tagger;
+  mecab_lattice_t* lattice;
+  VALUE strings;
+  int counts;
+};
+
+static VALUE
+mecaby_model_score_many_body(VALUE ptr)
+{
+  long i;
+  VALUE result;
+  struct mecaby_score_args* args = (struct mecaby_score_args*)ptr;
+
+  result = rb_ary_new2(RARRAY_LEN(args->strings));
+  for (i = 0; i < RARRAY_LEN(args->strings); ++i) {
+    VALUE str = RARRAY_AREF(args->strings, i);
+    mecab_node_t const* node;
+    mecab_node_t const* eos;
+    long ntokens = 0;
+
+    StringValue(str);
+    mecab_lattice_set_sentence2(args->lattice, RSTRING_PTR(str), RSTRING_LEN(str));
+    if (!mecab_parse_lattice(args->tagger, args->lattice)) {
+      rb_raise(mecaby_eError, "%s", mecab_lattice_strerror(args->lattice));
+    }
+
+    eos = mecab_lattice_get_eos_node(args->lattice);
+    if (!args->counts) {
+      rb_ary_push(result, LONG2NUM(eos->cost));
+      continue;
+    }
+
+    for (node = mecab_lattice_get_bos_node(args->lattice)->next; node != NULL && node != eos; node = node->next) {
+      ++ntokens;
+    }
+    rb_ary_push(result, rb_assoc_new(LONG2NUM(eos->cost), LONG2NUM(ntokens)));
+  }
+
+  return result;
+}
+
+static VALUE
+mecaby_model_score_many_ensure(VALUE ptr)
+{
+  struct mecaby_score_args* args = (struct mecaby_score_args*)ptr;
+
+  mecab_lattice_destroy(args->lattice);
+
+  return Qnil;
+}
+
+/*
+ * Returns the best path costs of the strings.  With counts: true, each
+ * element is a pair of the cost and the number of tokens.  The strings
+ * are parsed by the current thread's tagger with one lattice, and no
+ * node or string objects are created.
+ */
+static VALUE
+mecaby_model_score_many(int argc, VALUE* argv, VALUE self)
+{
+  VALUE strings, opts, vtagger;
+  struct mecaby_score_args args;
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+
+  rb_scan_args(argc, argv, "11", &strings, &opts);
+  strings = rb_convert_type(strings, T_ARRAY, "Array", "to_ary");
+  args.counts = 0;
+  if (!NIL_P(opts)) {
+    opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+    args.counts = RTEST(rb_hash_lookup2(opts, ID2SYM(rb_intern("counts")), Qfalse));
+  }
+
+  vtagger = mecaby_model_tagger_for_current_thread(self);
+  args.tagger = check_get_tagger_idle(vtagger)->tagger;
+  args.strings = strings;
+  args.lattice = mecab_model_new_lattice(model->model);
+  if (args.lattice == NULL) {
+    rb_raise(mecaby_eError, "failed to create a lattice");
+  }
+  mecab_lattice_set_request_type(args.lattice, MECAB_ONE_BEST);
+
+  return rb_ensure(mecaby_model_score_many_body, (VALUE)&args, mecaby_model_score_many_ensure, (VALUE)&args);
+}
+
+static VALUE
+mecaby_model_swap(VALUE self, VALUE other)
+{
+  mecaby_model_t* model_self;
+  mecaby_model_t* model_other;
+
+  model_self = get_model_initialized(self);
+  model_other = get_model_initialized(other);
+
+  /* the registry of Model.shared finds a model by the arg it was loaded with */
+  if ((model_self != NULL && model_self->shared) || (model_other != NULL && model_other->shared)) {
+    rb_raise(rb_eRuntimeError, "can't swap a model of Mecaby::Model.shared");
+  }
+
+  if (model_self != NULL && model_other != NULL) {
+    mecaby_mapping_t* locked = model_self->locked;
+
+    mecab_model_swap(model_self->model, model_other->model);
+    model_self->locked = model_other->locked;
+    model_other->locked = locked;
+    mecaby_feature_table_clear(&model_self->features);
+    mecaby_feature_table_clear(&model_other->features);
+    model_self->dictionary_bytes = mecaby_dictionary_bytes(mecab_model_dictionary_info(model_self->model), Qnil);
+    model_other->dictionary_bytes = mecaby_dictionary_bytes(mecab_model_dictionary_info(model_other->model), Qnil);
+  }
+
+  return self;
+}
+
+static VALUE
+mecaby_model_feature_fields(VALUE self)
+{
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+
+  return mecaby_feature_table_load_field_names(&model->features, mecab_model_dictionary_info(model->model));
+}
+
+static VALUE
+mecaby_model_set_feature_fields(VALUE self, VALUE names)
+{
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+
+  rb_check_frozen(self);
+  mecaby_feature_table_set_field_names(&model->features, names);
+
+  return names;
+}
+
+static VALUE
+mecaby_model_stats(VALUE self)
+{
+  VALUE stats;
+  mecaby_model_t* model = check_get_model(self);
+
+  stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("taggers")), UINT2NUM(model->ntaggers));
+  rb_hash_aset(stats, ID2SYM(rb_intern("lattices")), UINT2NUM(model->nlattices));
+
+  return stats;
+}
+
+/*
+ * Returns the memory used by the model: the size of each dictionary file
+ * mapped into memory, the feature table, and the largest arena of the
+ * lattices parsed by this model, in bytes.
+ */
+static VALUE
+mecaby_model_memory_report(VALUE self)
+{
+  VALUE report, files;
+  size_t mapped, feature_table;
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+
+  files = rb_hash_new();
+  mapped = mecaby_dictionary_bytes(mecab_model_dictionary_info(model->model), files);
+  feature_table = mecaby_feature_table_memsize(&model->features);
+
+  report = rb_hash_new();
+  rb_hash_aset(report, ID2SYM(rb_intern("files")), files);
+  rb_hash_aset(report, ID2SYM(rb_intern("mapped_bytes")), SIZET2NUM(mapped));
+  rb_hash_aset(report, ID2SYM(rb_intern("feature_table_bytes")), SIZET2NUM(feature_table));
+  rb_hash_aset(report, ID2SYM(rb_intern("lattice_high_water_bytes")), SIZET2NUM(model->lattice_high_water));
+  rb_hash_aset(report, ID2SYM(rb_intern("taggers")), UINT2NUM(model->ntaggers));
+  rb_hash_aset(report, ID2SYM(rb_intern("lattices")), UINT2NUM(model->nlattices));
+  rb_hash_aset(report, ID2SYM(rb_intern("total_bytes")),
+               SIZET2NUM(sizeof(mecaby_model_t) + mapped + feature_table + model->lattice_high_water));
+  rb_hash_aset(report, ID2SYM(rb_intern("locked_bytes")), SIZET2NUM(mecaby_mappings_bytes(model->locked)));
+
+  return report;
+}
+
+static VALUE
+mecaby_model_prewarm_with(VALUE self, enum mecaby_prewarm_mode mode)
+{
+#ifdef MECABY_USE_PREWARM
+  static char const* const mode_names[] = { "touch", "willneed", "mlock" };
+  long i, size;
+  char* p;
+  VALUE files, paths, report, errors, vbuf;
+  mecaby_prewarm_t pw;
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+
+  if (mode == MECABY_PREWARM_MLOCK) {
+    rb_check_frozen(self);
+  }
+
+  files = rb_hash_new();
+  mecaby_dictionary_bytes(mecab_model_dictionary_info(model->model), files);
+  paths = rb_funcall(files, rb_intern("keys"), 0);
+
+  /* copy the paths to a buffer which doesn't move while the GVL is released */
+  memset(&pw, 0, sizeof(pw));
+  pw.mode = mode;
+  pw.nfiles = RARRAY_LEN(paths);
+  size = pw.nfiles * sizeof(mecaby_prewarm_file_t);
+  for (i = 0; i < pw.nfiles; ++i) {
+    size += RSTRING_LEN(RARRAY_AREF(paths, i)) + 1;
+  }
+  pw.files = ALLOCV(vbuf, size);
+  p = (char*)(pw.files + pw.nfiles);
+  for (i = 0; i < pw.nfiles; ++i) {
+    VALUE path = RARRAY_AREF(paths, i);
+    memcpy(p, RSTRING_PTR(path), RSTRING_LEN(path));
+    p[RSTRING_LEN(path)] = '\0';
+    pw.files[i].path = p;
+    pw.files[i].size = 0;
+    pw.files[i].error_no = 0;
+    p += RSTRING_LEN(path) + 1;
+  }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(mecaby_prewarm_run, &pw, mecaby_prewarm_unblock, &pw);
+#else
+  mecaby_prewarm_run(&pw);
+#endif
+
+  if (mode == MECABY_PREWARM_MLOCK) {
+    mecaby_mappings_release(model->locked);
+    model->locked = pw.locked;
+  }
+  if (pw.canceled) {
+    ALLOCV_END(vbuf);
+    rb_thread_check_ints();
+    rb_raise(rb_eInterrupt, "prewarm was interrupted");
+  }
+
+  errors = rb_hash_new();
+  for (i = 0; i < pw.nfiles; ++i) {
+    if (pw.files[i].error_no != 0) {
+      rb_hash_aset(errors, RARRAY_AREF(paths, i), rb_str_new_cstr(strerror(pw.files[i].error_no)));
+    }
+  }
+  ALLOCV_END(vbuf);
+
+  report = rb_hash_new();
+  rb_hash_aset(report, ID2SYM(rb_intern("mode")), ID2SYM(rb_intern(mode_names[mode])));
+  rb_hash_aset(report, ID2SYM(rb_intern("files")), LONG2NUM(pw.nfiles));
+  rb_hash_aset(report, ID2SYM(rb_intern("bytes")), SIZET2NUM(pw.bytes));
+  rb_hash_aset(report, ID2SYM(rb_intern("locked_bytes")), SIZET2NUM(pw.locked_bytes));
+  rb_hash_aset(report, ID2SYM(rb_intern("seconds")), DBL2NUM(pw.seconds));
+  rb_hash_aset(report, ID2SYM(rb_intern("errors")), errors);
+
+  return report;
+#else
+  rb_notimplement();
+  UNREACHABLE;
+#endif
+}
+
+/*
+ * call-seq:
+ *   model.prewarm(mode: :touch) -> Hash
+ *
+ * Brings the pages of the dictionary files into memory, so that the first
+ * parses don't wait for page faults.  The mode is one of:
+ *
+ * :touch    :: reads a byte of each page.
+ * :willneed :: asks the kernel to read the files ahead.
+ * :mlock    :: locks the pages until the model is destroyed.  When the
+ *              process may not lock them, the pages are touched instead
+ *              and the error is reported.
+ *
+ * Returns the number of files, the bytes prewarmed and locked, the time
+ * spent in seconds and the errors by file.  The GVL is released while the
+ * files are read.
+ */
+static VALUE
+mecaby_model_prewarm(int argc, VALUE* argv, VALUE self)
+{
+  VALUE opts, vmode = Qnil;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  if (!NIL_P(opts)) {
+    vmode = rb_hash_lookup2(opts, ID2SYM(rb_intern("mode")), Qnil);
+  }
+
+  return mecaby_model_prewarm_with(self, mecaby_prewarm_mode_from(vmode));
+}
+
+/*
+ * Mecaby::Model::Loader
+ */
+
+typedef struct mecaby_loader {
+  VALUE klass;
+  VALUE arg;
+  VALUE prewarm;
+  VALUE model;
+  mecaby_load_job_t* job;
+} mecaby_loader_t;
+
+static void
+mecaby_loader_mark(void *ptr)
+{
+  mecaby_loader_t* loader = ptr;
+
+  if (loader != NULL) {
+    mecaby_gc_mark_movable(loader->klass);
+    mecaby_gc_mark_movable(loader->arg);
+    mecaby_gc_mark_movable(loader->prewarm);
+    mecaby_gc_mark_movable(loader->model);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_loader_compact(void *ptr)
+{
+  mecaby_loader_t* loader = ptr;
+
+  MECABY_GC_UPDATE(loader->klass);
+  MECABY_GC_UPDATE(loader->arg);
+  MECABY_GC_UPDATE(loader->prewarm);
+  MECABY_GC_UPDATE(loader->model);
+}
+#endif
+
+static void
+mecaby_loader_free(void *ptr)
+{
+  mecaby_loader_t* loader = ptr;
+
+  if (loader != NULL) {
+    if (loader->job != NULL) {
+      mecaby_load_job_release(loader->job);
+    }
+    xfree(loader);
+  }
+}
+
+static size_t
+mecaby_loader_memsize(void const *ptr)
+{
+  return sizeof(mecaby_loader_t);
+}
+
+static const rb_data_type_t mecaby_loader_data_type = {
+  "Mecaby::Model::Loader",
+  {
+    mecaby_loader_mark,
+    mecaby_loader_free,
+    mecaby_loader_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_loader_compact,
+#endif
+  }
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+static mecaby_loader_t*
+get_loader(VALUE obj)
+{
+  mecaby_loader_t* loader;
+  TypedData_Get_Struct(obj, mecaby_loader_t, &mecaby_loader_data_type, loader);
+  return loader;
+}
+
+static int
+mecaby_load_job_is_done(mecaby_load_job_t* job)
+{
+#ifdef MECABY_USE_LOAD_THREAD
+  int done;
+
+  pthread_mutex_lock(&job->mutex);
+  done = job->done;
+  pthread_mutex_unlock(&job->mutex);
+
+  return done;
+#else
+  return 1;
+#endif
+}
+
+#ifdef MECABY_USE_LOAD_THREAD
+static void*
+mecaby_load_job_thread(void* ptr)
+{
+  mecaby_load_job_t* job = ptr;
+
+  mecaby_load_job_run(job);
+
+  pthread_mutex_lock(&job->mutex);
+  job->done = 1;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->mutex);
+
+  mecaby_load_job_release(job);
+  return NULL;
+}
+
+struct mecaby_load_wait {
+  mecaby_load_job_t* job;
+  int has_deadline;
+  struct timespec deadline;
+  int interrupted;
+};
+
+static void*
+mecaby_load_job_wait(void* ptr)
+{
+  struct mecaby_load_wait* wait = ptr;
+  mecaby_load_job_t* job = wait->job;
+
+  pthread_mutex_lock(&job->mutex);
+  while (!job->done && !wait->interrupted) {
+    if (!wait->has_deadline) {
+      pthread_cond_wait(&job->cond, &job->mutex);
+    }
+    else if (pthread_cond_timedwait(&job->cond, &job->mutex, &wait->deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&job->mutex);
+
+  return NULL;
+}
+
+static void
+mecaby_load_job_unblock(void* ptr)
+{
+  struct mecaby_load_wait* wait = ptr;
+  mecaby_load_job_t* job = wait->job;
+
+  pthread_mutex_lock(&job->mutex);
+  wait->interrupted = 1;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->mutex);
+}
+#endif
+
+/*
+ * Waits for the job until the timeout in seconds, or forever if it is
+ * nil.  Returns whether the job is done.
+ */
+static int
+mecaby_loader_wait(mecaby_loader_t* loader, VALUE vtimeout)
+{
+#ifdef MECABY_USE_LOAD_THREAD
+  struct mecaby_load_wait wait;
+
+  wait.job = loader->job;
+  wait.has_deadline = !NIL_P(vtimeout);
+  if (wait.has_deadline) {
+    double timeout = NUM2DBL(vtimeout), now;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_REALTIME)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    now = (double)time(NULL);
+#endif
+    if (timeout < 0) timeout = 0;
+    now += timeout;
+    wait.deadline.tv_sec = (time_t)now;
+    wait.deadline.tv_nsec = (long)((now - (double)wait.deadline.tv_sec) * 1e9);
+  }
+
+  for (;;) {
+    wait.interrupted = 0;
+    rb_thread_call_without_gvl(mecaby_load_job_wait, &wait, mecaby_load_job_unblock, &wait);
+    if (mecaby_load_job_is_done(loader->job)) return 1;
+    if (!wait.interrupted) return 0;
+    rb_thread_check_ints();
+  }
+#else
+  return 1;
+#endif
+}
+
+/*
+ * call-seq:
+ *   Mecaby::Model.load_async(arg = nil, prewarm: nil) -> Mecaby::Model::Loader
+ *
+ * Starts loading a model on a native thread without the GVL, and returns
+ * a Loader to wait for it.  The arguments are the same as Model.new;
+ * prewarm: is done by the thread which takes the model from the Loader.
+ */
+static VALUE
+mecaby_model_s_load_async(int argc, VALUE* argv, VALUE klass)
+{
+  VALUE arg, opts, obj;
+  mecaby_loader_t* loader;
+
+  rb_scan_args(argc, argv, "01:", &arg, &opts);
+
+  obj = TypedData_Make_Struct(mecaby_cModelLoader, mecaby_loader_t, &mecaby_loader_data_type, loader);
+  loader->model = Qnil;
+  RB_OBJ_WRITE(obj, &loader->klass, klass);
+  RB_OBJ_WRITE(obj, &loader->arg, NIL_P(arg) ? Qnil : mecaby_model_arg(arg));
+  RB_OBJ_WRITE(obj, &loader->prewarm, NIL_P(opts) ? Qnil : rb_hash_lookup2(opts, ID2SYM(rb_intern("prewarm")), Qnil));
+  if (RTEST(loader->prewarm)) {
+    mecaby_prewarm_mode_from(loader->prewarm);
+  }
+  loader->job = mecaby_load_job_new(loader->arg, 0);
+
+#ifdef MECABY_USE_LOAD_THREAD
   {
-    mecaby_lattice_mark,
-    mecaby_lattice_free,
-    mecaby_lattice_memsize,
+    int err;
+    pthread_t thread;
+
+    loader->job->refcount = 2;
+    err = pthread_create(&thread, NULL, mecaby_load_job_thread, loader->job);
+    if (err != 0) {
+      loader->job->refcount = 1;
+      rb_syserr_fail(err, "pthread_create");
+    }
+    pthread_detach(thread);
+  }
+#else
+  mecaby_load_job_call(loader->job);
+#endif
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   loader.join(timeout = nil) -> loader or nil
+ *
+ * Waits until the model is loaded.  Returns nil if the timeout in seconds
+ * expires first.
+ */
+static VALUE
+mecaby_loader_join(int argc, VALUE* argv, VALUE self)
+{
+  VALUE vtimeout;
+  mecaby_loader_t* loader = get_loader(self);
+
+  rb_scan_args(argc, argv, "01", &vtimeout);
+
+  return mecaby_loader_wait(loader, vtimeout) ? self : Qnil;
+}
+
+/*
+ * call-seq:
+ *   loader.value(timeout = nil) -> Mecaby::Model or nil
+ *
+ * Waits until the model is loaded and returns it, or raises the error of
+ * the load.  Returns nil if the timeout in seconds expires first.
+ */
+static VALUE
+mecaby_loader_value(int argc, VALUE* argv, VALUE self)
+{
+  VALUE vtimeout, model;
+  mecab_model_t* mecab_model;
+  mecaby_loader_t* loader = get_loader(self);
+
+  rb_scan_args(argc, argv, "01", &vtimeout);
+
+  if (!NIL_P(loader->model)) {
+    return loader->model;
+  }
+  if (!mecaby_loader_wait(loader, vtimeout)) {
+    return Qnil;
+  }
+  /* another thread may have taken the model while the GVL was released */
+  if (!NIL_P(loader->model)) {
+    return loader->model;
+  }
+
+  mecab_model = loader->job->result;
+  if (mecab_model == NULL) {
+    char const* error = loader->job->error;
+    if (strstr(error, "load_dictionary_resource")) {
+      rb_raise(mecaby_eDictNotFound, "%s:%d: mecab_model_initialize: %s", __FILE__, __LINE__, error);
+    }
+    else {
+      rb_raise(rb_eRuntimeError, "%s:%d: mecab_model_initialize: %s", __FILE__, __LINE__, error);
+    }
+  }
+
+  model = rb_obj_alloc(loader->klass);
+  RB_OBJ_WRITE(model, &get_model(model)->arg, loader->arg);
+  loader->job->result = NULL;
+  RB_OBJ_WRITE(self, &loader->model, model);
+  mecaby_model_setup(model, mecab_model, loader->prewarm);
+
+  return model;
+}
+
+static VALUE
+mecaby_loader_is_done(VALUE self)
+{
+  return mecaby_load_job_is_done(get_loader(self)->job) ? Qtrue : Qfalse;
+}
+
+/*
+ * Shared model registry
+ */
+
+/*
+ * The registry is a pair of a Hash and a Mutex.  In the Ractor-safe
+ * build each Ractor has its own registry in the Ractor-local storage;
+ * pass a frozen model to other Ractors to share its dictionary.
+ */
+#ifdef MECABY_RACTOR_SAFE
+static rb_ractor_local_key_t mecaby_shared_models_key;
+#else
+static VALUE mecaby_shared_models = Qnil;
+#endif
+
+static struct mecaby_mecab_option {
+  char short_name;
+  char const* long_name;
+  int has_arg;
+  int is_path;
+} const mecaby_mecab_options[] = {
+  { 'r', "rcfile",             1, 1 },
+  { 'd', "dicdir",             1, 1 },
+  { 'u', "userdic",            1, 1 },
+  { 'l', "lattice-level",      1, 0 },
+  { 'D', "dictionary-info",    0, 0 },
+  { 'O', "output-format-type", 1, 0 },
+  { 'a', "all-morphs",         0, 0 },
+  { 'N', "nbest",              1, 0 },
+  { 'p', "partial",            0, 0 },
+  { 'm', "marginal",           0, 0 },
+  { 'M', "max-grouping-size",  1, 0 },
+  { 'F', "node-format",        1, 0 },
+  { 'U', "unk-format",         1, 0 },
+  { 'B', "bos-format",         1, 0 },
+  { 'E', "eos-format",         1, 0 },
+  { 'S', "eon-format",         1, 0 },
+  { 'x', "unk-feature",        1, 0 },
+  { 'b', "input-buffer-size",  1, 0 },
+  { 'P', "dump-config",        0, 0 },
+  { 'C', "allocate-sentence",  0, 0 },
+  { 't', "theta",              1, 0 },
+  { 'c', "cost-factor",        1, 0 },
+  { 'o', "output",             1, 1 },
+};
+
+#define MECABY_MECAB_OPTIONS_SIZE (sizeof(mecaby_mecab_options) / sizeof(mecaby_mecab_options[0]))
+
+static struct mecaby_mecab_option const*
+mecaby_find_short_option(char name)
+{
+  size_t i;
+
+  for (i = 0; i < MECABY_MECAB_OPTIONS_SIZE; ++i) {
+    if (mecaby_mecab_options[i].short_name == name) {
+      return &mecaby_mecab_options[i];
+    }
+  }
+
+  return NULL;
+}
+
+static struct mecaby_mecab_option const*
+mecaby_find_long_option(char const* name, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < MECABY_MECAB_OPTIONS_SIZE; ++i) {
+    char const* long_name = mecaby_mecab_options[i].long_name;
+    if (strlen(long_name) == len && strncmp(long_name, name, len) == 0) {
+      return &mecaby_mecab_options[i];
+    }
+  }
+
+  return NULL;
+}
+
+static VALUE
+mecaby_expand_path_list(VALUE paths)
+{
+  long i;
+  VALUE ary = rb_str_split(paths, ",");
+
+  for (i = 0; i < RARRAY_LEN(ary); ++i) {
+    rb_ary_store(ary, i, rb_file_expand_path(RARRAY_AREF(ary, i), Qnil));
+  }
+
+  return rb_ary_join(ary, rb_str_new2(","));
+}
+
+/*
+ * Splits the argument of Model.new into option words.  The string form
+ * is split on whitespace as mecab_model_new2 does, and the first item of
+ * the array form is the program name.
+ */
+static VALUE
+mecaby_split_model_args(VALUE arg)
+{
+  VALUE ary;
+
+  if (NIL_P(arg)) {
+    return rb_ary_new3(1, rb_str_new2("-C"));
+  }
+
+  ary = rb_check_array_type(arg);
+  if (NIL_P(ary)) {
+    StringValue(arg);
+    return rb_str_split(arg, " ");
+  }
+
+  ary = rb_ary_dup(ary);
+  rb_ary_shift(ary);
+  return ary;
+}
+
+/*
+ * Returns the frozen array of options equivalent to the given argument
+ * of Model.new.  Short options are spelled as long options, paths are
+ * expanded, and the options are sorted by name.  When an option is
+ * repeated the last one is kept, as MeCab does.
+ */
+static VALUE
+mecaby_normalize_model_args(VALUE arg)
+{
+  long i, n;
+  VALUE args, options, rest, key;
+
+  args = mecaby_split_model_args(arg);
+  options = rb_hash_new();
+  rest = rb_ary_new();
+
+  n = RARRAY_LEN(args);
+  for (i = 0; i < n; ++i) {
+    char const* ptr;
+    long len;
+    struct mecaby_mecab_option const* opt = NULL;
+    VALUE item, value = Qnil, entry;
+
+    item = RARRAY_AREF(args, i);
+    StringValue(item);
+    ptr = RSTRING_PTR(item);
+    len = RSTRING_LEN(item);
+
+    if (len > 2 && ptr[0] == '-' && ptr[1] == '-') {
+      char const* eq = memchr(ptr + 2, '=', len - 2);
+      opt = mecaby_find_long_option(ptr + 2, eq ? (size_t)(eq - ptr - 2) : (size_t)(len - 2));
+      if (opt != NULL && opt->has_arg) {
+        if (eq != NULL) {
+          value = rb_str_new(eq + 1, ptr + len - eq - 1);
+        }
+        else if (i + 1 < n) {
+          value = RARRAY_AREF(args, ++i);
+        }
+      }
+    }
+    else if (len >= 2 && ptr[0] == '-') {
+      opt = mecaby_find_short_option(ptr[1]);
+      if (opt != NULL && opt->has_arg) {
+        if (len > 2) {
+          value = rb_str_new(ptr + 2, len - 2);
+        }
+        else if (i + 1 < n) {
+          value = RARRAY_AREF(args, ++i);
+        }
+      }
+    }
+
+    if (opt == NULL) {
+      rb_ary_push(rest, rb_str_new_frozen(item));
+      continue;
+    }
+
+    entry = rb_sprintf("--%s", opt->long_name);
+    if (!NIL_P(value)) {
+      StringValue(value);
+      if (opt->is_path) {
+        value = mecaby_expand_path_list(value);
+      }
+      rb_str_cat2(entry, "=");
+      rb_str_append(entry, value);
+    }
+    rb_obj_freeze(entry);
+    rb_hash_aset(options, rb_str_new2(opt->long_name), entry);
+  }
+
+  key = rb_funcall(rb_funcall(options, rb_intern("values"), 0), rb_intern("sort"), 0);
+  rb_ary_concat(key, rest);
+
+  return rb_obj_freeze(key);
+}
+
+static VALUE
+mecaby_shared_models_registry(void)
+{
+  VALUE registry;
+
+#ifdef MECABY_RACTOR_SAFE
+  if (rb_ractor_local_storage_value_lookup(mecaby_shared_models_key, &registry)) {
+    return registry;
+  }
+#else
+  if (!NIL_P(mecaby_shared_models)) {
+    return mecaby_shared_models;
+  }
+#endif
+
+  registry = rb_ary_new3(2, rb_hash_new(), rb_mutex_new());
+
+#ifdef MECABY_RACTOR_SAFE
+  rb_ractor_local_storage_value_set(mecaby_shared_models_key, registry);
+#else
+  mecaby_shared_models = registry;
+  rb_gc_register_address(&mecaby_shared_models);
+#endif
+
+  return registry;
+}
+
+#define SHARED_MODELS_TABLE(registry) RARRAY_AREF(registry, 0)
+#define SHARED_MODELS_LOCK(registry) RARRAY_AREF(registry, 1)
+
+/*
+ * An entry of the table is a WeakRef of a loaded model, or, while the
+ * model is loaded, a pending entry: an Array of a Mutex of the key.  The
+ * registry lock is held only to look up and update the table, and the
+ * dictionary is loaded under the Mutex of the key, so the loads of
+ * different dictionaries run in parallel.
+ */
+#define SHARED_MODELS_IS_PENDING(entry) RB_TYPE_P(entry, T_ARRAY)
+
+struct mecaby_shared_model_args {
+  VALUE klass;
+  VALUE arg;
+  VALUE key;
+  VALUE table;
+  VALUE lock;
+  VALUE entry;
+  VALUE obj;
+};
+
+static int
+mecaby_shared_models_prune_i(VALUE key, VALUE entry, VALUE arg)
+{
+  if (!SHARED_MODELS_IS_PENDING(entry) && NIL_P(weakref_getobj_if_alive(entry))) {
+    return ST_DELETE;
+  }
+  return ST_CONTINUE;
+}
+
+/*
+ * Returns the living model of the key, or its pending entry, which is
+ * added after the entries of the released models are pruned.
+ */
+static VALUE
+mecaby_shared_models_reserve(VALUE ptr)
+{
+  VALUE entry, obj;
+  struct mecaby_shared_model_args* sma = (struct mecaby_shared_model_args*)ptr;
+
+  entry = rb_hash_lookup(sma->table, sma->key);
+  if (!NIL_P(entry)) {
+    if (SHARED_MODELS_IS_PENDING(entry)) return entry;
+    obj = weakref_getobj_if_alive(entry);
+    if (!NIL_P(obj)) return obj;
+  }
+
+  rb_hash_foreach(sma->table, mecaby_shared_models_prune_i, Qnil);
+  entry = rb_ary_new3(1, rb_mutex_new());
+  rb_hash_aset(sma->table, sma->key, entry);
+
+  return entry;
+}
+
+/*
+ * Returns true if the pending entry is still to be loaded, the model if
+ * it has been loaded meanwhile, or false if the entry has been dropped.
+ */
+static VALUE
+mecaby_shared_models_check(VALUE ptr)
+{
+  VALUE entry;
+  struct mecaby_shared_model_args* sma = (struct mecaby_shared_model_args*)ptr;
+
+  entry = rb_hash_lookup(sma->table, sma->key);
+  if (entry == sma->entry) return Qtrue;
+  if (NIL_P(entry) || SHARED_MODELS_IS_PENDING(entry)) return Qfalse;
+
+  entry = weakref_getobj_if_alive(entry);
+  return NIL_P(entry) ? Qfalse : entry;
+}
+
+/*
+ * Replaces the pending entry with the loaded model, or drops it if the
+ * load failed.
+ */
+static VALUE
+mecaby_shared_models_settle(VALUE ptr)
+{
+  struct mecaby_shared_model_args* sma = (struct mecaby_shared_model_args*)ptr;
+
+  if (rb_hash_lookup(sma->table, sma->key) != sma->entry) return Qnil;
+
+  if (NIL_P(sma->obj)) {
+    rb_hash_delete(sma->table, sma->key);
+  }
+  else {
+    rb_hash_aset(sma->table, sma->key, weakref_new(sma->obj));
+  }
+
+  return Qnil;
+}
+
+static VALUE
+mecaby_shared_models_load_body(VALUE ptr)
+{
+  struct mecaby_shared_model_args* sma = (struct mecaby_shared_model_args*)ptr;
+
+  sma->obj = NIL_P(sma->arg) ? rb_class_new_instance(0, NULL, sma->klass)
+                             : rb_class_new_instance(1, &sma->arg, sma->klass);
+  check_get_model(sma->obj)->shared = 1;
+  return sma->obj;
+}
+
+static VALUE
+mecaby_shared_models_load_ensure(VALUE ptr)
+{
+  struct mecaby_shared_model_args* sma = (struct mecaby_shared_model_args*)ptr;
+
+  return rb_mutex_synchronize(sma->lock, mecaby_shared_models_settle, ptr);
+}
+
+static VALUE
+mecaby_shared_models_load(VALUE ptr)
+{
+  VALUE result;
+  struct mecaby_shared_model_args* sma = (struct mecaby_shared_model_args*)ptr;
+
+  result = rb_mutex_synchronize(sma->lock, mecaby_shared_models_check, ptr);
+  if (result != Qtrue) return result;
+
+  sma->obj = Qnil;
+  return rb_ensure(mecaby_shared_models_load_body, ptr, mecaby_shared_models_load_ensure, ptr);
+}
+
+/*
+ * Returns the model shared in the process for the given argument.
+ * Arguments which are equivalent after normalization give the same
+ * model, so the dictionary is loaded only once.  The registry holds the
+ * models weakly, so a model is released when no one uses it.
+ */
+static VALUE
+mecaby_model_s_shared(int argc, VALUE* argv, VALUE klass)
+{
+  VALUE arg, registry, result;
+  struct mecaby_shared_model_args sma;
+
+  rb_scan_args(argc, argv, "01", &arg);
+
+  registry = mecaby_shared_models_registry();
+
+  sma.klass = klass;
+  sma.arg = arg;
+  sma.key = mecaby_normalize_model_args(arg);
+  sma.table = SHARED_MODELS_TABLE(registry);
+  sma.lock = SHARED_MODELS_LOCK(registry);
+
+  /* a pending entry dropped by a failed load is reserved again */
+  for (;;) {
+    result = rb_mutex_synchronize(sma.lock, mecaby_shared_models_reserve, (VALUE)&sma);
+    if (!SHARED_MODELS_IS_PENDING(result)) return result;
+
+    sma.entry = result;
+    result = rb_mutex_synchronize(RARRAY_AREF(sma.entry, 0), mecaby_shared_models_load, (VALUE)&sma);
+    if (result != Qfalse) return result;
+  }
+}
+
+static int
+mecaby_shared_stats_i(VALUE key, VALUE entry, VALUE stats)
+{
+  VALUE obj;
+
+  if (SHARED_MODELS_IS_PENDING(entry)) return ST_CONTINUE;
+
+  obj = weakref_getobj_if_alive(entry);
+  if (NIL_P(obj)) return ST_DELETE;
+
+  rb_hash_aset(stats, key, mecaby_model_stats(obj));
+  return ST_CONTINUE;
+}
+
+static VALUE
+mecaby_model_s_shared_stats_body(VALUE table)
+{
+  VALUE stats = rb_hash_new();
+
+  rb_hash_foreach(table, mecaby_shared_stats_i, stats);
+  return stats;
+}
+
+/*
+ * Returns the stats of the living shared models keyed by their
+ * normalized arguments, and drops the entries of the released ones.
+ */
+static VALUE
+mecaby_model_s_shared_stats(VALUE klass)
+{
+  VALUE registry = mecaby_shared_models_registry();
+
+  return rb_mutex_synchronize(SHARED_MODELS_LOCK(registry), mecaby_model_s_shared_stats_body,
+                              SHARED_MODELS_TABLE(registry));
+}
+
+/*
+ * Mecaby::Dictionary
+ *
+ * Compiles a user dictionary into the binary format of mecab-dict-index:
+ * the header, the double-array trie of the surfaces, the tokens and the
+ * feature strings.  The rows are sorted by surface in several threads,
+ * and the trie is built by the same algorithm as Darts, which MeCab uses
+ * to read it.  The context ids and the costs are taken from the rows as
+ * they are, and the ids are validated against the model's matrix.
+ */
+
+#define MECABY_DIC_MAGIC_ID 0xef718f77U
+#define MECABY_DIC_VERSION 102
+#define MECABY_DIC_TYPE_USR 1
+#define MECABY_DIC_HEADER_SIZE (10 * 4 + 32)
+
+typedef struct mecaby_dic_token {
+  unsigned short lcAttr;
+  unsigned short rcAttr;
+  unsigned short posid;
+  short wcost;
+  unsigned int feature;
+  unsigned int compound;
+} mecaby_dic_token_t;
+
+typedef struct mecaby_dic_entry {
+  char const* surface;
+  size_t surface_offset;
+  size_t length;
+  size_t index;
+  mecaby_dic_token_t token;
+} mecaby_dic_entry_t;
+
+typedef struct mecaby_darts_unit {
+  int base;
+  unsigned int check;
+} mecaby_darts_unit_t;
+
+typedef struct mecaby_darts_node {
+  unsigned int code;
+  size_t depth;
+  size_t left;
+  size_t right;
+} mecaby_darts_node_t;
+
+typedef struct mecaby_darts {
+  mecaby_darts_unit_t* array;
+  unsigned char* used;
+  size_t alloc_size;
+  size_t size;
+  size_t next_check_pos;
+  size_t nkeys;
+  char const** keys;
+  size_t* lengths;
+  int* values;
+  mecaby_darts_node_t** levels;
+  size_t nlevels;
+} mecaby_darts_t;
+
+typedef struct mecaby_dic_builder {
+  mecaby_dic_entry_t* entries;
+  size_t nentries;
+  size_t entries_capa;
+  char* surfaces;
+  size_t surfaces_len;
+  size_t surfaces_capa;
+  char* features;
+  size_t features_len;
+  size_t features_capa;
+  size_t max_length;
+  unsigned int lsize;
+  unsigned int rsize;
+  char charset[32];
+  rb_encoding* encoding;
+  int nthreads;
+  mecaby_darts_t darts;
+  char const* output;
+  int error_no;
+  char const* error;
+} mecaby_dic_builder_t;
+
+/*
+ * Darts
+ */
+
+static int
+mecaby_darts_resize(mecaby_darts_t* da, size_t new_size)
+{
+  mecaby_darts_unit_t* array;
+  unsigned char* used;
+
+  if (new_size <= da->alloc_size) return 1;
+
+  array = realloc(da->array, new_size * sizeof(*array));
+  if (array == NULL) return 0;
+  da->array = array;
+
+  used = realloc(da->used, new_size);
+  if (used == NULL) return 0;
+  da->used = used;
+
+  memset(da->array + da->alloc_size, 0, (new_size - da->alloc_size) * sizeof(*array));
+  memset(da->used + da->alloc_size, 0, new_size - da->alloc_size);
+  da->alloc_size = new_size;
+
+  return 1;
+}
+
+static int
+mecaby_darts_reserve(mecaby_darts_t* da, size_t pos)
+{
+  size_t new_size;
+
+  if (pos < da->alloc_size) return 1;
+
+  new_size = da->alloc_size + da->alloc_size / 2;
+  if (new_size <= pos) new_size = pos + 1;
+
+  return mecaby_darts_resize(da, new_size);
+}
+
+static size_t
+mecaby_darts_fetch(mecaby_darts_t* da, mecaby_darts_node_t const* parent, mecaby_darts_node_t* siblings)
+{
+  size_t i, n = 0;
+  unsigned int prev = 0;
+
+  for (i = parent->left; i < parent->right; ++i) {
+    unsigned int cur = 0;
+
+    if (da->lengths[i] < parent->depth) continue;
+    if (da->lengths[i] != parent->depth) {
+      cur = (unsigned char)da->keys[i][parent->depth] + 1;
+    }
+
+    if (cur != prev || n == 0) {
+      if (n > 0) siblings[n - 1].right = i;
+      siblings[n].depth = parent->depth + 1;
+      siblings[n].code = cur;
+      siblings[n].left = i;
+      ++n;
+    }
+    prev = cur;
+  }
+  if (n > 0) siblings[n - 1].right = parent->right;
+
+  return n;
+}
+
+static int
+mecaby_darts_fits(mecaby_darts_t* da, mecaby_darts_node_t const* siblings, size_t n, size_t begin)
+{
+  size_t i;
+
+  if (da->used[begin]) return 0;
+  for (i = 1; i < n; ++i) {
+    if (da->array[begin + siblings[i].code].check != 0) return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Places the siblings and their descendants, and returns the base of
+ * the siblings, or 0 on failure.
+ */
+static size_t
+mecaby_darts_insert(mecaby_darts_t* da, mecaby_darts_node_t const* siblings, size_t n)
+{
+  size_t i, begin, pos, nonzero_num = 0;
+  size_t last = siblings[n - 1].code;
+  int first = 1;
+  mecaby_darts_node_t* children;
+
+  pos = siblings[0].code + 1 > da->next_check_pos ? siblings[0].code : da->next_check_pos - 1;
+  for (;;) {
+    ++pos;
+    if (!mecaby_darts_reserve(da, pos)) return 0;
+    if (da->array[pos].check) {
+      ++nonzero_num;
+      continue;
+    }
+    if (first) {
+      da->next_check_pos = pos;
+      first = 0;
+    }
+
+    begin = pos - siblings[0].code;
+    if (!mecaby_darts_reserve(da, begin + last)) return 0;
+    if (mecaby_darts_fits(da, siblings, n, begin)) break;
+  }
+
+  if (begin > INT_MAX) return 0;
+  if (1.0 * nonzero_num / (pos - da->next_check_pos + 1) >= 0.95) {
+    da->next_check_pos = pos;
+  }
+
+  da->used[begin] = 1;
+  if (da->size < begin + last + 1) {
+    da->size = begin + last + 1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    da->array[begin + siblings[i].code].check = (unsigned int)begin;
+  }
+
+  children = da->levels[siblings[0].depth];
+  for (i = 0; i < n; ++i) {
+    size_t nchildren = mecaby_darts_fetch(da, &siblings[i], children);
+
+    if (nchildren == 0) {
+      da->array[begin + siblings[i].code].base = -da->values[siblings[i].left] - 1;
+    }
+    else {
+      size_t h = mecaby_darts_insert(da, children, nchildren);
+      if (h == 0) return 0;
+      da->array[begin + siblings[i].code].base = (int)h;
+    }
+  }
+
+  return begin;
+}
+
+/*
+ * Builds the trie of the sorted unique keys.
+ */
+static int
+mecaby_darts_build(mecaby_darts_t* da, size_t max_length)
+{
+  size_t i, n;
+  mecaby_darts_node_t root;
+
+  da->nlevels = max_length + 2;
+  da->levels = calloc(da->nlevels, sizeof(*da->levels));
+  if (da->levels == NULL) return 0;
+  for (i = 0; i < da->nlevels; ++i) {
+    da->levels[i] = malloc(257 * sizeof(**da->levels));
+    if (da->levels[i] == NULL) return 0;
+  }
+
+  if (!mecaby_darts_resize(da, 8192)) return 0;
+  da->array[0].base = 1;
+  da->next_check_pos = 0;
+  da->size = 0;
+
+  root.code = 0;
+  root.depth = 0;
+  root.left = 0;
+  root.right = da->nkeys;
+  n = mecaby_darts_fetch(da, &root, da->levels[0]);
+  if (n > 0 && mecaby_darts_insert(da, da->levels[0], n) == 0) return 0;
+
+  /* lookups read up to 256 units after a base */
+  da->size += 256 + 1;
+  return mecaby_darts_resize(da, da->size);
+}
+
+static void
+mecaby_darts_free(mecaby_darts_t* da)
+{
+  size_t i;
+
+  if (da->levels != NULL) {
+    for (i = 0; i < da->nlevels; ++i) {
+      free(da->levels[i]);
+    }
+    free(da->levels);
+  }
+  free(da->array);
+  free(da->used);
+  free(da->keys);
+  free(da->lengths);
+  free(da->values);
+}
+
+/*
+ * Sorting
+ */
+
+static int
+mecaby_dic_entry_cmp(void const* a, void const* b)
+{
+  mecaby_dic_entry_t const* x = a;
+  mecaby_dic_entry_t const* y = b;
+  int r = memcmp(x->surface, y->surface, x->length < y->length ? x->length : y->length);
+
+  if (r != 0) return r;
+  if (x->length != y->length) return x->length < y->length ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void
+mecaby_dic_entries_merge(mecaby_dic_entry_t const* a, size_t na,
+                         mecaby_dic_entry_t const* b, size_t nb,
+                         mecaby_dic_entry_t* out)
+{
+  mecaby_dic_entry_t const* aend = a + na;
+  mecaby_dic_entry_t const* bend = b + nb;
+
+  while (a < aend && b < bend) {
+    if (mecaby_dic_entry_cmp(b, a) < 0) {
+      *out++ = *b++;
+    }
+    else {
+      *out++ = *a++;
+    }
+  }
+  memcpy(out, a, (aend - a) * sizeof(*a));
+  out += aend - a;
+  memcpy(out, b, (bend - b) * sizeof(*b));
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct mecaby_sort_task {
+  pthread_t thread;
+  int started;
+  mecaby_dic_entry_t* src;
+  mecaby_dic_entry_t* dst;
+  size_t begin;
+  size_t middle;
+  size_t end;
+} mecaby_sort_task_t;
+
+static void*
+mecaby_sort_task_run(void* ptr)
+{
+  mecaby_sort_task_t* task = ptr;
+
+  if (task->dst == NULL) {
+    qsort(task->src + task->begin, task->end - task->begin, sizeof(*task->src), mecaby_dic_entry_cmp);
+  }
+  else {
+    mecaby_dic_entries_merge(task->src + task->begin, task->middle - task->begin,
+                             task->src + task->middle, task->end - task->middle,
+                             task->dst + task->begin);
+  }
+
+  return NULL;
+}
+
+static void
+mecaby_sort_tasks_run(mecaby_sort_task_t* tasks, int ntasks)
+{
+  int i;
+
+  for (i = 0; i < ntasks; ++i) {
+    tasks[i].started = i > 0 && pthread_create(&tasks[i].thread, NULL, mecaby_sort_task_run, &tasks[i]) == 0;
+    if (i > 0 && !tasks[i].started) {
+      mecaby_sort_task_run(&tasks[i]);
+    }
+  }
+  mecaby_sort_task_run(&tasks[0]);
+  for (i = 1; i < ntasks; ++i) {
+    if (tasks[i].started) {
+      pthread_join(tasks[i].thread, NULL);
+    }
+  }
+}
+
+/*
+ * Sorts the chunks of the entries in nthreads threads, and merges the
+ * sorted runs in pairs in parallel.
+ */
+static int
+mecaby_dic_entries_sort(mecaby_dic_entry_t* entries, size_t n, int nthreads)
+{
+  int i, nruns;
+  size_t* bounds;
+  mecaby_sort_task_t* tasks;
+  mecaby_dic_entry_t* src = entries;
+  mecaby_dic_entry_t* dst;
+
+  if (nthreads <= 1 || n < (size_t)nthreads * 1024) {
+    qsort(entries, n, sizeof(*entries), mecaby_dic_entry_cmp);
+    return 1;
+  }
+
+  dst = malloc(n * sizeof(*entries));
+  bounds = malloc((nthreads + 1) * sizeof(*bounds));
+  tasks = malloc(nthreads * sizeof(*tasks));
+  if (dst == NULL || bounds == NULL || tasks == NULL) {
+    free(dst);
+    free(bounds);
+    free(tasks);
+    return 0;
+  }
+
+  for (i = 0; i <= nthreads; ++i) {
+    bounds[i] = n / nthreads * i + (i == nthreads ? n % nthreads : 0);
+  }
+  for (i = 0; i < nthreads; ++i) {
+    tasks[i].src = src;
+    tasks[i].dst = NULL;
+    tasks[i].begin = bounds[i];
+    tasks[i].end = bounds[i + 1];
+  }
+  mecaby_sort_tasks_run(tasks, nthreads);
+
+  for (nruns = nthreads; nruns > 1; nruns = (nruns + 1) / 2) {
+    int ntasks = 0;
+
+    for (i = 0; i + 1 < nruns; i += 2) {
+      tasks[ntasks].src = src;
+      tasks[ntasks].dst = dst;
+      tasks[ntasks].begin = bounds[i];
+      tasks[ntasks].middle = bounds[i + 1];
+      tasks[ntasks].end = bounds[i + 2];
+      ++ntasks;
+    }
+    if (i < nruns) {
+      memcpy(dst + bounds[i], src + bounds[i], (bounds[i + 1] - bounds[i]) * sizeof(*src));
+    }
+    mecaby_sort_tasks_run(tasks, ntasks);
+
+    for (i = 0; 2 * i <= nruns; ++i) {
+      bounds[i] = bounds[2 * i < nruns ? 2 * i : nruns];
+    }
+    bounds[(nruns + 1) / 2] = n;
+
+    {
+      mecaby_dic_entry_t* tmp = src;
+      src = dst;
+      dst = tmp;
+    }
+  }
+
+  if (src != entries) {
+    memcpy(entries, src, n * sizeof(*entries));
+    dst = src;
+  }
+  free(dst);
+  free(bounds);
+  free(tasks);
+
+  return 1;
+}
+#else
+static int
+mecaby_dic_entries_sort(mecaby_dic_entry_t* entries, size_t n, int nthreads)
+{
+  qsort(entries, n, sizeof(*entries), mecaby_dic_entry_cmp);
+  return 1;
+}
+#endif
+
+/*
+ * Building
+ */
+
+static void
+mecaby_dic_builder_free(mecaby_dic_builder_t* builder)
+{
+  xfree(builder->entries);
+  xfree(builder->surfaces);
+  xfree(builder->features);
+  mecaby_darts_free(&builder->darts);
+}
+
+static size_t
+mecaby_dic_builder_append(char** buf, size_t* len, size_t* capa, char const* p, size_t n)
+{
+  size_t offset = *len;
+
+  if (*capa < *len + n + 1) {
+    size_t new_capa = *capa < 4096 ? 4096 : *capa * 2;
+    while (new_capa < *len + n + 1) new_capa *= 2;
+    REALLOC_N(*buf, char, new_capa);
+    *capa = new_capa;
+  }
+  memcpy(*buf + *len, p, n);
+  (*buf)[*len + n] = '\0';
+  *len += n + 1;
+
+  return offset;
+}
+
+static VALUE
+mecaby_dic_builder_encode(mecaby_dic_builder_t* builder, VALUE str)
+{
+  rb_encoding* enc;
+
+  StringValue(str);
+  enc = rb_enc_get(str);
+  if (enc == builder->encoding || enc == rb_ascii8bit_encoding() ||
+      (rb_enc_asciicompat(builder->encoding) && rb_enc_str_asciionly_p(str))) {
+    return str;
+  }
+
+  return rb_str_encode(str, rb_enc_from_encoding(builder->encoding), 0, Qnil);
+}
+
+static void
+mecaby_dic_builder_add(mecaby_dic_builder_t* builder, long lineno,
+                       char const* surface, size_t surface_len, int unquote,
+                       long lid, long rid, long cost,
+                       char const* feature, size_t feature_len)
+{
+  mecaby_dic_entry_t* entry;
+  size_t offset;
+
+  if (surface_len == 0) {
+    rb_raise(rb_eArgError, "row %ld: empty surface", lineno);
+  }
+  if (lid < 0 || (unsigned long)lid >= builder->lsize) {
+    rb_raise(rb_eArgError, "row %ld: left id %ld is out of the matrix (0...%u)", lineno, lid, builder->lsize);
+  }
+  if (rid < 0 || (unsigned long)rid >= builder->rsize) {
+    rb_raise(rb_eArgError, "row %ld: right id %ld is out of the matrix (0...%u)", lineno, rid, builder->rsize);
+  }
+  if (cost < SHRT_MIN || SHRT_MAX < cost) {
+    rb_raise(rb_eArgError, "row %ld: cost %ld is out of range", lineno, cost);
+  }
+  if (memchr(feature, '\0', feature_len) != NULL) {
+    rb_raise(rb_eArgError, "row %ld: feature contains NUL", lineno);
+  }
+
+  if (builder->nentries == builder->entries_capa) {
+    builder->entries_capa = builder->entries_capa < 1024 ? 1024 : builder->entries_capa * 2;
+    REALLOC_N(builder->entries, mecaby_dic_entry_t, builder->entries_capa);
+  }
+
+  offset = mecaby_dic_builder_append(&builder->surfaces, &builder->surfaces_len, &builder->surfaces_capa,
+                                     surface, surface_len);
+  if (unquote) {
+    /* collapse "" in a quoted CSV field */
+    char* p = builder->surfaces + offset;
+    char* q = p;
+    char const* end = p + surface_len;
+    for (; p < end; ++p, ++q) {
+      *q = *p;
+      if (*p == '"' && p + 1 < end && p[1] == '"') ++p;
+    }
+    *q = '\0';
+    surface_len = q - (builder->surfaces + offset);
+  }
+
+  entry = &builder->entries[builder->nentries];
+  entry->surface = NULL;
+  entry->surface_offset = offset;
+  entry->length = surface_len;
+  entry->index = builder->nentries;
+  entry->token.lcAttr = (unsigned short)lid;
+  entry->token.rcAttr = (unsigned short)rid;
+  entry->token.posid = 0;
+  entry->token.wcost = (short)cost;
+  entry->token.compound = 0;
+  entry->token.feature = (unsigned int)mecaby_dic_builder_append(&builder->features, &builder->features_len,
+                                                                  &builder->features_capa, feature, feature_len);
+  if (builder->features_len > UINT_MAX) {
+    rb_raise(rb_eArgError, "features are too large");
+  }
+  if (builder->max_length < surface_len) {
+    builder->max_length = surface_len;
+  }
+  ++builder->nentries;
+}
+
+static long
+mecaby_dic_parse_int(char const* p, char const* q, long lineno, char const* name)
+{
+  char* end;
+  long n;
+  char buf[32];
+
+  if (q - p == 0) {
+    rb_raise(rb_eArgError, "row %ld: %s is required", lineno, name);
+  }
+  if ((size_t)(q - p) >= sizeof(buf)) {
+    rb_raise(rb_eArgError, "row %ld: invalid %s", lineno, name);
+  }
+  memcpy(buf, p, q - p);
+  buf[q - p] = '\0';
+
+  n = strtol(buf, &end, 10);
+  if (*end != '\0') {
+    rb_raise(rb_eArgError, "row %ld: invalid %s", lineno, name);
+  }
+
+  return n;
+}
+
+/*
+ * Adds a CSV line of mecab-dict-index: surface,left_id,right_id,cost,feature...
+ */
+static void
+mecaby_dic_builder_add_line(mecaby_dic_builder_t* builder, long lineno, char const* p, char const* end)
+{
+  int i;
+  char const* fields[4][2];
+
+  while (end > p && (end[-1] == '\n' || end[-1] == '\r')) --end;
+  if (p == end) return;
+
+  for (i = 0; i < 4; ++i) {
+    char const* q = mecaby_feature_field_end(p, end);
+    if (q >= end) {
+      rb_raise(rb_eArgError, "row %ld: too few columns", lineno);
+    }
+    fields[i][0] = p;
+    fields[i][1] = q;
+    p = q + 1;
+  }
+
+  if (fields[0][1] - fields[0][0] >= 2 && *fields[0][0] == '"' && fields[0][1][-1] == '"') {
+    ++fields[0][0];
+    --fields[0][1];
+    mecaby_dic_builder_add(builder, lineno, fields[0][0], fields[0][1] - fields[0][0], 1,
+                           mecaby_dic_parse_int(fields[1][0], fields[1][1], lineno, "left id"),
+                           mecaby_dic_parse_int(fields[2][0], fields[2][1], lineno, "right id"),
+                           mecaby_dic_parse_int(fields[3][0], fields[3][1], lineno, "cost"),
+                           p, end - p);
+    return;
+  }
+
+  mecaby_dic_builder_add(builder, lineno, fields[0][0], fields[0][1] - fields[0][0], 0,
+                         mecaby_dic_parse_int(fields[1][0], fields[1][1], lineno, "left id"),
+                         mecaby_dic_parse_int(fields[2][0], fields[2][1], lineno, "right id"),
+                         mecaby_dic_parse_int(fields[3][0], fields[3][1], lineno, "cost"),
+                         p, end - p);
+}
+
+static void
+mecaby_dic_builder_add_csv(mecaby_dic_builder_t* builder, VALUE csv)
+{
+  long lineno = 0;
+  char const* p;
+  char const* end;
+
+  csv = mecaby_dic_builder_encode(builder, csv);
+  p = RSTRING_PTR(csv);
+  end = p + RSTRING_LEN(csv);
+  while (p < end) {
+    char const* q = memchr(p, '\n', end - p);
+    if (q == NULL) q = end;
+    mecaby_dic_builder_add_line(builder, ++lineno, p, q);
+    p = q + 1;
+  }
+
+  RB_GC_GUARD(csv);
+}
+
+/*
+ * Adds a row of [surface, left_id, right_id, cost, feature], where the
+ * feature is a String or an Array of fields.
+ */
+static void
+mecaby_dic_builder_add_row(mecaby_dic_builder_t* builder, long lineno, VALUE row)
+{
+  VALUE surface, feature, cost;
+
+  if (RB_TYPE_P(row, T_STRING)) {
+    row = mecaby_dic_builder_encode(builder, row);
+    mecaby_dic_builder_add_line(builder, lineno, RSTRING_PTR(row), RSTRING_END(row));
+    return;
+  }
+
+  row = rb_convert_type(row, T_ARRAY, "Array", "to_ary");
+  if (RARRAY_LEN(row) < 5) {
+    rb_raise(rb_eArgError, "row %ld: too few columns", lineno);
+  }
+
+  surface = mecaby_dic_builder_encode(builder, RARRAY_AREF(row, 0));
+  cost = RARRAY_AREF(row, 3);
+  if (NIL_P(cost)) {
+    rb_raise(rb_eArgError, "row %ld: cost is required", lineno);
+  }
+  feature = RARRAY_AREF(row, 4);
+  if (RB_TYPE_P(feature, T_ARRAY)) {
+    feature = rb_ary_join(feature, rb_str_new_cstr(","));
+  }
+  feature = mecaby_dic_builder_encode(builder, feature);
+
+  mecaby_dic_builder_add(builder, lineno, RSTRING_PTR(surface), RSTRING_LEN(surface), 0,
+                         NUM2LONG(RARRAY_AREF(row, 1)), NUM2LONG(RARRAY_AREF(row, 2)), NUM2LONG(cost),
+                         RSTRING_PTR(feature), RSTRING_LEN(feature));
+}
+
+/*
+ * Groups the sorted entries by surface into the keys of the trie.  The
+ * value of a key is the index of its first token shifted by 8 bits plus
+ * the number of its tokens, as mecab-dict-index does.
+ */
+static int
+mecaby_dic_builder_make_keys(mecaby_dic_builder_t* builder)
+{
+  size_t i, first = 0;
+  mecaby_darts_t* da = &builder->darts;
+
+  da->keys = malloc(builder->nentries * sizeof(*da->keys));
+  da->lengths = malloc(builder->nentries * sizeof(*da->lengths));
+  da->values = malloc(builder->nentries * sizeof(*da->values));
+  if (da->keys == NULL || da->lengths == NULL || da->values == NULL) {
+    builder->error = "failed to allocate memory";
+    return 0;
+  }
+
+  da->nkeys = 0;
+  for (i = 1; i <= builder->nentries; ++i) {
+    mecaby_dic_entry_t const* head = &builder->entries[first];
+
+    if (i < builder->nentries &&
+        builder->entries[i].length == head->length &&
+        memcmp(builder->entries[i].surface, head->surface, head->length) == 0) {
+      continue;
+    }
+    if (i - first > 0xff) {
+      builder->error = "too many entries for one surface (max 255)";
+      return 0;
+    }
+    if (first >= (1U << 23)) {
+      builder->error = "too many entries (max 8388608)";
+      return 0;
+    }
+    da->keys[da->nkeys] = head->surface;
+    da->lengths[da->nkeys] = head->length;
+    da->values[da->nkeys] = (int)((first << 8) + (i - first));
+    ++da->nkeys;
+    first = i;
+  }
+
+  return 1;
+}
+
+typedef int mecaby_dic_write_func(void* ctx, void const* p, size_t n);
+
+static int
+mecaby_dic_write_file(void* ctx, void const* p, size_t n)
+{
+  return fwrite(p, 1, n, (FILE*)ctx) == n;
+}
+
+static int
+mecaby_dic_write_memory(void* ctx, void const* p, size_t n)
+{
+  char** buf = ctx;
+
+  memcpy(*buf, p, n);
+  *buf += n;
+  return 1;
+}
+
+static size_t
+mecaby_dic_builder_size(mecaby_dic_builder_t* builder)
+{
+  return MECABY_DIC_HEADER_SIZE
+    + builder->darts.size * sizeof(mecaby_darts_unit_t)
+    + builder->nentries * sizeof(mecaby_dic_token_t)
+    + builder->features_len;
+}
+
+static int
+mecaby_dic_builder_write(mecaby_dic_builder_t* builder, mecaby_dic_write_func* write, void* ctx)
+{
+  size_t i;
+  unsigned int header[10];
+
+  header[0] = (unsigned int)mecaby_dic_builder_size(builder) ^ MECABY_DIC_MAGIC_ID;
+  header[1] = MECABY_DIC_VERSION;
+  header[2] = MECABY_DIC_TYPE_USR;
+  header[3] = (unsigned int)builder->nentries;
+  header[4] = builder->lsize;
+  header[5] = builder->rsize;
+  header[6] = (unsigned int)(builder->darts.size * sizeof(mecaby_darts_unit_t));
+  header[7] = (unsigned int)(builder->nentries * sizeof(mecaby_dic_token_t));
+  header[8] = (unsigned int)builder->features_len;
+  header[9] = 0;
+
+  if (!write(ctx, header, sizeof(header))) return 0;
+  if (!write(ctx, builder->charset, sizeof(builder->charset))) return 0;
+  if (!write(ctx, builder->darts.array, builder->darts.size * sizeof(mecaby_darts_unit_t))) return 0;
+  for (i = 0; i < builder->nentries; ++i) {
+    if (!write(ctx, &builder->entries[i].token, sizeof(mecaby_dic_token_t))) return 0;
+  }
+  if (!write(ctx, builder->features, builder->features_len)) return 0;
+
+  return 1;
+}
+
+/*
+ * Sorts the entries, builds the trie and writes the output file.  This
+ * runs without the GVL and doesn't call any Ruby API.
+ */
+static void*
+mecaby_dic_builder_build(void* ptr)
+{
+  size_t i;
+  FILE* fp;
+  mecaby_dic_builder_t* builder = ptr;
+
+  for (i = 0; i < builder->nentries; ++i) {
+    builder->entries[i].surface = builder->surfaces + builder->entries[i].surface_offset;
+  }
+
+  if (!mecaby_dic_entries_sort(builder->entries, builder->nentries, builder->nthreads)) {
+    builder->error = "failed to allocate memory";
+    return NULL;
+  }
+  if (!mecaby_dic_builder_make_keys(builder)) {
+    return NULL;
+  }
+  if (!mecaby_darts_build(&builder->darts, builder->max_length)) {
+    builder->error = "failed to build the double-array";
+    return NULL;
+  }
+  if (mecaby_dic_builder_size(builder) > UINT_MAX) {
+    builder->error = "dictionary is too large";
+    return NULL;
+  }
+
+  if (builder->output == NULL) {
+    return NULL;
+  }
+
+  fp = fopen(builder->output, "wb");
+  if (fp == NULL) {
+    builder->error_no = errno;
+    return NULL;
+  }
+  if (!mecaby_dic_builder_write(builder, mecaby_dic_write_file, fp)) {
+    builder->error_no = errno;
+  }
+  if (fclose(fp) != 0 && builder->error_no == 0) {
+    builder->error_no = errno;
+  }
+
+  return NULL;
+}
+
+static int
+mecaby_default_build_threads(void)
+{
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) return 1;
+  return n > 8 ? 8 : (int)n;
+#else
+  return 1;
+#endif
+}
+
+struct mecaby_dictionary_compile_args {
+  mecaby_dic_builder_t* builder;
+  VALUE source;
+  VALUE output;
+};
+
+static VALUE
+mecaby_dictionary_compile_body(VALUE ptr)
+{
+  struct mecaby_dictionary_compile_args* args = (struct mecaby_dictionary_compile_args*)ptr;
+  mecaby_dic_builder_t* builder = args->builder;
+  VALUE source = args->source;
+  VALUE result;
+  char* p;
+
+  if (RB_TYPE_P(source, T_ARRAY)) {
+    long i;
+    for (i = 0; i < RARRAY_LEN(source); ++i) {
+      mecaby_dic_builder_add_row(builder, i + 1, RARRAY_AREF(source, i));
+    }
+  }
+  else if (rb_respond_to(source, rb_intern("read"))) {
+    mecaby_dic_builder_add_csv(builder, rb_funcall(source, rb_intern("read"), 0));
+  }
+  else {
+    mecaby_dic_builder_add_csv(builder, source);
+  }
+
+  if (builder->nentries == 0) {
+    rb_raise(rb_eArgError, "no entries");
+  }
+
+  if (!NIL_P(args->output)) {
+    builder->output = StringValueCStr(args->output);
+  }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(mecaby_dic_builder_build, builder, NULL, NULL);
+#else
+  mecaby_dic_builder_build(builder);
+#endif
+
+  if (builder->error != NULL) {
+    rb_raise(mecaby_eError, "%s", builder->error);
+  }
+  if (builder->error_no != 0) {
+    errno = builder->error_no;
+    rb_sys_fail(builder->output);
+  }
+
+  if (!NIL_P(args->output)) {
+    return args->output;
+  }
+
+  result = rb_str_new(NULL, mecaby_dic_builder_size(builder));
+  p = RSTRING_PTR(result);
+  mecaby_dic_builder_write(builder, mecaby_dic_write_memory, &p);
+
+  return result;
+}
+
+static VALUE
+mecaby_dictionary_compile_ensure(VALUE ptr)
+{
+  struct mecaby_dictionary_compile_args* args = (struct mecaby_dictionary_compile_args*)ptr;
+
+  mecaby_dic_builder_free(args->builder);
+
+  return Qnil;
+}
+
+/*
+ * Compiles a user dictionary from CSV rows in the format of
+ * mecab-dict-index (surface,left_id,right_id,cost,feature...).  The
+ * source is an IO or a String of CSV, or an Array of CSV lines or of
+ * [surface, left_id, right_id, cost, feature] rows.
+ *
+ * The model: option gives the system dictionary whose matrix and charset
+ * the user dictionary is compiled for, and the output: option gives the
+ * file to write.  Without output:, the compiled dictionary is returned
+ * as a binary String.  The threads: option is the number of threads to
+ * sort the rows.
+ */
+static VALUE
+mecaby_dictionary_s_compile(int argc, VALUE* argv, VALUE self)
+{
+  VALUE source, opts, vmodel, vthreads;
+  mecaby_model_t* model;
+  mecaby_dic_builder_t builder;
+  mecab_dictionary_info_t const* info;
+  struct mecaby_dictionary_compile_args args;
+
+  rb_scan_args(argc, argv, "11", &source, &opts);
+  opts = NIL_P(opts) ? rb_hash_new() : rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+
+  vmodel = rb_hash_lookup2(opts, ID2SYM(rb_intern("model")), Qnil);
+  if (NIL_P(vmodel)) {
+    rb_raise(rb_eArgError, "model is required");
+  }
+  if (!MECABY_OBJ_IS_MODEL(vmodel)) {
+    vmodel = rb_funcall(mecaby_cModel, rb_intern("shared"), 1, vmodel);
+  }
+  model = check_get_model_initialized(vmodel, rb_eArgError);
+
+  info = mecab_model_dictionary_info(model->model);
+  while (info != NULL && info->type != MECAB_SYS_DIC) {
+    info = info->next;
+  }
+  if (info == NULL) {
+    rb_raise(rb_eArgError, "the model has no system dictionary");
+  }
+
+  memset(&builder, 0, sizeof(builder));
+  builder.lsize = info->lsize;
+  builder.rsize = info->rsize;
+  strncpy(builder.charset, info->charset, sizeof(builder.charset) - 1);
+  builder.encoding = mecaby_decode_charset_to_encoding(info->charset);
+
+  vthreads = rb_hash_lookup2(opts, ID2SYM(rb_intern("threads")), Qnil);
+  builder.nthreads = NIL_P(vthreads) ? mecaby_default_build_threads() : NUM2INT(vthreads);
+
+  args.builder = &builder;
+  args.source = source;
+  args.output = rb_hash_lookup2(opts, ID2SYM(rb_intern("output")), Qnil);
+  if (!NIL_P(args.output)) {
+    FilePathValue(args.output);
+  }
+
+  return rb_ensure(mecaby_dictionary_compile_body, (VALUE)&args, mecaby_dictionary_compile_ensure, (VALUE)&args);
+}
+
+/*
+ * Mecaby::Lattice
+ */
+
+static VALUE
+mecaby_lattice_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE arg;
+  mecaby_lattice_t* lattice = check_get_lattice(self);
+
+  if (lattice->lattice != NULL) {
+    rb_raise(rb_eRuntimeError, "already initialized");
+  }
+
+  rb_scan_args(argc, argv, "01", &arg);
+  if (argc == 0) {
+    lattice->lattice = mecab_lattice_new();
+  }
+  else if (MECABY_OBJ_IS_MODEL(arg)) {
+    mecaby_model_t* model = check_get_model_initialized(arg, rb_eArgError);
+    RB_OBJ_WRITE(self, &lattice->generator, arg);
+    lattice->lattice = mecab_model_new_lattice(model->model);
+    lattice->model = mecaby_model_retain(model);
+    MECABY_ATOMIC_INC(model->nlattices);
+    OBJ_INFECT(self, arg);
+  }
+  else {
+    rb_raise(rb_eArgError, "invalid argument: %"PRIsVALUE, rb_inspect(arg));
+  }
+
+  return self;
+}
+
+static VALUE
+mecaby_lattice_sentence(VALUE self)
+{
+  char const* sentence;
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  sentence = mecab_lattice_get_sentence(lattice->lattice);
+
+  return rb_external_str_new_with_enc(sentence, strlen(sentence), rb_default_external_encoding());
+}
+
+static void
+mecaby_lattice_reset_sentence(mecaby_lattice_t* lattice)
+{
+  lattice->sentence = Qnil;
+  if (lattice->offset_map != NULL) {
+    xfree(lattice->offset_map);
+    lattice->offset_map = NULL;
+  }
+}
+
+/*
+ * Sets the sentence.  The lattice keeps a frozen copy of it because
+ * MeCab refers to the buffer until the next sentence is set.
+ */
+static void
+mecaby_lattice_assign_sentence(VALUE self, VALUE vsentence, int normalize_flags)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  StringValueCStr(vsentence);
+  if (normalize_flags) {
+    mecaby_check_normalizable(vsentence);
+  }
+
+  mecaby_lattice_reset_sentence(lattice);
+  mecaby_node_pool_advance(lattice->node_pool);
+  if (normalize_flags) {
+    lattice->offset_map = ALLOC_N(long, RSTRING_LEN(vsentence) + 1);
+    vsentence = mecaby_normalize(vsentence, normalize_flags, lattice->offset_map);
+  }
+  RB_OBJ_WRITE(self, &lattice->sentence, rb_str_new_frozen(vsentence));
+
+  mecab_lattice_set_sentence2(lattice->lattice, RSTRING_PTR(lattice->sentence), RSTRING_LEN(lattice->sentence));
+}
+
+static VALUE
+mecaby_lattice_sentence_eq(VALUE self, VALUE vsentence)
+{
+  mecaby_lattice_assign_sentence(self, vsentence, 0);
+
+  return vsentence;
+}
+
+/*
+ * Sets the sentence and returns self.  With the normalize: option, the
+ * sentence is normalized before analysis, and the offsets of the
+ * structured output of #to_s point into the given sentence.
+ */
+static VALUE
+mecaby_lattice_set_sentence(int argc, VALUE* argv, VALUE self)
+{
+  VALUE vsentence, opts;
+
+  rb_scan_args(argc, argv, "11", &vsentence, &opts);
+  if (!NIL_P(opts)) {
+    opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+  }
+
+  mecaby_lattice_assign_sentence(self, vsentence, mecaby_normalize_flags(opts));
+
+  return self;
+}
+
+static VALUE
+mecaby_lattice_serialize(mecaby_serializer_t* ser, mecaby_lattice_t* lattice)
+{
+  ser->offset_map = lattice->offset_map;
+  return mecaby_serialize_nodes(ser, mecab_lattice_get_bos_node(lattice->lattice));
+}
+
+static char const*
+mecaby_lattice_output_write(void* arg, char* buf, size_t size)
+{
+  return mecab_lattice_tostr2((mecab_lattice_t*)arg, buf, size);
+}
+
+static char const*
+mecaby_lattice_output_strerror(void* arg)
+{
+  return mecab_lattice_strerror((mecab_lattice_t*)arg);
+}
+
+/*
+ * Returns the result of the last parse.  The format: option selects
+ * :text (default), :json or :msgpack, and the fields: option selects the
+ * keys of each token in the structured formats.
+ *
+ * The into: option gives a String into which the text result is written
+ * and which is returned, replacing its contents or, with append: true,
+ * following them.
+ */
+static VALUE
+mecaby_lattice_to_s(int argc, VALUE* argv, VALUE self)
+{
+  VALUE opts, buf;
+  char const* str;
+  int append;
+  mecaby_serializer_t ser;
+  mecaby_lattice_t* lattice;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  if (!NIL_P(opts)) {
+    opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+  }
+
+  lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+  mecaby_serializer_init(&ser, opts, lattice->model ? &lattice->model->features : NULL);
+  if (lattice->model != NULL) {
+    mecaby_serializer_set_dictionary(&ser, mecab_model_dictionary_info(lattice->model->model));
+  }
+  buf = mecaby_output_buffer_option(opts, &append);
+  if (ser.format != MECABY_FORMAT_TEXT) {
+    if (!NIL_P(buf)) {
+      rb_raise(rb_eArgError, "into: is only for the text format");
+    }
+    return mecaby_lattice_serialize(&ser, lattice);
+  }
+
+  if (!NIL_P(buf)) {
+    return mecaby_output_buffer_write(buf, append, mecab_lattice_get_size(lattice->lattice) * 64,
+        mecaby_lattice_output_write, mecaby_lattice_output_strerror, lattice->lattice);
+  }
+
+  str = mecab_lattice_tostr(lattice->lattice);
+
+  return rb_external_str_new_with_enc(str, strlen(str), rb_default_external_encoding());
+}
+
+/*
+ * Returns the request type, a combination of the Mecaby::Lattice
+ * constants such as MARGINAL_PROB and NBEST.
+ */
+static VALUE
+mecaby_lattice_request_type(VALUE self)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  return INT2NUM(mecab_lattice_get_request_type(lattice->lattice));
+}
+
+static VALUE
+mecaby_lattice_request_type_eq(VALUE self, VALUE vtype)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  mecab_lattice_set_request_type(lattice->lattice, NUM2INT(vtype));
+
+  return vtype;
+}
+
+static VALUE
+mecaby_lattice_add_request_type(VALUE self, VALUE vtype)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  mecab_lattice_add_request_type(lattice->lattice, NUM2INT(vtype));
+
+  return self;
+}
+
+static VALUE
+mecaby_lattice_remove_request_type(VALUE self, VALUE vtype)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  mecab_lattice_remove_request_type(lattice->lattice, NUM2INT(vtype));
+
+  return self;
+}
+
+static VALUE
+mecaby_lattice_has_request_type(VALUE self, VALUE vtype)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  return mecab_lattice_has_request_type(lattice->lattice, NUM2INT(vtype)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Returns the temperature parameter used to compute the marginal
+ * probabilities.
+ */
+static VALUE
+mecaby_lattice_theta(VALUE self)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  return DBL2NUM(mecab_lattice_get_theta(lattice->lattice));
+}
+
+static VALUE
+mecaby_lattice_theta_eq(VALUE self, VALUE vtheta)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  mecab_lattice_set_theta(lattice->lattice, NUM2DBL(vtheta));
+
+  return vtheta;
+}
+
+/*
+ * Returns the normalization factor of the last parse with MARGINAL_PROB.
+ */
+static VALUE
+mecaby_lattice_z(VALUE self)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  return DBL2NUM(mecab_lattice_get_z(lattice->lattice));
+}
+
+static VALUE
+mecaby_lattice_z_eq(VALUE self, VALUE vz)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  mecab_lattice_set_z(lattice->lattice, NUM2DBL(vz));
+
+  return vz;
+}
+
+/*
+ * Clears the sentence and the result of the last parse.  Nodes taken
+ * from the lattice must not be used after that.
+ */
+static VALUE
+mecaby_lattice_clear(VALUE self)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  mecaby_node_pool_advance(lattice->node_pool);
+  mecab_lattice_clear(lattice->lattice);
+  mecaby_lattice_reset_sentence(lattice);
+
+  return self;
+}
+
+/*
+ * Returns true if the lattice has the result of a successful parse.
+ */
+static VALUE
+mecaby_lattice_is_available(VALUE self)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  return mecab_lattice_is_available(lattice->lattice) ? Qtrue : Qfalse;
+}
+
+/*
+ * Returns the BOS node of the last parse, or nil if the lattice has no
+ * result.
+ */
+static VALUE
+mecaby_lattice_bos_node(int argc, VALUE* argv, VALUE self)
+{
+  VALUE opts, vfilter;
+  mecab_node_t const* node;
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  rb_scan_args(argc, argv, "01", &opts);
+  vfilter = mecaby_filter_option(opts);
+
+  if (!mecab_lattice_is_available(lattice->lattice)) {
+    return Qnil;
+  }
+
+  node = mecab_lattice_get_bos_node(lattice->lattice);
+  if (node == NULL) {
+    return Qnil;
+  }
+
+  return mecaby_create_filtered_node(node, self, vfilter, mecaby_filter_bind(vfilter, self));
+}
+
+/*
+ * call-seq:
+ *   lattice.node_pool = true
+ *
+ * Makes the lattice reuse Node objects across parses.  A node taken from
+ * the lattice is valid until the lattice parses again or its sentence is
+ * changed; after that it raises Mecaby::Error, or is rebound to a node of
+ * the new result if the lattice has taken it from the pool again.
+ */
+static VALUE
+mecaby_lattice_set_node_pool(VALUE self, VALUE venabled)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  return mecaby_node_pool_set(self, &lattice->node_pool, venabled);
+}
+
+static VALUE
+mecaby_lattice_has_node_pool(VALUE self)
+{
+  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+
+  return lattice->node_pool != NULL && lattice->node_pool->enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * Returns the best path of the last parse as a Mecaby::Tokens, which
+ * stays valid after the lattice parses again or is cleared.
+ */
+static VALUE
+mecaby_lattice_snapshot(int argc, VALUE* argv, VALUE self)
+{
+  VALUE opts, vfilter;
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  rb_scan_args(argc, argv, "01", &opts);
+  vfilter = mecaby_filter_option(opts);
+
+  if (!mecab_lattice_is_available(lattice->lattice)) {
+    rb_raise(mecaby_eError, "the lattice has no result");
   }
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
-#endif
-};
 
-#define MECABY_OBJ_IS_LATTICE(obj) rb_typeddata_is_kind_of((obj), &mecaby_lattice_data_type)
+  return mecaby_tokens_new(mecab_lattice_get_bos_node(lattice->lattice), mecaby_feature_table_for(self),
+                           NIL_P(vfilter) ? NULL : check_get_filter(vfilter), mecaby_filter_bind(vfilter, self));
+}
 
-DEFINE_GETTER_AND_CHECKER(lattice, Lattice);
+/*
+ * Parses the lattice without blocking other fibers and threads.  The
+ * tagger defaults to the current thread's tagger of the lattice's model.
+ */
+static VALUE
+mecaby_lattice_parse_async(int argc, VALUE* argv, VALUE self)
+{
+  VALUE vtagger;
+  mecaby_lattice_t* lattice = check_get_lattice_idle(self, rb_eRuntimeError);
+
+  rb_scan_args(argc, argv, "01", &vtagger);
+  if (NIL_P(vtagger)) {
+    if (!MECABY_OBJ_IS_MODEL(lattice->generator)) {
+      rb_raise(rb_eArgError, "tagger is required for the lattice not created by a model");
+    }
+    vtagger = mecaby_model_tagger_for_current_thread(lattice->generator);
+  }
+
+  return mecaby_parse_lattice_async(vtagger, self);
+}
 #endif /* HAVE_MECAB_MODEL_NEW */
 
-static void
-mecaby_tagger_mark(void *ptr)
+/*
+ * Mecaby::Tagger
+ */
+
+static VALUE
+mecaby_tagger_initialize(int argc, VALUE* argv, VALUE self)
 {
-  mecaby_tagger_t* tagger = ptr;
+  VALUE arg;
+  mecaby_tagger_t* tagger = check_get_tagger(self);
 
-  if (tagger != NULL) {
-    rb_gc_mark(tagger->generator);
+  if (tagger->tagger != NULL) {
+    rb_raise(rb_eRuntimeError, "already initialized");
+  }
+
+  rb_scan_args(argc, argv, "01", &arg);
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (argc > 0 && MECABY_OBJ_IS_MODEL(arg)) {
+    mecaby_model_t* model = check_get_model_initialized(arg, rb_eArgError);
+    RB_OBJ_WRITE(self, &tagger->generator, arg);
+    tagger->tagger = mecab_model_new_tagger(model->model);
+    tagger->model = mecaby_model_retain(model);
+    MECABY_ATOMIC_INC(model->ntaggers);
+    OBJ_INFECT(self, arg);
+
+    if (tagger->tagger == NULL) {
+      rb_raise(rb_eRuntimeError, "%s:%d: mecab_tagger_initialize: %s", __FILE__, __LINE__, mecab_strerror(NULL));
+    }
+  }
+  else
+#endif
+  {
+    mecab_t* mecab;
+    VALUE generator = Qnil;
+
+    if (argc > 0) {
+      VALUE ary = rb_check_array_type(arg);
+      generator = rb_obj_dup(NIL_P(ary) ? arg : ary);
+    }
+    mecab = mecaby_load(generator, 1, "mecab_tagger_initialize");
+
+    /* another thread may have initialized it while the GVL was released */
+    if (tagger->tagger != NULL) {
+      mecab_destroy(mecab);
+      rb_raise(rb_eRuntimeError, "already initialized");
+    }
+    RB_OBJ_WRITE(self, &tagger->generator, generator);
+    tagger->tagger = mecab;
+  }
+
+  if (!NIL_P(tagger->generator)
+#ifdef HAVE_MECAB_MODEL_NEW
+      && !MECABY_OBJ_IS_MODEL(tagger->generator)
+#endif
+      ) {
+    rb_obj_freeze(tagger->generator);
   }
+
+  mecaby_register_pointer_object(tagger->tagger, self);
+  return self;
 }
 
-static void
-mecaby_tagger_free(void *ptr)
+static VALUE
+mecaby_tagger_inspect(VALUE self)
 {
-  mecaby_tagger_t* tagger = ptr;
+  VALUE str, cname;
+  mecaby_tagger_t* tagger = check_get_tagger(self);
 
-  if (tagger != NULL) {
-    if (tagger->tagger != NULL) {
-      mecaby_unregister_pointer(tagger->tagger);
-      mecab_destroy(tagger->tagger);
+  if (NIL_P(tagger->generator)) {
+    return rb_call_super(0, NULL);
+  }
+
+  cname = rb_class_name(CLASS_OF(self));
+  if (tagger->tagger != NULL) {
+#ifdef HAVE_MECAB_MODEL_NEW
+    if (MECABY_OBJ_IS_MODEL(tagger->generator)) {
+      str = rb_sprintf("#<%"PRIsVALUE":%p model=%"PRIsVALUE">", cname, (void*)self, tagger->generator);
     }
-    tagger->generator = Qnil;
-    xfree(tagger);
+    else
+#endif
+    {
+      str = rb_sprintf("#<%"PRIsVALUE":%p arg=%"PRIsVALUE">", cname, (void*)self, rb_inspect(tagger->generator));
+    }
+  }
+  else {
+      str = rb_sprintf("#<%"PRIsVALUE":%p uninitialized>", cname, (void*)self);
   }
+  OBJ_INFECT(str, self);
+
+  return str;
 }
 
-static size_t
-mecaby_tagger_memsize(void const *ptr)
+static VALUE
+mecaby_tagger_dictionary_info(VALUE self)
 {
-  return sizeof(mecaby_tagger_t);
+  VALUE obj;
+  mecab_dictionary_info_t const* mecab_di;
+  mecaby_tagger_t* tagger = check_get_tagger(self);
+
+  mecab_di = mecab_dictionary_info(tagger->tagger);
+  return mecaby_create_dictionary_info(mecab_di, self);
 }
 
-static const rb_data_type_t mecaby_tagger_data_type = {
-  "mecaby::Tagger",
-  {
-    mecaby_tagger_mark,
-    mecaby_tagger_free,
-    mecaby_tagger_memsize,
+static VALUE
+mecaby_tagger_feature_fields(VALUE self)
+{
+  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
+
+  return mecaby_tagger_feature_table(tagger)->field_names;
+}
+
+/*
+ * Sets the names of the feature fields used by Node#pos, Node#base_form
+ * and Node#reading.  The taggers created by the same model share them,
+ * so this raises FrozenError when the model is frozen, as
+ * Model#feature_fields= does.
+ */
+static VALUE
+mecaby_tagger_set_feature_fields(VALUE self, VALUE names)
+{
+  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (tagger->model != NULL) {
+    rb_check_frozen(tagger->generator);
   }
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
 #endif
-};
+  mecaby_feature_table_set_field_names(mecaby_tagger_feature_table(tagger), names);
 
-#define MECABY_OBJ_IS_TAGGER(obj) rb_typeddata_is_kind_of((obj), &mecaby_tagger_data_type)
-
-DEFINE_GETTER_AND_CHECKER(tagger, Tagger);
+  return names;
+}
 
-static void
-mecaby_dictionary_info_mark(void *ptr)
+/*
+ * Returns the fast path configuration as a Hash, or nil when it is
+ * disabled.
+ */
+static VALUE
+mecaby_tagger_fast_path(VALUE self)
 {
-  mecaby_dictionary_info_t* di = ptr;
+  VALUE hash;
+  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
 
-  if (di != NULL) {
-    rb_gc_mark(di->generator);
+  if (tagger->fast_path_min_length == 0) {
+    return Qnil;
   }
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("min_length")), SIZET2NUM(tagger->fast_path_min_length));
+  rb_hash_aset(hash, ID2SYM(rb_intern("feature")), tagger->fast_path_feature);
+
+  return hash;
 }
 
-static void
-mecaby_dictionary_info_free(void *ptr)
+/*
+ * Enables the fast path with a Hash of feature: (required) and
+ * min_length: (16 by default), or disables it with nil.  Runs of ASCII
+ * letters or digits at least min_length bytes long become tokens with
+ * the feature without being analyzed by MeCab.
+ *
+ * The runs are found byte by byte, so the fast path is only for UTF-8,
+ * EUC-JP and ASCII dictionaries, whose multibyte characters have no
+ * ASCII bytes.  Other dictionaries raise ArgumentError.
+ */
+static VALUE
+mecaby_tagger_set_fast_path(VALUE self, VALUE opts)
 {
-  mecaby_dictionary_info_t* di = ptr;
+  VALUE vfeature, vmin_length;
+  size_t min_length = 16;
+  rb_encoding* enc;
+  mecab_dictionary_info_t const* info;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  if (NIL_P(opts)) {
+    tagger->fast_path_min_length = 0;
+    tagger->fast_path_feature = Qnil;
+    return opts;
+  }
 
-  if (di != NULL) {
-    if (di->dictionary_info != NULL) {
-      mecaby_unregister_pointer(di->dictionary_info);
-      /* shouldn't free di->dictionary_info pointer. */
+  info = mecab_dictionary_info(tagger->tagger);
+  enc = mecaby_decode_charset_to_encoding(info->charset);
+  if (enc != rb_utf8_encoding() && enc != rb_usascii_encoding() && enc != rb_enc_find("EUC-JP")) {
+    rb_raise(rb_eArgError, "the fast path is not available for a %s dictionary", info->charset);
+  }
+
+  opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+  vfeature = rb_hash_lookup2(opts, ID2SYM(rb_intern("feature")), Qnil);
+  if (NIL_P(vfeature)) {
+    rb_raise(rb_eArgError, "feature is required");
+  }
+  StringValue(vfeature);
+  vfeature = rb_str_dup(vfeature);
+  StringValueCStr(vfeature);
+
+  vmin_length = rb_hash_lookup2(opts, ID2SYM(rb_intern("min_length")), Qnil);
+  if (!NIL_P(vmin_length)) {
+    min_length = NUM2SIZET(vmin_length);
+    if (min_length == 0) {
+      rb_raise(rb_eArgError, "min_length must be positive");
     }
-    di->generator = Qnil;
-    xfree(di);
   }
+
+  RB_OBJ_WRITE(self, &tagger->fast_path_feature, rb_obj_freeze(vfeature));
+  tagger->fast_path_min_length = min_length;
+
+  return opts;
 }
 
-static size_t
-mecaby_dictionary_info_memsize(void const *ptr)
+/*
+ * call-seq:
+ *   tagger.node_pool = true
+ *
+ * Makes parse_to_node reuse Node objects across parses instead of
+ * allocating one per node.  A node is valid until the tagger parses
+ * again; after that it raises Mecaby::Error, or is rebound to a node of
+ * the new result if the tagger has taken it from the pool again.
+ */
+static VALUE
+mecaby_tagger_set_node_pool(VALUE self, VALUE venabled)
 {
-  return sizeof(mecaby_dictionary_info_t);
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  return mecaby_node_pool_set(self, &tagger->node_pool, venabled);
 }
 
-static const rb_data_type_t mecaby_dictionary_info_data_type = {
-  "Mecaby::DictionaryInfo",
-  {
-    mecaby_dictionary_info_mark,
-    mecaby_dictionary_info_free,
-    mecaby_dictionary_info_memsize,
+static VALUE
+mecaby_tagger_has_node_pool(VALUE self)
+{
+  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
+
+  return tagger->node_pool != NULL && tagger->node_pool->enabled ? Qtrue : Qfalse;
+}
+
+#ifdef HAVE_MECAB_MODEL_NEW
+static VALUE
+mecaby_tagger_parse_lattice(VALUE self, VALUE vlattice)
+{
+  int result;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+  mecaby_lattice_t* lattice = check_get_lattice_idle(vlattice, rb_eArgError);
+
+  mecaby_node_pool_advance(lattice->node_pool);
+  result = mecab_parse_lattice(tagger->tagger, lattice->lattice);
+  if (result) {
+    mecaby_lattice_update_usage(lattice);
   }
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+
+  return result ? Qtrue : Qfalse;
+}
 #endif
-};
 
-#define MECABY_OBJ_IS_DICTIONARY_INFO(obj) rb_typeddata_is_kind_of((obj), &mecaby_dictionary_info_data_type)
+static VALUE
+mecaby_tagger_parse_string(VALUE self, VALUE vinput)
+{
+  int result;
+  const char* input;
+  const char* output;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  input = StringValueCStr(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+  output = mecab_sparse_tostr(tagger->tagger, input);
+
+  return rb_external_str_new_with_enc(output, strlen(output), rb_default_external_encoding());
+}
+
+typedef struct {
+  mecab_t* tagger;
+  char const* input;
+  size_t len;
+} mecaby_tagger_output_t;
+
+static char const*
+mecaby_tagger_output_write(void* arg, char* buf, size_t size)
+{
+  mecaby_tagger_output_t* out = arg;
+
+  return mecab_sparse_tostr3(out->tagger, out->input, out->len, buf, size);
+}
+
+static char const*
+mecaby_tagger_output_strerror(void* arg)
+{
+  return mecab_strerror(((mecaby_tagger_output_t*)arg)->tagger);
+}
+
+/*
+ * Parses the string into the buffer.  A result which does not fit is
+ * parsed again after the buffer grows, which stops happening once the
+ * buffer has reached the size of the results.
+ */
+static VALUE
+mecaby_tagger_parse_string_into(VALUE self, VALUE vinput, VALUE buf, int append)
+{
+  mecaby_tagger_output_t out;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  StringValue(vinput);
+  if (vinput == buf ||
+      (RSTRING_PTR(vinput) < RSTRING_PTR(buf) + rb_str_capacity(buf) &&
+       RSTRING_PTR(buf) < RSTRING_PTR(vinput) + RSTRING_LEN(vinput))) {
+    rb_raise(rb_eArgError, "into: must not share its bytes with the input");
+  }
+  out.tagger = tagger->tagger;
+  out.input = RSTRING_PTR(vinput);
+  out.len = RSTRING_LEN(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+
+  return mecaby_output_buffer_write(buf, append, out.len * 16,
+      mecaby_tagger_output_write, mecaby_tagger_output_strerror, &out);
+}
+
+static VALUE
+mecaby_tagger_serialize_string(VALUE self, mecaby_serializer_t* ser, VALUE vinput)
+{
+  mecab_node_t const* node;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  StringValue(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+  if (tagger->fast_path_min_length > 0) {
+    return mecaby_tagger_serialize_fast_path(tagger, ser, RSTRING_PTR(vinput), RSTRING_LEN(vinput));
+  }
+
+  node = mecab_sparse_tonode2(tagger->tagger, RSTRING_PTR(vinput), RSTRING_LEN(vinput));
+  if (node == NULL) {
+    rb_raise(mecaby_eError, "%s", mecab_strerror(tagger->tagger));
+  }
+
+  return mecaby_serialize_nodes(ser, node);
+}
+
+/*
+ * Parses a String or a Lattice.  The format: option selects :text
+ * (default), :json or :msgpack output, and the fields: option selects
+ * the keys of each token in the structured formats (:surface and
+ * :feature by default).  A Lattice gives true or false in the text
+ * format, and its serialized result or nil otherwise.
+ *
+ * The normalize: option (true, :width or :case) normalizes a String
+ * before analysis.  The offsets in the structured formats still point
+ * into the given String.
+ *
+ * The into: option gives a String into which the text result of a
+ * String is written and which is returned instead of a new String.  It
+ * replaces the contents of the buffer, or follows them with append: true.
+ */
+static VALUE
+mecaby_tagger_parse(int argc, VALUE* argv, VALUE self)
+{
+  VALUE target, opts, result, buf, vmap = 0;
+  mecaby_serializer_t ser;
+  int normalize_flags, append;
+
+  rb_scan_args(argc, argv, "11", &target, &opts);
+  if (!NIL_P(opts)) {
+    opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+  }
+
+  mecaby_serializer_init(&ser, opts,
+      mecaby_tagger_feature_table(check_get_tagger_initialized(self, rb_eRuntimeError)));
+  mecaby_serializer_set_dictionary(&ser, mecab_dictionary_info(get_tagger(self)->tagger));
+
+  normalize_flags = mecaby_normalize_flags(opts);
+  buf = mecaby_output_buffer_option(opts, &append);
+  if (!NIL_P(buf) && ser.format != MECABY_FORMAT_TEXT) {
+    rb_raise(rb_eArgError, "into: is only for the text format");
+  }
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (MECABY_OBJ_IS_LATTICE(target)) {
+    if (normalize_flags) {
+      rb_raise(rb_eArgError, "normalize: is given to Lattice#set_sentence for a lattice");
+    }
+    if (!NIL_P(buf)) {
+      rb_raise(rb_eArgError, "into: is given to Lattice#to_s for a lattice");
+    }
+    result = mecaby_tagger_parse_lattice(self, target);
+    if (ser.format == MECABY_FORMAT_TEXT) {
+      return result;
+    }
+    if (!RTEST(result)) {
+      return Qnil;
+    }
+    return mecaby_lattice_serialize(&ser, check_get_lattice_idle(target, rb_eArgError));
+  }
+#endif
+
+  if (normalize_flags) {
+    long* map;
+
+    StringValue(target);
+    mecaby_check_normalizable(target);
+    map = ALLOCV_N(long, vmap, RSTRING_LEN(target) + 1);
+    target = mecaby_normalize(target, normalize_flags, map);
+    ser.offset_map = map;
+  }
+
+  if (ser.format != MECABY_FORMAT_TEXT) {
+    result = mecaby_tagger_serialize_string(self, &ser, target);
+  }
+  else if (!NIL_P(buf)) {
+    result = mecaby_tagger_parse_string_into(self, target, buf, append);
+  }
+  else {
+    result = mecaby_tagger_parse_string(self, target);
+  }
 
-DEFINE_GETTER_AND_CHECKER(dictionary_info, DictionaryInfo);
+  if (vmap) {
+    ALLOCV_END(vmap);
+  }
 
-static VALUE mecaby_create_dictionary_info(mecab_dictionary_info_t const*, VALUE);
+  return result;
+}
 
-static void
-mecaby_node_mark(void *ptr)
+static VALUE
+mecaby_tagger_nbest_parse(VALUE self, VALUE vn, VALUE vinput)
 {
-  mecaby_node_t* node = ptr;
-  if (node != NULL) {
-    rb_gc_mark(node->generator);
+  size_t n;
+  const char* input;
+  const char* output;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  input = StringValueCStr(vinput);
+  n = NUM2SIZET(vn);
+  mecaby_node_pool_advance(tagger->node_pool);
+  output = mecab_nbest_sparse_tostr(tagger->tagger, n, input);
+  if (output == NULL) {
+    rb_raise(mecaby_eError, "%s", mecab_strerror(tagger->tagger));
   }
+
+  return rb_external_str_new_with_enc(output, strlen(output), rb_default_external_encoding());
 }
 
-static void
-mecaby_node_free(void *ptr)
+static VALUE
+mecaby_tagger_nbest_init(VALUE self, VALUE vinput)
 {
-  mecaby_node_t* node = ptr;
-  if (node != NULL) {
-    if (node->node) {
-      mecaby_unregister_pointer(node->node);
-      /* shouldn't free node->node pointer. */
-    }
-    node->generator = Qnil;
-    xfree(node);
-  }
+  const char* input;
+  int result;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  input = StringValueCStr(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+  result = mecab_nbest_init(tagger->tagger, input);
+
+  return result ? Qtrue : Qfalse;
 }
 
-static size_t
-mecaby_node_memsize(void const *ptr)
+static VALUE
+mecaby_tagger_nbest_next(VALUE self)
 {
-  return sizeof(mecaby_node_t);
+  char const* output;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+
+  mecaby_node_pool_advance(tagger->node_pool);
+  output = mecab_nbest_next_tostr(tagger->tagger);
+  if (output == NULL) return Qnil;
+
+  return rb_external_str_new_with_enc(output, strlen(output), rb_default_external_encoding());
 }
 
-static const rb_data_type_t mecaby_node_data_type = {
-  "Mecaby::Node",
-  {
-    mecaby_node_mark,
-    mecaby_node_free,
-    mecaby_node_memsize,
-  }
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
-#endif
-};
+/*
+ * call-seq:
+ *   tagger.parse_to_node(str, filter: nil) -> Mecaby::Node
+ *
+ * Parses the string and returns the BOS node.  With filter:, the nodes
+ * traversed from it skip the tokens which the Mecaby::Filter rejects.
+ */
+static VALUE
+mecaby_tagger_parse_to_node(int argc, VALUE* argv, VALUE self)
+{
+  char const* input;
+  VALUE vinput, opts, vfilter;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
+  mecab_node_t const* mecab_node;
 
-#define MECABY_OBJ_IS_NODE(obj) rb_typeddata_is_kind_of((obj), &mecaby_node_data_type)
+  rb_scan_args(argc, argv, "11", &vinput, &opts);
+  vfilter = mecaby_filter_option(opts);
 
-DEFINE_GETTER_AND_CHECKER(node, Node);
+  input = StringValueCStr(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+  mecab_node = mecab_sparse_tonode(tagger->tagger, input);
 
-static VALUE mecaby_create_node(mecab_node_t const*, VALUE);
+  return mecaby_create_filtered_node(mecab_node, self, vfilter, mecaby_filter_bind(vfilter, self));
+}
 
-static void
-mecaby_path_mark(void *ptr)
+/*
+ * Parses the string and returns the best path as a Mecaby::Tokens, which
+ * stays valid after the tagger parses again.
+ */
+static VALUE
+mecaby_tagger_parse_to_tokens(int argc, VALUE* argv, VALUE self)
 {
-  mecaby_path_t* path = ptr;
+  VALUE vinput, opts, vfilter;
+  mecab_node_t const* node;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
 
-  if (path != NULL) {
-    rb_gc_mark(path->generator);
+  rb_scan_args(argc, argv, "11", &vinput, &opts);
+  vfilter = mecaby_filter_option(opts);
+
+  StringValue(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+  node = mecab_sparse_tonode2(tagger->tagger, RSTRING_PTR(vinput), RSTRING_LEN(vinput));
+  if (node == NULL) {
+    rb_raise(mecaby_eError, "%s", mecab_strerror(tagger->tagger));
   }
+
+  return mecaby_tokens_new(node, mecaby_feature_table_for(self),
+                           NIL_P(vfilter) ? NULL : check_get_filter(vfilter), mecaby_filter_bind(vfilter, self));
 }
 
+struct mecaby_term_frequencies_args {
+  VALUE self;
+  VALUE inputs;
+  int many;
+  mecaby_term_counter_t counter;
+};
+
 static void
-mecaby_path_free(void *ptr)
+mecaby_tagger_count_terms(VALUE self, mecaby_term_counter_t* counter, VALUE vinput)
 {
-  mecaby_path_t* path = ptr;
+  mecab_node_t const* node;
+  mecaby_tagger_t* tagger = check_get_tagger_idle(self);
 
-  if (path != NULL) {
-    if (path->path != NULL) {
-      mecaby_unregister_pointer(path->path);
-      /* shouldn't free path->path pointer. */
-    }
-    path->generator = Qnil;
-    xfree(path);
+  StringValue(vinput);
+  mecaby_node_pool_advance(tagger->node_pool);
+  node = mecab_sparse_tonode2(tagger->tagger, RSTRING_PTR(vinput), RSTRING_LEN(vinput));
+  if (node == NULL) {
+    rb_raise(mecaby_eError, "%s", mecab_strerror(tagger->tagger));
   }
+
+  mecaby_term_counter_put_nodes(counter, node);
 }
 
-static size_t
-mecaby_path_memsize(void const *ptr)
+static VALUE
+mecaby_tagger_term_frequencies_body(VALUE ptr)
 {
-  return sizeof(mecaby_path_t);
-}
+  long i;
+  VALUE results;
+  struct mecaby_term_frequencies_args* args = (struct mecaby_term_frequencies_args*)ptr;
 
-static const rb_data_type_t mecaby_path_data_type = {
-  "Mecaby::Path",
-  {
-    mecaby_path_mark,
-    mecaby_path_free,
-    mecaby_path_memsize,
+  if (!args->many) {
+    mecaby_tagger_count_terms(args->self, &args->counter, args->inputs);
+    return mecaby_term_counter_take(&args->counter);
   }
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
-#endif
-};
-
-#define MECABY_OBJ_IS_PATH(obj) rb_typeddata_is_kind_of((obj), &mecaby_path_data_type)
 
-DEFINE_GETTER_AND_CHECKER(path, Path);
+  results = rb_ary_new2(RARRAY_LEN(args->inputs));
+  for (i = 0; i < RARRAY_LEN(args->inputs); ++i) {
+    mecaby_tagger_count_terms(args->self, &args->counter, RARRAY_AREF(args->inputs, i));
+    rb_ary_push(results, mecaby_term_counter_take(&args->counter));
+  }
 
-/*
- * Allocate methods
- */
+  return results;
+}
 
-#ifdef HAVE_MECAB_MODEL_NEW
 static VALUE
-mecaby_model_s_allocate(VALUE klass)
+mecaby_tagger_term_frequencies_ensure(VALUE ptr)
 {
-  mecaby_model_t* model;
-  VALUE obj = TypedData_Make_Struct(klass, mecaby_model_t, &mecaby_model_data_type, model);
-  model->arg = Qnil;
-  model->model = NULL;
-  return obj;
+  struct mecaby_term_frequencies_args* args = (struct mecaby_term_frequencies_args*)ptr;
+
+  mecaby_term_counter_free(&args->counter);
+
+  return Qnil;
 }
 
 static VALUE
-mecaby_lattice_s_allocate(VALUE klass)
+mecaby_tagger_count_terms_with(int argc, VALUE* argv, VALUE self, int many)
 {
-  mecaby_lattice_t* lattice;
-  VALUE obj = TypedData_Make_Struct(klass, mecaby_lattice_t, &mecaby_lattice_data_type, lattice);
-  lattice->generator = Qnil;
-  lattice->lattice = NULL;
-  return obj;
+  VALUE opts, vfilter;
+  struct mecaby_term_frequencies_args args;
+
+  rb_scan_args(argc, argv, "11", &args.inputs, &opts);
+  check_get_tagger_idle(self);
+  if (many) {
+    args.inputs = rb_convert_type(args.inputs, T_ARRAY, "Array", "to_ary");
+  }
+  if (!NIL_P(opts)) {
+    opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+  }
+  args.self = self;
+  args.many = many;
+  vfilter = mecaby_filter_option(opts);
+  mecaby_term_counter_init(&args.counter, opts, mecaby_feature_table_for(self));
+  if (!NIL_P(vfilter)) {
+    args.counter.filter = check_get_filter(vfilter);
+    args.counter.filter_bits = mecaby_filter_bind(vfilter, self);
+  }
+
+  return rb_ensure(mecaby_tagger_term_frequencies_body, (VALUE)&args, mecaby_tagger_term_frequencies_ensure, (VALUE)&args);
 }
-#endif /* HAVE_MECAB_MODEL_NEW */
 
+/*
+ * call-seq:
+ *   tagger.term_frequencies(str, fields: :base_form, pos_filter: nil) -> Hash
+ *
+ * Parses the string and returns a Hash of each term to its count.  A term
+ * is the fields of a token (:surface, :feature, :pos, :base_form or
+ * :reading) joined by "/"; a missing base form or reading is replaced by
+ * the surface.  pos_filter: is a POS prefix or an Array of them, such as
+ * "名詞" or "動詞,自立", and restricts the terms to the tokens matching
+ * one of them.
+ */
 static VALUE
-mecaby_tagger_s_allocate(VALUE klass)
+mecaby_tagger_term_frequencies(int argc, VALUE* argv, VALUE self)
 {
-  mecaby_tagger_t* tagger;
-  VALUE obj = TypedData_Make_Struct(klass, mecaby_tagger_t, &mecaby_tagger_data_type, tagger);
-  tagger->generator = Qnil;
-  tagger->tagger = NULL;
-  return obj;
+  return mecaby_tagger_count_terms_with(argc, argv, self, 0);
 }
 
+/*
+ * call-seq:
+ *   tagger.term_frequencies_many(strs, fields: :base_form, pos_filter: nil) -> Array
+ *
+ * Returns an Array of the term frequencies of each string, compiling the
+ * options only once.
+ */
 static VALUE
-mecaby_dictionary_info_s_allocate(VALUE klass)
+mecaby_tagger_term_frequencies_many(int argc, VALUE* argv, VALUE self)
 {
-  mecaby_dictionary_info_t* di;
-  VALUE obj = TypedData_Make_Struct(klass, mecaby_dictionary_info_t, &mecaby_dictionary_info_data_type, di);
-  di->generator = Qnil;
-  di->dictionary_info = NULL;
-  return obj;
+  return mecaby_tagger_count_terms_with(argc, argv, self, 1);
 }
 
 static VALUE
-mecaby_node_s_allocate(VALUE klass)
+mecaby_tagger_parse_string_async(VALUE self, VALUE vinput)
 {
-  mecaby_node_t* node;
-  VALUE obj = TypedData_Make_Struct(klass, mecaby_node_t, &mecaby_node_data_type, node);
-  node->generator = Qnil;
-  node->node = NULL;
-  return obj;
+  struct mecaby_parse_async_args args;
+
+  args.tagger = check_get_tagger_idle(self);
+#ifdef HAVE_MECAB_MODEL_NEW
+  args.lattice = NULL;
+  args.job.lattice = NULL;
+#endif
+  vinput = rb_str_new_frozen(vinput);
+  args.job.tagger = args.tagger->tagger;
+  args.job.input = StringValueCStr(vinput);
+  args.job.length = RSTRING_LEN(vinput);
+  args.job.output = NULL;
+
+  mecaby_parse_async(&args);
+  RB_GC_GUARD(vinput);
+
+  if (args.job.output == NULL) {
+    rb_raise(mecaby_eError, "%s", mecab_strerror(args.tagger->tagger));
+  }
+
+  return rb_external_str_new_with_enc(args.job.output, strlen(args.job.output), rb_default_external_encoding());
 }
 
+/*
+ * Same as parse, but MeCab runs without blocking other threads, and
+ * under a fiber scheduler only the calling fiber waits for the result.
+ */
 static VALUE
-mecaby_path_s_allocate(VALUE klass)
+mecaby_tagger_parse_async(VALUE self, VALUE target)
 {
-  mecaby_path_t* path;
-  VALUE obj = TypedData_Make_Struct(klass, mecaby_path_t, &mecaby_path_data_type, path);
-  path->generator = Qnil;
-  path->path = NULL;
-  return obj;
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (MECABY_OBJ_IS_LATTICE(target)) {
+    return mecaby_parse_lattice_async(self, target);
+  }
+#endif
+
+  return mecaby_tagger_parse_string_async(self, target);
 }
 
-#ifdef HAVE_MECAB_MODEL_NEW
 /*
- * Mecaby::Model
+ * Sentences
+ *
+ * A sentence ends after a run of terminators: "\n", "!" and "?", and in
+ * UTF-8 also "。", "．", "！" and "？".  The ASCII terminators never
+ * appear in the trail bytes of Shift_JIS and EUC-JP, so the bytes can be
+ * scanned without decoding the characters.
  */
 
-static VALUE
-mecaby_model_initialize(int argc, VALUE* argv, VALUE self)
+static int
+mecaby_sentence_terminator_length(char const* p, char const* end, int utf8)
 {
-  VALUE arg;
-  mecaby_model_t* model = check_get_model(self);
+  if (*p == '\n' || *p == '!' || *p == '?') return 1;
+  if (!utf8 || end - p < 3) return 0;
 
-  if (model->model != NULL) {
-    rb_raise(rb_eRuntimeError, "already initialized");
+  if ((unsigned char)p[0] == 0xe3 && (unsigned char)p[1] == 0x80 && (unsigned char)p[2] == 0x82) {
+    return 3;
+  }
+  if ((unsigned char)p[0] == 0xef && (unsigned char)p[1] == 0xbc &&
+      ((unsigned char)p[2] == 0x8e || (unsigned char)p[2] == 0x81 || (unsigned char)p[2] == 0x9f)) {
+    return 3;
   }
 
-  rb_scan_args(argc, argv, "01", &arg);
-  if (argc == 0) {
-    model->model = mecab_model_new2("-C");
+  return 0;
+}
+
+/*
+ * Returns the end of the sentence starting at p, or end if the text has
+ * no more terminators.
+ */
+static char const*
+mecaby_sentence_end(char const* p, char const* end, int utf8)
+{
+  int n;
+
+  while (p < end && (n = mecaby_sentence_terminator_length(p, end, utf8)) == 0) {
+    ++p;
+  }
+  while (p < end && (n = mecaby_sentence_terminator_length(p, end, utf8)) > 0) {
+    p += n;
   }
-  else {
-    VALUE ary = rb_check_array_type(arg);
 
-    if (NIL_P(ary)) {
-      char const* str = StringValueCStr(arg);
-      model->arg = rb_obj_dup(arg);
-      model->model = mecab_model_new2(str);
-    }
-    else {
-      int i, n;
-      char** args;
+  return p;
+}
 
-      n = RARRAY_LEN(ary);
-      args = ALLOCA_N(char*, n);
-      for (i = 0; i < n; ++i) {
-        VALUE item = RARRAY_AREF(ary, i);
-        args[i] = StringValueCStr(item);
-      }
-      model->arg = rb_obj_dup(ary);
-      model->model = mecab_model_new(n, args);
+#ifdef HAVE_MECAB_MODEL_NEW
+/*
+ * Mecaby::Document
+ *
+ * A text with the tokens of its sentences.  Each sentence is analyzed
+ * separately with the lattice of the document, so an edit re-analyzes
+ * only the sentences it touches and the tokens of the others are kept.
+ */
+
+typedef struct mecaby_document {
+  VALUE model;
+  VALUE lattice;
+  VALUE text;
+  mecaby_tokens_part_t* sentences;
+  long nsentences;
+  long capa;
+  VALUE tokens;
+  long reparsed_sentences;
+  long reparsed_bytes;
+} mecaby_document_t;
+
+static void
+mecaby_document_mark(void *ptr)
+{
+  mecaby_document_t* doc = ptr;
+
+  if (doc != NULL) {
+    long i;
+
+    mecaby_gc_mark_movable(doc->model);
+    mecaby_gc_mark_movable(doc->lattice);
+    mecaby_gc_mark_movable(doc->text);
+    mecaby_gc_mark_movable(doc->tokens);
+    for (i = 0; i < doc->nsentences; ++i) {
+      mecaby_gc_mark_movable(doc->sentences[i].tokens);
     }
   }
+}
 
-  if (!NIL_P(model->arg)) {
-    rb_obj_freeze(model->arg);
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+mecaby_document_compact(void *ptr)
+{
+  mecaby_document_t* doc = ptr;
+  long i;
+
+  MECABY_GC_UPDATE(doc->model);
+  MECABY_GC_UPDATE(doc->lattice);
+  MECABY_GC_UPDATE(doc->text);
+  MECABY_GC_UPDATE(doc->tokens);
+  for (i = 0; i < doc->nsentences; ++i) {
+    MECABY_GC_UPDATE(doc->sentences[i].tokens);
   }
-
-  mecaby_register_pointer_object(model->model, self);
-  return self;
 }
+#endif
 
-static VALUE
-mecaby_model_inspect(VALUE self)
+static void
+mecaby_document_free(void *ptr)
 {
-  VALUE str, cname;
-  mecaby_model_t* model = check_get_model(self);
+  mecaby_document_t* doc = ptr;
 
-  if (NIL_P(model->arg)) {
-    return rb_call_super(0, NULL);
+  if (doc != NULL) {
+    if (doc->sentences != NULL) {
+      xfree(doc->sentences);
+    }
+    xfree(doc);
   }
+}
 
-  cname = rb_class_name(CLASS_OF(self));
-  if (model->model != NULL) {
-    str = rb_sprintf("#<%"PRIsVALUE":%p arg=%"PRIsVALUE">", cname, (void*)self, rb_inspect(model->arg));
-  }
-  else {
-    str = rb_sprintf("#<%"PRIsVALUE":%p uninitialized>", cname, (void*)self);
+static size_t
+mecaby_document_memsize(void const *ptr)
+{
+  mecaby_document_t const* doc = ptr;
+
+  return sizeof(mecaby_document_t) + doc->capa * sizeof(mecaby_tokens_part_t);
+}
+
+static const rb_data_type_t mecaby_document_data_type = {
+  "Mecaby::Document",
+  {
+    mecaby_document_mark,
+    mecaby_document_free,
+    mecaby_document_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    mecaby_document_compact,
+#endif
   }
-  OBJ_INFECT(str, self);
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  , NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+#endif
+};
 
-  return str;
+static mecaby_document_t*
+check_get_document(VALUE obj)
+{
+  if (!rb_typeddata_is_kind_of(obj, &mecaby_document_data_type)) {
+    rb_raise(rb_eTypeError, "%"PRIsVALUE" object is required but %"PRIsVALUE" is given",
+             RB_CLASSNAME(mecaby_cDocument), RB_CLASSNAME(rb_obj_class(obj)));
+  }
+  return DATA_PTR(obj);
 }
 
-static VALUE
-mecaby_model_dictionary_info(VALUE self)
+static mecaby_document_t*
+check_get_document_initialized(VALUE obj)
 {
-  VALUE obj;
-  mecab_dictionary_info_t const* mecab_di;
-  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
+  mecaby_document_t* doc = check_get_document(obj);
 
-  mecab_di = mecab_model_dictionary_info(model->model);
-  return mecaby_create_dictionary_info(mecab_di, self);
+  if (NIL_P(doc->text)) {
+    rb_raise(rb_eRuntimeError, "uninitialized %"PRIsVALUE, RB_CLASSNAME(rb_obj_class(obj)));
+  }
+  return doc;
 }
 
 static VALUE
-mecaby_model_transition_cost(VALUE self, VALUE rc_attr, VALUE lc_attr)
+mecaby_document_s_allocate(VALUE klass)
 {
-  return Qnil;
+  mecaby_document_t* doc;
+  VALUE obj = TypedData_Make_Struct(klass, mecaby_document_t, &mecaby_document_data_type, doc);
+  doc->model = Qnil;
+  doc->lattice = Qnil;
+  doc->text = Qnil;
+  doc->sentences = NULL;
+  doc->nsentences = 0;
+  doc->capa = 0;
+  doc->tokens = Qnil;
+  doc->reparsed_sentences = 0;
+  doc->reparsed_bytes = 0;
+  return obj;
 }
 
 static VALUE
-mecaby_model_create_tagger(VALUE self)
+mecaby_document_export_text(VALUE vtext)
 {
-  VALUE obj;
-
-  obj = rb_obj_alloc(mecaby_cTagger);
-  rb_funcall(obj, rb_intern("initialize"), 1, self);
-
-  return obj;
+  StringValue(vtext);
+  return rb_str_export_to_enc(vtext, rb_default_external_encoding());
 }
 
+/*
+ * Analyzes the bytes of the text from begin to end with the lattice of
+ * the document.
+ */
 static VALUE
-mecaby_model_create_lattice(VALUE self)
+mecaby_document_parse_span(mecaby_document_t* doc, VALUE vtagger, VALUE text, long begin, long end)
 {
-  VALUE obj;
+  mecaby_lattice_t* lattice = get_lattice(doc->lattice);
 
-  obj = rb_obj_alloc(mecaby_cLattice);
-  rb_funcall(obj, rb_intern("initialize"), 1, self);
+  mecaby_lattice_assign_sentence(doc->lattice, rb_str_subseq(text, begin, end - begin), 0);
+  if (!RTEST(mecaby_tagger_parse_lattice(vtagger, doc->lattice))) {
+    rb_raise(mecaby_eError, "%s", mecab_lattice_strerror(lattice->lattice));
+  }
 
-  return obj;
+  return mecaby_tokens_new(mecab_lattice_get_bos_node(lattice->lattice),
+                           mecaby_feature_table_for(doc->lattice), NULL, NULL);
 }
 
-static VALUE
-mecaby_model_swap(VALUE self, VALUE other)
+/*
+ * Replaces the sentences from first with the sentences of the new text
+ * starting at begin, and shifts the sentences after them by delta.  The
+ * new sentences are split and analyzed until one of them ends where an
+ * old sentence from last ended, since the text after that point is
+ * unchanged and splits in the same way.
+ */
+static void
+mecaby_document_reparse(VALUE self, mecaby_document_t* doc, VALUE text, long first, long last, long begin, long delta)
 {
-  mecaby_model_t* model_self;
-  mecaby_model_t* model_other;
+  VALUE vtagger, parsed;
+  char const* ptr = RSTRING_PTR(text);
+  char const* end = ptr + RSTRING_LEN(text);
+  int utf8 = rb_enc_get_index(text) == rb_utf8_encindex();
+  long pos = begin, nnew = 0, i;
 
-  model_self = get_model_initialized(self);
-  model_other = get_model_initialized(other);
+  vtagger = mecaby_model_tagger_for_current_thread(doc->model);
+  parsed = rb_ary_new();
 
-  if (model_self != NULL && model_other != NULL) {
-    mecab_model_swap(model_self->model, model_other->model);
+  while (ptr + pos < end) {
+    long e = mecaby_sentence_end(ptr + pos, end, utf8) - ptr;
+
+    rb_ary_push(parsed, mecaby_document_parse_span(doc, vtagger, text, pos, e));
+    ++nnew;
+    pos = e;
+
+    while (last < doc->nsentences && doc->sentences[last].end + delta < e) {
+      ++last;
+    }
+    if (last < doc->nsentences && doc->sentences[last].end + delta == e) {
+      ++last;
+      break;
+    }
+  }
+  if (ptr + pos >= end) {
+    last = doc->nsentences;
   }
 
-  return self;
+  if (doc->nsentences - (last - first) + nnew > doc->capa) {
+    long capa = doc->capa > 0 ? doc->capa : 16;
+    while (capa < doc->nsentences - (last - first) + nnew) capa *= 2;
+    REALLOC_N(doc->sentences, mecaby_tokens_part_t, capa);
+    doc->capa = capa;
+  }
+  MEMMOVE(doc->sentences + first + nnew, doc->sentences + last, mecaby_tokens_part_t, doc->nsentences - last);
+  doc->nsentences += nnew - (last - first);
+  /* the sentences are split again rather than kept in a buffer as large as the text */
+  for (i = 0, pos = begin; i < nnew; ++i) {
+    RB_OBJ_WRITE(self, &doc->sentences[first + i].tokens, RARRAY_AREF(parsed, i));
+    doc->sentences[first + i].begin = pos;
+    doc->sentences[first + i].end = pos = mecaby_sentence_end(ptr + pos, end, utf8) - ptr;
+  }
+  for (i = first + nnew; i < doc->nsentences; ++i) {
+    doc->sentences[i].begin += delta;
+    doc->sentences[i].end += delta;
+  }
+  RB_GC_GUARD(parsed);
+
+  RB_OBJ_WRITE(self, &doc->text, text);
+  doc->tokens = Qnil;
+  doc->reparsed_sentences = nnew;
+  doc->reparsed_bytes = pos - begin;
 }
 
 /*
- * Mecaby::Lattice
+ * Returns the index of the last sentence which begins at or before pos.
  */
+static long
+mecaby_document_sentence_at(mecaby_document_t const* doc, long pos)
+{
+  long lo = 0, hi = doc->nsentences;
+
+  while (hi - lo > 1) {
+    long mid = lo + (hi - lo) / 2;
+    if (doc->sentences[mid].begin <= pos) {
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
 
+/*
+ * call-seq:
+ *   Mecaby::Document.new(model, text)
+ *
+ * Splits the text into sentences and analyzes them with the model.
+ */
 static VALUE
-mecaby_lattice_initialize(int argc, VALUE* argv, VALUE self)
+mecaby_document_initialize(VALUE self, VALUE vmodel, VALUE vtext)
 {
-  VALUE arg;
-  mecaby_lattice_t* lattice = check_get_lattice(self);
+  mecaby_document_t* doc = check_get_document(self);
 
-  if (lattice->lattice != NULL) {
+  if (!NIL_P(doc->text)) {
     rb_raise(rb_eRuntimeError, "already initialized");
   }
 
-  rb_scan_args(argc, argv, "01", &arg);
-  if (argc == 0) {
-    lattice->lattice = mecab_lattice_new();
-  }
-  else if (MECABY_OBJ_IS_MODEL(arg)) {
-    mecaby_model_t* model = check_get_model_initialized(arg, rb_eArgError);
-    lattice->generator = arg;
-    lattice->lattice = mecab_model_new_lattice(model->model);
-    OBJ_INFECT(self, arg);
-  }
-  else {
-    rb_raise(rb_eArgError, "invalid argument: %"PRIsVALUE, rb_inspect(arg));
-  }
+  check_get_model_initialized(vmodel, rb_eArgError);
+  vtext = rb_str_new_frozen(mecaby_document_export_text(vtext));
+
+  RB_OBJ_WRITE(self, &doc->model, vmodel);
+  RB_OBJ_WRITE(self, &doc->lattice, mecaby_model_create_lattice(vmodel));
+  mecaby_document_reparse(self, doc, vtext, 0, 0, 0, 0);
 
   return self;
 }
 
+/*
+ * Returns the text of the document as a frozen String.
+ */
 static VALUE
-mecaby_lattice_sentence(VALUE self)
+mecaby_document_text(VALUE self)
 {
-  char const* sentence;
-  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
-
-  sentence = mecab_lattice_get_sentence(lattice->lattice);
-
-  return rb_external_str_new_with_enc(sentence, strlen(sentence), rb_default_external_encoding());
+  return check_get_document_initialized(self)->text;
 }
 
+/*
+ * Returns the tokens of the whole text as a Mecaby::Tokens, whose
+ * offsets are byte offsets into #text.
+ */
 static VALUE
-mecaby_lattice_sentence_eq(VALUE self, VALUE vsentence)
+mecaby_document_tokens(VALUE self)
 {
-  char const* sentence;
-  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+  mecaby_document_t* doc = check_get_document_initialized(self);
 
-  sentence = StringValueCStr(vsentence);
-  mecab_lattice_set_sentence(lattice->lattice, sentence);
+  if (NIL_P(doc->tokens)) {
+    RB_OBJ_WRITE(self, &doc->tokens, mecaby_tokens_concat(doc->sentences, doc->nsentences));
+  }
 
-  return vsentence;
+  return doc->tokens;
 }
 
+/*
+ * call-seq:
+ *   document.edit(range, str) -> document
+ *
+ * Replaces the characters of the range with the string as String#[]=
+ * does, and re-analyzes the sentences around the change.  The sentence
+ * before the change is included, since the change may join it with the
+ * next one.
+ */
 static VALUE
-mecaby_lattice_set_sentence(VALUE self, VALUE vsentence)
+mecaby_document_edit(VALUE self, VALUE vrange, VALUE vstr)
 {
-  mecaby_lattice_sentence_eq(self, vsentence);
+  long beg, len, byte_beg, byte_end, first, last;
+  VALUE text;
+  mecaby_document_t* doc = check_get_document_initialized(self);
+
+  vstr = mecaby_document_export_text(vstr);
+  if (!RTEST(rb_range_beg_len(vrange, &beg, &len, rb_str_strlen(doc->text), 1))) {
+    rb_raise(rb_eTypeError, "Range is required but %"PRIsVALUE" is given", RB_CLASSNAME(rb_obj_class(vrange)));
+  }
+  byte_beg = rb_str_offset(doc->text, beg);
+  byte_end = rb_str_offset(doc->text, beg + len);
+
+  text = rb_str_dup(doc->text);
+  rb_str_update(text, beg, len, vstr);
+  rb_str_freeze(text);
+
+  if (doc->nsentences == 0) {
+    mecaby_document_reparse(self, doc, text, 0, 0, 0, RSTRING_LEN(text));
+    return self;
+  }
+
+  first = mecaby_document_sentence_at(doc, byte_beg);
+  if (first > 0 && doc->sentences[first].begin == byte_beg) {
+    --first;
+  }
+  last = byte_end > byte_beg ? mecaby_document_sentence_at(doc, byte_end - 1) : first;
+  if (last < first) last = first;
+
+  mecaby_document_reparse(self, doc, text, first, last, doc->sentences[first].begin,
+                          RSTRING_LEN(text) - RSTRING_LEN(doc->text));
+
   return self;
 }
 
+/*
+ * Returns the number of the sentences and the size of the last
+ * re-analysis.
+ */
 static VALUE
-mecaby_lattice_to_s(VALUE self)
+mecaby_document_stats(VALUE self)
 {
-  char const* str;
-  mecaby_lattice_t* lattice = check_get_lattice_initialized(self, rb_eRuntimeError);
+  VALUE stats = rb_hash_new();
+  mecaby_document_t* doc = check_get_document_initialized(self);
 
-  str = mecab_lattice_tostr(lattice->lattice);
+  rb_hash_aset(stats, ID2SYM(rb_intern("sentences")), LONG2NUM(doc->nsentences));
+  rb_hash_aset(stats, ID2SYM(rb_intern("reparsed_sentences")), LONG2NUM(doc->reparsed_sentences));
+  rb_hash_aset(stats, ID2SYM(rb_intern("reparsed_bytes")), LONG2NUM(doc->reparsed_bytes));
 
-  return rb_external_str_new_with_enc(str, strlen(str), rb_default_external_encoding());
+  return stats;
 }
-#endif /* HAVE_MECAB_MODEL_NEW */
 
 /*
- * Mecaby::Tagger
+ * Parallel document parsing
+ *
+ * Model#parse_document splits a large text at sentence boundaries into
+ * one chunk per thread.  Each thread analyzes the sentences of its chunk
+ * with its own tagger and lattice of the model, without the GVL, and
+ * writes the result into malloc'ed buffers: the text, or the token
+ * blocks of mecaby_tokens_build for each sentence.  They are joined in
+ * order after the threads finish.  An interrupt sets the canceled flag of
+ * the job, which the threads check between sentences.
  */
 
-static VALUE
-mecaby_tagger_initialize(int argc, VALUE* argv, VALUE self)
+typedef struct mecaby_document_task {
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  int started;
+#endif
+  mecab_model_t* model;
+  char const* text;
+  long begin;
+  long end;
+  int utf8;
+  int tokens;
+  char* blob;
+  size_t blob_size;
+  size_t blob_capa;
+  mecaby_tokens_t** parts;
+  long* bases;
+  long nparts;
+  long parts_capa;
+  volatile int const* canceled;
+  char error[256];
+} mecaby_document_task_t;
+
+typedef struct mecaby_document_job {
+  char* text;
+  int ntasks;
+  mecaby_document_task_t* tasks;
+  volatile int canceled;
+} mecaby_document_job_t;
+
+static int
+mecaby_document_task_append(mecaby_document_task_t* task, char const* p, size_t n)
 {
-  VALUE arg;
-  mecaby_tagger_t* tagger = check_get_tagger(self);
+  if (task->blob_size + n > task->blob_capa) {
+    size_t capa = task->blob_capa > 0 ? task->blob_capa : 4096;
+    char* blob;
+    while (capa < task->blob_size + n) capa *= 2;
+    blob = realloc(task->blob, capa);
+    if (blob == NULL) return 0;
+    task->blob = blob;
+    task->blob_capa = capa;
+  }
+  memcpy(task->blob + task->blob_size, p, n);
+  task->blob_size += n;
 
-  if (tagger->tagger != NULL) {
-    rb_raise(rb_eRuntimeError, "already initialized");
+  return 1;
+}
+
+/*
+ * Appends the tokens of the sentence at base to the parts of the task.
+ */
+static int
+mecaby_document_task_add_tokens(mecaby_document_task_t* task, mecab_node_t const* bos, long base)
+{
+  mecaby_tokens_t* tokens;
+
+  if (task->nparts == task->parts_capa) {
+    long capa = task->parts_capa > 0 ? task->parts_capa * 2 : 64;
+    mecaby_tokens_t** parts = realloc(task->parts, capa * sizeof(*parts));
+    long* bases;
+
+    if (parts == NULL) return 0;
+    task->parts = parts;
+    bases = realloc(task->bases, capa * sizeof(*bases));
+    if (bases == NULL) return 0;
+    task->bases = bases;
+    task->parts_capa = capa;
   }
 
-  rb_scan_args(argc, argv, "01", &arg);
-  if (argc == 0) {
-    tagger->tagger = mecab_new2("-C");
+  tokens = mecaby_tokens_build(bos, NULL, NULL, NULL, malloc);
+  if (tokens == NULL) return 0;
+  task->parts[task->nparts] = tokens;
+  task->bases[task->nparts] = base;
+  ++task->nparts;
+
+  return 1;
+}
+
+static void*
+mecaby_document_task_run(void* ptr)
+{
+  mecaby_document_task_t* task = ptr;
+  mecab_t* mecab = mecab_model_new_tagger(task->model);
+  mecab_lattice_t* lattice = mecab_model_new_lattice(task->model);
+  char const* p = task->text + task->begin;
+  char const* end = task->text + task->end;
+
+  if (mecab == NULL || lattice == NULL) {
+    snprintf(task->error, sizeof(task->error), "failed to create a tagger: %s", mecab_strerror(NULL));
+    p = end;
   }
-  else {
-    VALUE ary = rb_check_array_type(arg);
 
-    if (NIL_P(ary)) {
-#ifdef HAVE_MECAB_MODEL_NEW
-      if (MECABY_OBJ_IS_MODEL(arg)) {
-        mecaby_model_t* model = check_get_model_initialized(arg, rb_eArgError);
-        tagger->generator = arg;
-        tagger->tagger = mecab_model_new_tagger(model->model);
-        OBJ_INFECT(self, arg);
-      }
-      else
-#endif
-      {
-        char const* str = StringValueCStr(arg);
-        tagger->generator = rb_obj_dup(arg);
-        tagger->tagger = mecab_new2(str);
-      }
-    }
-    else {
-      int i, n;
-      char** args;
+  while (p < end && !*task->canceled) {
+    char const* e = mecaby_sentence_end(p, end, task->utf8);
+    int ok;
 
-      n = RARRAY_LEN(ary);
-      args = ALLOCA_N(char*, n);
-      for (i = 0; i < n; ++i) {
-        VALUE item = RARRAY_AREF(ary, i);
-        args[i] = StringValueCStr(item);
-      }
-      tagger->generator = rb_obj_dup(ary);
-      tagger->tagger = mecab_new(n, args);
+    mecab_lattice_set_sentence2(lattice, p, e - p);
+    if (!mecab_parse_lattice(mecab, lattice)) {
+      snprintf(task->error, sizeof(task->error), "%s", mecab_lattice_strerror(lattice));
+      break;
     }
-  }
 
-  if (tagger->tagger == NULL) {
-    char const* error = mecab_strerror(NULL);
-    if (strstr(error, "load_dictionary_resource")) {
-      rb_raise(mecaby_eDictNotFound, "%s:%d: mecab_tagger_initialize: %s", __FILE__, __LINE__, mecab_strerror(NULL));
+    if (task->tokens) {
+      ok = mecaby_document_task_add_tokens(task, mecab_lattice_get_bos_node(lattice), p - task->text);
     }
     else {
-      rb_raise(rb_eRuntimeError, "%s:%d: mecab_tagger_initialize: %s", __FILE__, __LINE__, mecab_strerror(NULL));
+      char const* output = mecab_lattice_tostr(lattice);
+      ok = output != NULL && mecaby_document_task_append(task, output, strlen(output));
+    }
+    if (!ok) {
+      snprintf(task->error, sizeof(task->error), "failed to allocate memory");
+      break;
     }
+    p = e;
   }
 
-  if (!NIL_P(tagger->generator)
-#ifdef HAVE_MECAB_MODEL_NEW
-      && !MECABY_OBJ_IS_MODEL(tagger->generator)
-#endif
-      ) {
-    rb_obj_freeze(tagger->generator);
-  }
+  if (lattice != NULL) mecab_lattice_destroy(lattice);
+  if (mecab != NULL) mecab_destroy(mecab);
 
-  mecaby_register_pointer_object(tagger->tagger, self);
-  return self;
+  return NULL;
 }
 
-static VALUE
-mecaby_tagger_inspect(VALUE self)
+static void*
+mecaby_document_job_run(void* ptr)
 {
-  VALUE str, cname;
-  mecaby_tagger_t* tagger = check_get_tagger(self);
+  mecaby_document_job_t* job = ptr;
+  int i;
 
-  if (NIL_P(tagger->generator)) {
-    return rb_call_super(0, NULL);
-  }
+  if (job->ntasks == 0) return NULL;
 
-  cname = rb_class_name(CLASS_OF(self));
-  if (tagger->tagger != NULL) {
-#ifdef HAVE_MECAB_MODEL_NEW
-    if (MECABY_OBJ_IS_MODEL(tagger->generator)) {
-      str = rb_sprintf("#<%"PRIsVALUE":%p model=%"PRIsVALUE">", cname, (void*)self, tagger->generator);
+#ifdef HAVE_PTHREAD_H
+  for (i = 1; i < job->ntasks; ++i) {
+    job->tasks[i].started = pthread_create(&job->tasks[i].thread, NULL, mecaby_document_task_run, &job->tasks[i]) == 0;
+    if (!job->tasks[i].started) {
+      mecaby_document_task_run(&job->tasks[i]);
     }
-    else
-#endif
-    {
-      str = rb_sprintf("#<%"PRIsVALUE":%p arg=%"PRIsVALUE">", cname, (void*)self, rb_inspect(tagger->generator));
+  }
+  mecaby_document_task_run(&job->tasks[0]);
+  for (i = 1; i < job->ntasks; ++i) {
+    if (job->tasks[i].started) {
+      pthread_join(job->tasks[i].thread, NULL);
     }
   }
-  else {
-      str = rb_sprintf("#<%"PRIsVALUE":%p uninitialized>", cname, (void*)self);
+#else
+  for (i = 0; i < job->ntasks; ++i) {
+    mecaby_document_task_run(&job->tasks[i]);
   }
-  OBJ_INFECT(str, self);
+#endif
 
-  return str;
+  return NULL;
 }
 
-static VALUE
-mecaby_tagger_dictionary_info(VALUE self)
+static void
+mecaby_document_job_unblock(void* ptr)
 {
-  VALUE obj;
-  mecab_dictionary_info_t const* mecab_di;
-  mecaby_tagger_t* tagger = check_get_tagger(self);
+  mecaby_document_job_t* job = ptr;
 
-  mecab_di = mecab_dictionary_info(tagger->tagger);
-  return mecaby_create_dictionary_info(mecab_di, self);
+  job->canceled = 1;
 }
 
-#ifdef HAVE_MECAB_MODEL_NEW
 static VALUE
-mecaby_tagger_parse_lattice(VALUE self, VALUE vlattice)
+mecaby_document_job_text(mecaby_document_job_t* job)
 {
-  int result;
-  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
-  mecaby_lattice_t* lattice = check_get_lattice_initialized(vlattice, rb_eArgError);
+  int i;
+  size_t size = 0;
+  VALUE result;
+  rb_encoding* internal = rb_default_internal_encoding();
 
-  result = mecab_parse_lattice(tagger->tagger, lattice->lattice);
+  for (i = 0; i < job->ntasks; ++i) {
+    size += job->tasks[i].blob_size;
+  }
+  result = rb_enc_str_new(NULL, 0, rb_default_external_encoding());
+  rb_str_resize(result, size);
+  rb_str_set_len(result, 0);
+  for (i = 0; i < job->ntasks; ++i) {
+    rb_str_cat(result, job->tasks[i].blob, job->tasks[i].blob_size);
+  }
+  if (internal != NULL) {
+    result = rb_str_conv_enc(result, rb_default_external_encoding(), internal);
+  }
 
-  return result ? Qtrue : Qfalse;
+  return result;
 }
-#endif
 
 static VALUE
-mecaby_tagger_parse_string(VALUE self, VALUE vinput)
+mecaby_document_job_tokens(mecaby_document_job_t* job, mecaby_feature_table_t const* table)
 {
-  int result;
-  const char* input;
-  const char* output;
-  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
+  int i;
+  long n = 0, k = 0;
+  VALUE vparts = 0, vbases = 0, result;
+  mecaby_tokens_t const** parts;
+  long* bases;
+
+  for (i = 0; i < job->ntasks; ++i) {
+    n += job->tasks[i].nparts;
+  }
+  parts = ALLOCV_N(mecaby_tokens_t const*, vparts, n);
+  bases = ALLOCV_N(long, vbases, n);
+  for (i = 0; i < job->ntasks; ++i) {
+    long j;
+    for (j = 0; j < job->tasks[i].nparts; ++j, ++k) {
+      parts[k] = job->tasks[i].parts[j];
+      bases[k] = job->tasks[i].bases[j];
+    }
+  }
 
-  input = StringValueCStr(vinput);
-  output = mecab_sparse_tostr(tagger->tagger, input);
+  result = mecaby_tokens_join(parts, bases, n, table->field_index);
+  ALLOCV_END(vparts);
+  ALLOCV_END(vbases);
 
-  return rb_external_str_new_with_enc(output, strlen(output), rb_default_external_encoding());
+  return result;
 }
 
+struct mecaby_parse_document_args {
+  VALUE self;
+  mecaby_document_job_t* job;
+  int tokens;
+};
+
 static VALUE
-mecaby_tagger_parse(VALUE self, VALUE target)
+mecaby_model_parse_document_body(VALUE ptr)
 {
-#ifdef HAVE_MECAB_MODEL_NEW
-  if (MECABY_OBJ_IS_LATTICE(target)) {
-    return mecaby_tagger_parse_lattice(self, target);
+  int i;
+  struct mecaby_parse_document_args* args = (struct mecaby_parse_document_args*)ptr;
+  mecaby_document_job_t* job = args->job;
+  mecaby_model_t* model = check_get_model_initialized(args->self, rb_eRuntimeError);
+  mecaby_feature_table_t* table = &model->features;
+
+  if (args->tokens) {
+    mecaby_feature_table_load_field_names(table, mecab_model_dictionary_info(model->model));
   }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(mecaby_document_job_run, job, mecaby_document_job_unblock, job);
+#else
+  mecaby_document_job_run(job);
 #endif
 
-  return mecaby_tagger_parse_string(self, target);
+  if (job->canceled) {
+    /* raises the pending exception, if the interrupt has one */
+    rb_thread_check_ints();
+    rb_raise(rb_eInterrupt, "parse_document was interrupted");
+  }
+
+  for (i = 0; i < job->ntasks; ++i) {
+    if (job->tasks[i].error[0] != '\0') {
+      rb_raise(mecaby_eError, "%s", job->tasks[i].error);
+    }
+  }
+
+  return args->tokens ? mecaby_document_job_tokens(job, table) : mecaby_document_job_text(job);
 }
 
 static VALUE
-mecaby_tagger_nbest_parse(VALUE self, VALUE vn, VALUE vinput)
+mecaby_model_parse_document_ensure(VALUE ptr)
 {
-  size_t n;
-  const char* input;
-  const char* output;
-  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
-
-  input = StringValueCStr(vinput);
-  n = NUM2SIZET(vn);
-  output = mecab_nbest_sparse_tostr(tagger->tagger, n, input);
-  if (output == NULL) {
-    rb_raise(mecaby_eError, "%s", mecab_strerror(tagger->tagger));
+  int i;
+  struct mecaby_parse_document_args* args = (struct mecaby_parse_document_args*)ptr;
+  mecaby_document_job_t* job = args->job;
+
+  for (i = 0; i < job->ntasks; ++i) {
+    long j;
+    for (j = 0; j < job->tasks[i].nparts; ++j) {
+      free(job->tasks[i].parts[j]);
+    }
+    free(job->tasks[i].parts);
+    free(job->tasks[i].bases);
+    free(job->tasks[i].blob);
   }
+  free(job->tasks);
+  free(job->text);
 
-  return rb_external_str_new_with_enc(output, strlen(output), rb_default_external_encoding());
+  return Qnil;
 }
 
+/*
+ * call-seq:
+ *   model.parse_document(str, threads: nil, format: :text) -> String or Mecaby::Tokens
+ *
+ * Analyzes a large text in several threads.  The text is split at
+ * sentence boundaries into one chunk per thread, and each sentence is
+ * analyzed separately, so the :text output has an EOS line for each
+ * sentence.  With format: :tokens, it returns a Mecaby::Tokens whose
+ * offsets are byte offsets into the text.  The number of threads
+ * defaults to the number of processors up to 8.
+ */
 static VALUE
-mecaby_tagger_nbest_init(VALUE self, VALUE vinput)
+mecaby_model_parse_document(int argc, VALUE* argv, VALUE self)
 {
-  const char* input;
-  int result;
-  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
+  VALUE vstr, opts, vthreads = Qnil, vformat = Qnil;
+  int i, nthreads, utf8;
+  long len, begin;
+  mecaby_document_job_t job;
+  struct mecaby_parse_document_args args;
+  mecaby_model_t* model = check_get_model_initialized(self, rb_eRuntimeError);
 
-  input = StringValueCStr(vinput);
-  result = mecab_nbest_init(tagger->tagger, input);
+  rb_scan_args(argc, argv, "11", &vstr, &opts);
+  if (!NIL_P(opts)) {
+    opts = rb_convert_type(opts, T_HASH, "Hash", "to_hash");
+    vthreads = rb_hash_lookup2(opts, ID2SYM(rb_intern("threads")), Qnil);
+    vformat = rb_hash_lookup2(opts, ID2SYM(rb_intern("format")), Qnil);
+  }
 
-  return result ? Qtrue : Qfalse;
-}
+  args.self = self;
+  args.job = &job;
+  args.tokens = 0;
+  if (!NIL_P(vformat)) {
+    if (vformat == ID2SYM(rb_intern("tokens"))) {
+      args.tokens = 1;
+    }
+    else if (vformat != ID2SYM(rb_intern("text"))) {
+      rb_raise(rb_eArgError, "unknown format: %"PRIsVALUE, rb_inspect(vformat));
+    }
+  }
 
-static VALUE
-mecaby_tagger_nbest_next(VALUE self)
-{
-  char const* output;
-  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
+  nthreads = NIL_P(vthreads) ? mecaby_default_build_threads() : NUM2INT(vthreads);
+  if (nthreads < 1) {
+    rb_raise(rb_eArgError, "threads must be positive");
+  }
+#ifndef HAVE_PTHREAD_H
+  nthreads = 1;
+#endif
 
-  output = mecab_nbest_next_tostr(tagger->tagger);
-  if (output == NULL) return Qnil;
+  vstr = rb_str_export_to_enc(rb_str_to_str(vstr), rb_default_external_encoding());
+  len = RSTRING_LEN(vstr);
+  utf8 = rb_enc_get_index(vstr) == rb_utf8_encindex();
+  if (nthreads > len / 1024 + 1) {
+    nthreads = (int)(len / 1024 + 1);
+  }
 
-  return rb_external_str_new_with_enc(output, strlen(output), rb_default_external_encoding());
-}
+  /* the threads read a copy of the string, which nothing can move or modify */
+  job.text = malloc(len + 1);
+  job.tasks = calloc(nthreads, sizeof(*job.tasks));
+  job.ntasks = 0;
+  job.canceled = 0;
+  if (job.text == NULL || job.tasks == NULL) {
+    free(job.text);
+    free(job.tasks);
+    rb_memerror();
+  }
+  memcpy(job.text, RSTRING_PTR(vstr), len);
+  job.text[len] = '\0';
 
-static VALUE
-mecaby_tagger_parse_to_node(VALUE self, VALUE vinput)
-{
-  char const* input;
-  mecaby_tagger_t* tagger = check_get_tagger_initialized(self, rb_eRuntimeError);
-  mecab_node_t const* mecab_node;
+  for (i = 0, begin = 0; i < nthreads && begin < len; ++i) {
+    mecaby_document_task_t* task = &job.tasks[job.ntasks++];
+    long end = len;
 
-  input = StringValueCStr(vinput);
-  mecab_node = mecab_sparse_tonode(tagger->tagger, input);
+    if (i + 1 < nthreads) {
+      long target = len / nthreads * (i + 1);
+      end = mecaby_sentence_end(job.text + (target > begin ? target : begin), job.text + len, utf8) - job.text;
+    }
+    task->model = model->model;
+    task->text = job.text;
+    task->begin = begin;
+    task->end = end;
+    task->utf8 = utf8;
+    task->tokens = args.tokens;
+    task->canceled = &job.canceled;
+    begin = end;
+  }
 
-  return mecaby_create_node(mecab_node, self);
+  return rb_ensure(mecaby_model_parse_document_body, (VALUE)&args, mecaby_model_parse_document_ensure, (VALUE)&args);
 }
+#endif /* HAVE_MECAB_MODEL_NEW */
 
 /*
  * Mecaby::DictionaryInfo
@@ -1067,7 +8539,7 @@ mecaby_create_dictionary_info(mecab_dictionary_info_t const* mecab_di, VALUE gen
 
   vdi = rb_obj_alloc(mecaby_cDictionaryInfo);
   di = get_dictionary_info(vdi);
-  di->generator = generator;
+  RB_OBJ_WRITE(vdi, &di->generator, generator);
   di->dictionary_info = mecab_di;
   OBJ_INFECT(vdi, generator);
 
@@ -1175,53 +8647,205 @@ mecaby_dictionary_info_version(VALUE self)
  * Mecaby::Node
  */
 
+/*
+ * Returns the feature table for the nodes generated by the generator.
+ * The table of a model is shared by its taggers.  The features are not
+ * interned in partial mode, because they can be given by the input.
+ */
+static mecaby_feature_table_t*
+mecaby_feature_table_for(VALUE generator)
+{
+  mecaby_tagger_t* tagger;
+
+  if (MECABY_OBJ_IS_NODE(generator)) {
+    return get_node(generator)->features;
+  }
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (MECABY_OBJ_IS_LATTICE(generator)) {
+    mecaby_lattice_t* lattice = get_lattice(generator);
+    if (lattice->model == NULL || mecab_lattice_has_request_type(lattice->lattice, MECAB_PARTIAL)) {
+      return NULL;
+    }
+    return &lattice->model->features;
+  }
+#endif
+
+  if (!MECABY_OBJ_IS_TAGGER(generator)) {
+    return NULL;
+  }
+
+  tagger = get_tagger(generator);
+#ifdef HAVE_MECAB_GET_PARTIAL
+  if (mecab_get_partial(tagger->tagger)) {
+    return NULL;
+  }
+#endif
+
+  return mecaby_tagger_feature_table(tagger);
+}
+
+/*
+ * Returns the enabled node pool which nodes generated by the generator
+ * are bound from, and sets its owner.
+ */
+static mecaby_node_pool_t*
+mecaby_node_pool_for(VALUE generator, VALUE* owner)
+{
+  mecaby_node_pool_t* pool = NULL;
+
+  *owner = generator;
+  if (MECABY_OBJ_IS_NODE(generator)) {
+    mecaby_node_t* node = get_node(generator);
+    pool = node->pool;
+    *owner = node->generator;
+  }
+  else if (MECABY_OBJ_IS_TAGGER(generator)) {
+    pool = get_tagger(generator)->node_pool;
+  }
+#ifdef HAVE_MECAB_MODEL_NEW
+  else if (MECABY_OBJ_IS_LATTICE(generator)) {
+    pool = get_lattice(generator)->node_pool;
+  }
+#endif
+
+  return pool != NULL && pool->enabled ? pool : NULL;
+}
+
+/*
+ * Binds the next wrapper of the pool to the node.  Pooled wrappers are
+ * not registered to the pointer map, so each traversal binds its own
+ * wrapper until the owner parses again.
+ */
 static VALUE
-mecaby_create_node(mecab_node_t const* mecab_node, VALUE generator)
+mecaby_node_pool_bind(mecaby_node_pool_t* pool, VALUE owner, mecab_node_t const* mecab_node, VALUE generator)
 {
   VALUE vnode;
   mecaby_node_t* node;
 
-  vnode = mecaby_lookup_object(mecab_node);
-  if (!NIL_P(vnode)) return vnode;
+  if (pool->used < RARRAY_LEN(pool->nodes)) {
+    vnode = RARRAY_AREF(pool->nodes, pool->used);
+  }
+  else {
+    vnode = rb_obj_alloc(mecaby_cNode);
+    rb_ary_push(pool->nodes, vnode);
+  }
+  ++pool->used;
+
+  node = get_node(vnode);
+  RB_OBJ_WRITE(vnode, &node->generator, owner);
+  node->node = mecab_node;
+  node->features = mecaby_feature_table_for(generator);
+  node->pool = pool;
+  node->generation = pool->generation;
+
+  return vnode;
+}
+
+/*
+ * Creates the node which traverses only the tokens accepted by the
+ * filter, if it is not nil.  A filtered node is not registered to the
+ * pointer map, which has the unfiltered one.
+ */
+static VALUE
+mecaby_create_filtered_node(mecab_node_t const* mecab_node, VALUE generator,
+                            VALUE filter, struct mecaby_filter_bits* bits)
+{
+  VALUE vnode, owner;
+  mecaby_node_t* node;
+  mecaby_node_pool_t* pool;
+
+  pool = mecaby_node_pool_for(generator, &owner);
+  if (pool != NULL) {
+    vnode = mecaby_node_pool_bind(pool, owner, mecab_node, generator);
+    node = get_node(vnode);
+    RB_OBJ_WRITE(vnode, &node->filter, filter);
+    node->filter_bits = bits;
+    return vnode;
+  }
+
+  if (NIL_P(filter)) {
+    vnode = mecaby_lookup_object(mecab_node);
+    if (!NIL_P(vnode)) return vnode;
+  }
 
   vnode = rb_obj_alloc(mecaby_cNode);
   node = get_node(vnode);
-  node->generator = generator;
+  RB_OBJ_WRITE(vnode, &node->generator, generator);
   node->node = mecab_node;
+  node->features = mecaby_feature_table_for(generator);
+  RB_OBJ_WRITE(vnode, &node->filter, filter);
+  node->filter_bits = bits;
   OBJ_INFECT(vnode, generator);
 
-  mecaby_register_pointer_object(mecab_node, vnode);
+  if (NIL_P(filter)) {
+    mecaby_register_pointer_object(mecab_node, vnode);
+  }
   return vnode;
 }
 
+static VALUE
+mecaby_create_node(mecab_node_t const* mecab_node, VALUE generator)
+{
+  if (MECABY_OBJ_IS_NODE(generator)) {
+    mecaby_node_t* node = get_node(generator);
+    return mecaby_create_filtered_node(mecab_node, generator, node->filter, node->filter_bits);
+  }
+
+  return mecaby_create_filtered_node(mecab_node, generator, Qnil, NULL);
+}
+
+/*
+ * Skips the tokens rejected by the filter of the node.
+ */
+static mecab_node_t const*
+mecaby_node_skip_rejected(mecaby_node_t* node, mecab_node_t const* mecab_node, int forward)
+{
+  mecaby_filter_t* filter;
+
+  if (NIL_P(node->filter)) return mecab_node;
+
+  filter = check_get_filter(node->filter);
+  while (mecab_node != NULL && mecaby_node_is_token(mecab_node) &&
+         !mecaby_filter_accepts(filter, node->filter_bits, mecab_node)) {
+    mecab_node = forward ? mecab_node->next : mecab_node->prev;
+  }
+
+  return mecab_node;
+}
+
 static VALUE
 mecaby_node_prev(VALUE self)
 {
-  mecaby_node_t* node = check_get_node_initialized(self, rb_eRuntimeError);
+  mecab_node_t const* prev;
+  mecaby_node_t* node = check_get_node_alive(self);
 
-  if (node->node->prev == NULL) {
+  prev = mecaby_node_skip_rejected(node, node->node->prev, 0);
+  if (prev == NULL) {
     return Qnil;
   }
 
-  return mecaby_create_node(node->node->prev, self);
+  return mecaby_create_node(prev, self);
 }
 
 static VALUE
 mecaby_node_next(VALUE self)
 {
-  mecaby_node_t* node = check_get_node_initialized(self, rb_eRuntimeError);
+  mecab_node_t const* next;
+  mecaby_node_t* node = check_get_node_alive(self);
 
-  if (node->node->next == NULL) {
+  next = mecaby_node_skip_rejected(node, node->node->next, 1);
+  if (next == NULL) {
     return Qnil;
   }
 
-  return mecaby_create_node(node->node->next, self);
+  return mecaby_create_node(next, self);
 }
 
 static VALUE
 mecaby_node_surface(VALUE self)
 {
-  mecaby_node_t* node = check_get_node_initialized(self, rb_eRuntimeError);
+  mecaby_node_t* node = check_get_node_alive(self);
 
   return rb_external_str_new_with_enc(node->node->surface, node->node->length, rb_default_external_encoding());
 }
@@ -1229,16 +8853,190 @@ mecaby_node_surface(VALUE self)
 static VALUE
 mecaby_node_feature(VALUE self)
 {
-  mecaby_node_t* node = check_get_node_initialized(self, rb_eRuntimeError);
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return mecaby_feature_table_fetch(node->features, node->node->feature, 0);
+}
+
+static VALUE
+mecaby_node_features(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return mecaby_feature_table_fetch(node->features, node->node->feature, 1);
+}
+
+static VALUE
+mecaby_node_feature_field(VALUE self, enum mecaby_feature_field field)
+{
+  int index;
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  if (node->features == NULL) {
+    index = mecaby_default_field_index[field];
+    return mecaby_feature_field_at(node->node->feature, index, rb_default_external_encoding());
+  }
+
+  index = node->features->field_index[field];
+  if (index < 0) return Qnil;
+
+  return rb_ary_entry(mecaby_feature_table_fetch(node->features, node->node->feature, 1), index);
+}
+
+static VALUE
+mecaby_node_pos(VALUE self)
+{
+  return mecaby_node_feature_field(self, MECABY_FIELD_POS);
+}
+
+static VALUE
+mecaby_node_base_form(VALUE self)
+{
+  return mecaby_node_feature_field(self, MECABY_FIELD_BASE_FORM);
+}
+
+static VALUE
+mecaby_node_reading(VALUE self)
+{
+  return mecaby_node_feature_field(self, MECABY_FIELD_READING);
+}
+
+/*
+ * Returns the marginal probability of the node.  It is computed only when
+ * the lattice has the MARGINAL_PROB request type.
+ */
+static VALUE
+mecaby_node_prob(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return DBL2NUM(node->node->prob);
+}
+
+static VALUE
+mecaby_node_alpha(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return DBL2NUM(node->node->alpha);
+}
+
+static VALUE
+mecaby_node_beta(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return DBL2NUM(node->node->beta);
+}
+
+/*
+ * Returns the accumulated cost of the best path from BOS to the node.
+ */
+static VALUE
+mecaby_node_cost(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return LONG2NUM(node->node->cost);
+}
+
+/*
+ * Returns the word cost of the node.
+ */
+static VALUE
+mecaby_node_wcost(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return INT2NUM(node->node->wcost);
+}
+
+/*
+ * Returns the byte length of the surface, without the leading spaces.
+ */
+static VALUE
+mecaby_node_length(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->length);
+}
+
+/*
+ * Returns the byte length of the surface with the leading spaces.
+ */
+static VALUE
+mecaby_node_rlength(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->rlength);
+}
+
+static VALUE
+mecaby_node_id(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->id);
+}
+
+static VALUE
+mecaby_node_posid(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->posid);
+}
+
+static VALUE
+mecaby_node_char_type(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->char_type);
+}
+
+static VALUE
+mecaby_node_stat(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->stat);
+}
+
+static VALUE
+mecaby_node_lc_attr(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->lcAttr);
+}
+
+static VALUE
+mecaby_node_rc_attr(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
+
+  return UINT2NUM(node->node->rcAttr);
+}
+
+/*
+ * Returns true if the node is on the best path.
+ */
+static VALUE
+mecaby_node_is_best(VALUE self)
+{
+  mecaby_node_t* node = check_get_node_alive(self);
 
-  return rb_external_str_new_with_enc(node->node->feature, strlen(node->node->feature), rb_default_external_encoding());
+  return node->node->isbest ? Qtrue : Qfalse;
 }
 
 #define DEFINE_NODE_STATUS_PREDICATOR(name, NAME) \
 static VALUE \
 mecaby_node_status_is_##name(VALUE self) \
 { \
-  mecaby_node_t* node = check_get_node_initialized(self, rb_eRuntimeError); \
+  mecaby_node_t* node = check_get_node_alive(self); \
  \
   return node->node->stat == MECAB_##NAME##_NODE ? Qtrue : Qfalse; \
 }
@@ -1253,7 +9051,7 @@ DEFINE_NODE_STATUS_PREDICATOR(eon, EON);
 static VALUE
 mecaby_node_status_is_eon(VALUE self)
 {
-  mecaby_node_t* node = check_get_node_initialized(self, rb_eRuntimeError);
+  mecaby_node_t* node = check_get_node_alive(self);
 
   return Qfalse;
 }
@@ -1261,13 +9059,160 @@ mecaby_node_status_is_eon(VALUE self)
 
 #undef DEFINE_NODE_STATUS_PREDICATOR
 
+/*
+ * MeCab compatibility
+ *
+ * The classes of the mecab-ruby binding are defined as subclasses of the
+ * Mecaby classes when lib/MeCab.rb is required.  Their camelCase methods
+ * are bound to the same functions as the Mecaby methods, so legacy code
+ * calls into the extension without Ruby method frames in between.
+ */
+
+static VALUE mecaby_mMeCab = Qnil;
+static VALUE mecaby_cMeCabTagger;
+#ifdef HAVE_MECAB_MODEL_NEW
+static VALUE mecaby_cMeCabModel;
+static VALUE mecaby_cMeCabLattice;
+#endif
+
+/*
+ * call-seq:
+ *   MeCab::Tagger.new(arg = nil)
+ *
+ * Creates the tagger.  A String or an Array of options, or nil, is
+ * looked up in Mecaby::Model.shared so taggers with the same options
+ * share the dictionary.  A Mecaby::Tagger gives a new tagger of the same
+ * model or options.
+ */
+static VALUE
+mecaby_mecab_tagger_initialize(int argc, VALUE* argv, VALUE self)
+{
+  VALUE arg;
+
+  rb_scan_args(argc, argv, "01", &arg);
+  if (MECABY_OBJ_IS_TAGGER(arg)) {
+    arg = check_get_tagger_initialized(arg, rb_eArgError)->generator;
+  }
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  if (NIL_P(arg) || RB_TYPE_P(arg, T_STRING) || RB_TYPE_P(arg, T_ARRAY)) {
+    arg = mecaby_model_s_shared(NIL_P(arg) ? 0 : 1, &arg, mecaby_cModel);
+  }
+  else if (!MECABY_OBJ_IS_MODEL(arg)) {
+    rb_raise(rb_eArgError, "invalid argument");
+  }
+#else
+  if (NIL_P(arg)) {
+    return mecaby_tagger_initialize(0, NULL, self);
+  }
+  if (!RB_TYPE_P(arg, T_STRING) && !RB_TYPE_P(arg, T_ARRAY)) {
+    rb_raise(rb_eArgError, "invalid argument");
+  }
+#endif
+
+  return mecaby_tagger_initialize(1, &arg, self);
+}
+
+#ifdef HAVE_MECAB_MODEL_NEW
+static VALUE
+mecaby_mecab_model_create_tagger(VALUE self)
+{
+  VALUE obj = rb_obj_alloc(mecaby_cMeCabTagger);
+
+  return mecaby_tagger_initialize(1, &self, obj);
+}
+
+static VALUE
+mecaby_mecab_model_create_lattice(VALUE self)
+{
+  VALUE obj = rb_obj_alloc(mecaby_cMeCabLattice);
+
+  return mecaby_lattice_initialize(1, &self, obj);
+}
+#endif
+
+static VALUE
+mecaby_s_mecab_version(VALUE klass)
+{
+  return rb_str_new2(mecab_version());
+}
+
+/*
+ * Defines the MeCab module.  It is called by lib/MeCab.rb, and does
+ * nothing when the module is already defined by this method.
+ */
+static VALUE
+mecaby_s_define_mecab_compat(VALUE self)
+{
+  if (!NIL_P(mecaby_mMeCab)) {
+    return mecaby_mMeCab;
+  }
+
+  mecaby_mMeCab = rb_define_module("MeCab");
+  rb_define_const(mecaby_mMeCab, "VERSION", rb_obj_freeze(rb_str_new2(mecab_version())));
+  rb_define_const(mecaby_mMeCab, "MECAB_NOR_NODE", INT2FIX(MECAB_NOR_NODE));
+  rb_define_const(mecaby_mMeCab, "MECAB_UNK_NODE", INT2FIX(MECAB_UNK_NODE));
+  rb_define_const(mecaby_mMeCab, "MECAB_BOS_NODE", INT2FIX(MECAB_BOS_NODE));
+  rb_define_const(mecaby_mMeCab, "MECAB_EOS_NODE", INT2FIX(MECAB_EOS_NODE));
+#ifdef MECAB_EON_NODE
+  rb_define_const(mecaby_mMeCab, "MECAB_EON_NODE", INT2FIX(MECAB_EON_NODE));
+#endif
+
+  rb_define_method(mecaby_cNode, "rcAttr", mecaby_node_rc_attr, 0);
+  rb_define_method(mecaby_cNode, "lcAttr", mecaby_node_lc_attr, 0);
+  rb_define_method(mecaby_cNode, "isbest", mecaby_node_is_best, 0);
+  rb_define_const(mecaby_mMeCab, "Node", mecaby_cNode);
+  rb_define_const(mecaby_mMeCab, "DictionaryInfo", mecaby_cDictionaryInfo);
+
+  mecaby_cMeCabTagger = rb_define_class_under(mecaby_mMeCab, "Tagger", mecaby_cTagger);
+  rb_define_singleton_method(mecaby_cMeCabTagger, "version", mecaby_s_mecab_version, 0);
+  rb_define_method(mecaby_cMeCabTagger, "initialize", mecaby_mecab_tagger_initialize, -1);
+  rb_define_method(mecaby_cMeCabTagger, "parseToNode", mecaby_tagger_parse_to_node, -1);
+  rb_define_method(mecaby_cMeCabTagger, "parseNBest", mecaby_tagger_nbest_parse, 2);
+  rb_define_method(mecaby_cMeCabTagger, "parseNBestInit", mecaby_tagger_nbest_init, 1);
+  rb_define_method(mecaby_cMeCabTagger, "next", mecaby_tagger_nbest_next, 0);
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  rb_define_const(mecaby_mMeCab, "MECAB_ONE_BEST", INT2FIX(MECAB_ONE_BEST));
+  rb_define_const(mecaby_mMeCab, "MECAB_NBEST", INT2FIX(MECAB_NBEST));
+  rb_define_const(mecaby_mMeCab, "MECAB_PARTIAL", INT2FIX(MECAB_PARTIAL));
+  rb_define_const(mecaby_mMeCab, "MECAB_MARGINAL_PROB", INT2FIX(MECAB_MARGINAL_PROB));
+  rb_define_const(mecaby_mMeCab, "MECAB_ALTERNATIVE", INT2FIX(MECAB_ALTERNATIVE));
+  rb_define_const(mecaby_mMeCab, "MECAB_ALL_MORPHS", INT2FIX(MECAB_ALL_MORPHS));
+  rb_define_const(mecaby_mMeCab, "MECAB_ALLOCATE_SENTENCE", INT2FIX(MECAB_ALLOCATE_SENTENCE));
+
+  mecaby_cMeCabModel = rb_define_class_under(mecaby_mMeCab, "Model", mecaby_cModel);
+  rb_define_singleton_method(mecaby_cMeCabModel, "version", mecaby_s_mecab_version, 0);
+  rb_define_method(mecaby_cMeCabModel, "createTagger", mecaby_mecab_model_create_tagger, 0);
+  rb_define_method(mecaby_cMeCabModel, "createLattice", mecaby_mecab_model_create_lattice, 0);
+
+  mecaby_cMeCabLattice = rb_define_class_under(mecaby_mMeCab, "Lattice", mecaby_cLattice);
+  rb_define_method(mecaby_cMeCabLattice, "toString", mecaby_lattice_to_s, -1);
+  rb_define_method(mecaby_cMeCabLattice, "is_available", mecaby_lattice_is_available, 0);
+  rb_define_method(mecaby_cMeCabLattice, "set_request_type", mecaby_lattice_request_type_eq, 1);
+  rb_define_method(mecaby_cMeCabLattice, "has_request_type", mecaby_lattice_has_request_type, 1);
+  rb_define_method(mecaby_cMeCabLattice, "set_theta", mecaby_lattice_theta_eq, 1);
+  rb_define_method(mecaby_cMeCabLattice, "Z", mecaby_lattice_z, 0);
+  rb_define_method(mecaby_cMeCabLattice, "set_Z", mecaby_lattice_z_eq, 1);
+#endif
+
+  return mecaby_mMeCab;
+}
+
 void
 Init_mecaby(void)
 {
-  mecaby_init_pointer_object_map();
+#ifdef MECABY_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+  mecaby_init_pointer_object_map_key();
+  mecaby_shared_models_key = rb_ractor_local_storage_value_newkey();
+#endif
+
+  id_mecaby_thread_taggers = rb_intern("__mecaby_thread_taggers__");
 
   mecaby_mMecaby = rb_define_module("Mecaby");
-  rb_define_const(mecaby_mMecaby, "MECAB_VERSION", rb_str_new2(mecab_version()));
+  rb_define_const(mecaby_mMecaby, "MECAB_VERSION", rb_obj_freeze(rb_str_new2(mecab_version())));
+  rb_define_private_method(rb_singleton_class(mecaby_mMecaby), "define_mecab_compat", mecaby_s_define_mecab_compat, 0);
 
   mecaby_eError = rb_define_class_under(mecaby_mMecaby, "Error", rb_eStandardError);
   mecaby_eDictNotFound = rb_define_class_under(mecaby_mMecaby, "DictionaryNotFound", mecaby_eError);
@@ -1275,6 +9220,9 @@ Init_mecaby(void)
 #ifdef HAVE_MECAB_MODEL_NEW
   mecaby_cModel = rb_define_class_under(mecaby_mMecaby, "Model", rb_cData);
   rb_define_alloc_func(mecaby_cModel, mecaby_model_s_allocate);
+  rb_define_singleton_method(mecaby_cModel, "shared", mecaby_model_s_shared, -1);
+  rb_define_singleton_method(mecaby_cModel, "shared_stats", mecaby_model_s_shared_stats, 0);
+  rb_define_singleton_method(mecaby_cModel, "load_async", mecaby_model_s_load_async, -1);
   rb_define_method(mecaby_cModel, "initialize", mecaby_model_initialize, -1);
   rb_define_method(mecaby_cModel, "inspect", mecaby_model_inspect, 0);
   rb_define_method(mecaby_cModel, "dictionary_info", mecaby_model_dictionary_info, 0);
@@ -1285,15 +9233,55 @@ Init_mecaby(void)
   rb_define_method(mecaby_cModel, "create_lattice", mecaby_model_create_lattice, 0);
   rb_define_alias(mecaby_cModel, "createLattice", "create_lattice");
   rb_define_alias(mecaby_cModel, "new_lattice", "create_lattice");
+  rb_define_method(mecaby_cModel, "tagger_for_current_thread", mecaby_model_tagger_for_current_thread, 0);
   rb_define_method(mecaby_cModel, "swap", mecaby_model_swap, 1);
+  rb_define_method(mecaby_cModel, "stats", mecaby_model_stats, 0);
+  rb_define_method(mecaby_cModel, "memory_report", mecaby_model_memory_report, 0);
+  rb_define_method(mecaby_cModel, "prewarm", mecaby_model_prewarm, -1);
+  rb_define_method(mecaby_cModel, "score_many", mecaby_model_score_many, -1);
+  rb_define_method(mecaby_cModel, "parse_document", mecaby_model_parse_document, -1);
+  rb_define_method(mecaby_cModel, "feature_fields", mecaby_model_feature_fields, 0);
+  rb_define_method(mecaby_cModel, "feature_fields=", mecaby_model_set_feature_fields, 1);
+
+  mecaby_cModelLoader = rb_define_class_under(mecaby_cModel, "Loader", rb_cObject);
+  rb_undef_alloc_func(mecaby_cModelLoader);
+  rb_define_method(mecaby_cModelLoader, "join", mecaby_loader_join, -1);
+  rb_define_method(mecaby_cModelLoader, "value", mecaby_loader_value, -1);
+  rb_define_method(mecaby_cModelLoader, "done?", mecaby_loader_is_done, 0);
+
+  mecaby_mDictionary = rb_define_module_under(mecaby_mMecaby, "Dictionary");
+  rb_define_singleton_method(mecaby_mDictionary, "compile", mecaby_dictionary_s_compile, -1);
 
   mecaby_cLattice = rb_define_class_under(mecaby_mMecaby, "Lattice", rb_cData);
   rb_define_alloc_func(mecaby_cLattice, mecaby_lattice_s_allocate);
   rb_define_method(mecaby_cLattice, "initialize", mecaby_lattice_initialize, -1);
   rb_define_method(mecaby_cLattice, "sentence", mecaby_lattice_sentence, 0);
   rb_define_method(mecaby_cLattice, "sentence=", mecaby_lattice_sentence_eq, 1);
-  rb_define_method(mecaby_cLattice, "set_sentence", mecaby_lattice_set_sentence, 1);
-  rb_define_method(mecaby_cLattice, "to_s", mecaby_lattice_to_s, 0);
+  rb_define_method(mecaby_cLattice, "set_sentence", mecaby_lattice_set_sentence, -1);
+  rb_define_method(mecaby_cLattice, "to_s", mecaby_lattice_to_s, -1);
+  rb_define_method(mecaby_cLattice, "parse_async", mecaby_lattice_parse_async, -1);
+  rb_define_method(mecaby_cLattice, "request_type", mecaby_lattice_request_type, 0);
+  rb_define_method(mecaby_cLattice, "request_type=", mecaby_lattice_request_type_eq, 1);
+  rb_define_method(mecaby_cLattice, "add_request_type", mecaby_lattice_add_request_type, 1);
+  rb_define_method(mecaby_cLattice, "remove_request_type", mecaby_lattice_remove_request_type, 1);
+  rb_define_method(mecaby_cLattice, "has_request_type?", mecaby_lattice_has_request_type, 1);
+  rb_define_method(mecaby_cLattice, "theta", mecaby_lattice_theta, 0);
+  rb_define_method(mecaby_cLattice, "theta=", mecaby_lattice_theta_eq, 1);
+  rb_define_method(mecaby_cLattice, "z", mecaby_lattice_z, 0);
+  rb_define_method(mecaby_cLattice, "z=", mecaby_lattice_z_eq, 1);
+  rb_define_method(mecaby_cLattice, "clear", mecaby_lattice_clear, 0);
+  rb_define_method(mecaby_cLattice, "available?", mecaby_lattice_is_available, 0);
+  rb_define_method(mecaby_cLattice, "bos_node", mecaby_lattice_bos_node, -1);
+  rb_define_method(mecaby_cLattice, "snapshot", mecaby_lattice_snapshot, -1);
+  rb_define_method(mecaby_cLattice, "node_pool=", mecaby_lattice_set_node_pool, 1);
+  rb_define_method(mecaby_cLattice, "node_pool?", mecaby_lattice_has_node_pool, 0);
+  rb_define_const(mecaby_cLattice, "ONE_BEST", INT2FIX(MECAB_ONE_BEST));
+  rb_define_const(mecaby_cLattice, "NBEST", INT2FIX(MECAB_NBEST));
+  rb_define_const(mecaby_cLattice, "PARTIAL", INT2FIX(MECAB_PARTIAL));
+  rb_define_const(mecaby_cLattice, "MARGINAL_PROB", INT2FIX(MECAB_MARGINAL_PROB));
+  rb_define_const(mecaby_cLattice, "ALTERNATIVE", INT2FIX(MECAB_ALTERNATIVE));
+  rb_define_const(mecaby_cLattice, "ALL_MORPHS", INT2FIX(MECAB_ALL_MORPHS));
+  rb_define_const(mecaby_cLattice, "ALLOCATE_SENTENCE", INT2FIX(MECAB_ALLOCATE_SENTENCE));
 #endif /* HAVE_MECAB_MODEL_NEW */
 
   mecaby_cTagger = rb_define_class_under(mecaby_mMecaby, "Tagger", rb_cData);
@@ -1301,12 +9289,22 @@ Init_mecaby(void)
   rb_define_method(mecaby_cTagger, "initialize", mecaby_tagger_initialize, -1);
   rb_define_method(mecaby_cTagger, "inspect", mecaby_tagger_inspect, 0);
   rb_define_method(mecaby_cTagger, "dictionary_info", mecaby_tagger_dictionary_info, 0);
-  rb_define_method(mecaby_cTagger, "parse", mecaby_tagger_parse, 1);
+  rb_define_method(mecaby_cTagger, "feature_fields", mecaby_tagger_feature_fields, 0);
+  rb_define_method(mecaby_cTagger, "feature_fields=", mecaby_tagger_set_feature_fields, 1);
+  rb_define_method(mecaby_cTagger, "parse", mecaby_tagger_parse, -1);
+  rb_define_method(mecaby_cTagger, "fast_path", mecaby_tagger_fast_path, 0);
+  rb_define_method(mecaby_cTagger, "fast_path=", mecaby_tagger_set_fast_path, 1);
+  rb_define_method(mecaby_cTagger, "node_pool=", mecaby_tagger_set_node_pool, 1);
+  rb_define_method(mecaby_cTagger, "node_pool?", mecaby_tagger_has_node_pool, 0);
+  rb_define_method(mecaby_cTagger, "parse_async", mecaby_tagger_parse_async, 1);
   rb_define_method(mecaby_cTagger, "nbest_parse", mecaby_tagger_nbest_parse, 2);
   rb_define_method(mecaby_cTagger, "nbest_init", mecaby_tagger_nbest_init, 1);
   rb_define_method(mecaby_cTagger, "nbest_next", mecaby_tagger_nbest_next, 0);
   /*rb_define_method(mecaby_cTagger, "nbest_next_node", mecaby_tagger_nbest_next_node, 0);*/
-  rb_define_method(mecaby_cTagger, "parse_to_node", mecaby_tagger_parse_to_node, 1);
+  rb_define_method(mecaby_cTagger, "parse_to_node", mecaby_tagger_parse_to_node, -1);
+  rb_define_method(mecaby_cTagger, "parse_to_tokens", mecaby_tagger_parse_to_tokens, -1);
+  rb_define_method(mecaby_cTagger, "term_frequencies", mecaby_tagger_term_frequencies, -1);
+  rb_define_method(mecaby_cTagger, "term_frequencies_many", mecaby_tagger_term_frequencies_many, -1);
 
   mecaby_cDictionaryInfo = rb_define_class_under(mecaby_mMecaby, "DictionaryInfo", rb_cData);
   rb_define_alloc_func(mecaby_cDictionaryInfo, mecaby_dictionary_info_s_allocate);
@@ -1326,6 +9324,24 @@ Init_mecaby(void)
   rb_define_method(mecaby_cNode, "next", mecaby_node_next, 0);
   rb_define_method(mecaby_cNode, "surface", mecaby_node_surface, 0);
   rb_define_method(mecaby_cNode, "feature", mecaby_node_feature, 0);
+  rb_define_method(mecaby_cNode, "features", mecaby_node_features, 0);
+  rb_define_method(mecaby_cNode, "pos", mecaby_node_pos, 0);
+  rb_define_method(mecaby_cNode, "base_form", mecaby_node_base_form, 0);
+  rb_define_method(mecaby_cNode, "reading", mecaby_node_reading, 0);
+  rb_define_method(mecaby_cNode, "prob", mecaby_node_prob, 0);
+  rb_define_method(mecaby_cNode, "alpha", mecaby_node_alpha, 0);
+  rb_define_method(mecaby_cNode, "beta", mecaby_node_beta, 0);
+  rb_define_method(mecaby_cNode, "cost", mecaby_node_cost, 0);
+  rb_define_method(mecaby_cNode, "wcost", mecaby_node_wcost, 0);
+  rb_define_method(mecaby_cNode, "length", mecaby_node_length, 0);
+  rb_define_method(mecaby_cNode, "rlength", mecaby_node_rlength, 0);
+  rb_define_method(mecaby_cNode, "id", mecaby_node_id, 0);
+  rb_define_method(mecaby_cNode, "posid", mecaby_node_posid, 0);
+  rb_define_method(mecaby_cNode, "char_type", mecaby_node_char_type, 0);
+  rb_define_method(mecaby_cNode, "stat", mecaby_node_stat, 0);
+  rb_define_method(mecaby_cNode, "lc_attr", mecaby_node_lc_attr, 0);
+  rb_define_method(mecaby_cNode, "rc_attr", mecaby_node_rc_attr, 0);
+  rb_define_method(mecaby_cNode, "best?", mecaby_node_is_best, 0);
   rb_define_method(mecaby_cNode, "status_nor?", mecaby_node_status_is_nor, 0);
   rb_define_method(mecaby_cNode, "status_unk?", mecaby_node_status_is_unk, 0);
   rb_define_method(mecaby_cNode, "status_bos?", mecaby_node_status_is_bos, 0);
@@ -1334,4 +9350,39 @@ Init_mecaby(void)
 
   mecaby_cPath = rb_define_class_under(mecaby_mMecaby, "Path", rb_cData);
   rb_define_alloc_func(mecaby_cPath, mecaby_path_s_allocate);
+
+  mecaby_cTokens = rb_define_class_under(mecaby_mMecaby, "Tokens", rb_cObject);
+  rb_undef_alloc_func(mecaby_cTokens);
+  rb_include_module(mecaby_cTokens, rb_mEnumerable);
+  rb_define_method(mecaby_cTokens, "size", mecaby_tokens_size, 0);
+  rb_define_alias(mecaby_cTokens, "length", "size");
+  rb_define_method(mecaby_cTokens, "empty?", mecaby_tokens_is_empty, 0);
+  rb_define_method(mecaby_cTokens, "each", mecaby_tokens_each, 0);
+  rb_define_method(mecaby_cTokens, "surfaces", mecaby_tokens_surfaces, 0);
+  rb_define_method(mecaby_cTokens, "surface", mecaby_tokens_surface, 1);
+  rb_define_method(mecaby_cTokens, "feature", mecaby_tokens_feature, 1);
+  rb_define_method(mecaby_cTokens, "pos", mecaby_tokens_pos, 1);
+  rb_define_method(mecaby_cTokens, "base_form", mecaby_tokens_base_form, 1);
+  rb_define_method(mecaby_cTokens, "reading", mecaby_tokens_reading, 1);
+  rb_define_method(mecaby_cTokens, "offset", mecaby_tokens_offset, 1);
+  rb_define_method(mecaby_cTokens, "bytesize", mecaby_tokens_bytesize, 1);
+  rb_define_method(mecaby_cTokens, "posid", mecaby_tokens_posid, 1);
+  rb_define_method(mecaby_cTokens, "stat", mecaby_tokens_stat, 1);
+  rb_define_method(mecaby_cTokens, "cost", mecaby_tokens_cost, 1);
+  rb_define_method(mecaby_cTokens, "wcost", mecaby_tokens_wcost, 1);
+
+  mecaby_cFilter = rb_define_class_under(mecaby_mMecaby, "Filter", rb_cObject);
+  rb_define_alloc_func(mecaby_cFilter, mecaby_filter_s_allocate);
+  rb_define_method(mecaby_cFilter, "initialize", mecaby_filter_initialize, -1);
+  rb_define_method(mecaby_cFilter, "accept?", mecaby_filter_is_accepted, 1);
+
+#ifdef HAVE_MECAB_MODEL_NEW
+  mecaby_cDocument = rb_define_class_under(mecaby_mMecaby, "Document", rb_cObject);
+  rb_define_alloc_func(mecaby_cDocument, mecaby_document_s_allocate);
+  rb_define_method(mecaby_cDocument, "initialize", mecaby_document_initialize, 2);
+  rb_define_method(mecaby_cDocument, "text", mecaby_document_text, 0);
+  rb_define_method(mecaby_cDocument, "tokens", mecaby_document_tokens, 0);
+  rb_define_method(mecaby_cDocument, "edit", mecaby_document_edit, 2);
+  rb_define_method(mecaby_cDocument, "stats", mecaby_document_stats, 0);
+#endif
 }
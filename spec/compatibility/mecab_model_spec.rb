@@ -0,0 +1,43 @@
+require 'spec_helper'
+require 'MeCab'
+
+module MeCab
+  describe Model, if: defined?(Mecaby::Model) do
+    subject(:model) { described_class.new("-d #{dict_dir.join('utf-8')}") }
+
+    describe '#createTagger' do
+      subject(:tagger) { model.createTagger }
+
+      it { should be_a(MeCab::Tagger) }
+
+      it 'parses with the model' do
+        expect(tagger.parseToNode("寿司").next.surface).to eq("寿司")
+      end
+    end
+
+    describe '#createLattice' do
+      subject(:lattice) { model.createLattice }
+
+      it { should be_a(MeCab::Lattice) }
+
+      context 'When the lattice is parsed by the tagger of the model' do
+        before do
+          lattice.set_sentence("寿司が食べたい")
+          model.createTagger.parse(lattice)
+        end
+
+        it 'has the camelCase accessors of mecab-ruby' do
+          expect(lattice.is_available).to be_true
+          expect(lattice.toString).to end_with("EOS\n")
+
+          node = lattice.bos_node.next
+          expect(node.stat).to eq(MeCab::MECAB_NOR_NODE)
+          expect(node.length).to eq("寿司".bytesize)
+          expect(node.rcAttr).to eq(node.rc_attr)
+          expect(node.lcAttr).to eq(node.lc_attr)
+          expect(node.isbest).to be_true
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,50 @@
+require 'spec_helper'
+require 'stringio'
+require 'tmpdir'
+
+module Mecaby
+  describe Dictionary do
+    let(:model) { Model.new("-d #{dict_dir.join('utf-8')}") }
+    let(:rows) do
+      [ [ "ぴよぴよ", 1285, 1285, -3000, "名詞,一般,*,*,*,*,ぴよぴよ,ピヨピヨ,ピヨピヨ" ] ]
+    end
+
+    describe '.compile' do
+      context 'When the subject method is called with output:' do
+        it 'writes a user dictionary that MeCab can load' do
+          Dir.mktmpdir do |dir|
+            output = File.join(dir, 'user.dic')
+            expect(described_class.compile(rows, model: model, output: output)).to eq(output)
+
+            tagger = Tagger.new("-d #{dict_dir.join('utf-8')} -u #{output} -Owakati")
+            expect(tagger.parse("ぴよぴよと花子")).to eq("ぴよぴよ と 花子 \n")
+          end
+        end
+      end
+
+      context 'When the subject method is called with CSV' do
+        let(:csv) { "ぴよぴよ,1285,1285,-3000,名詞,一般,*,*,*,*,ぴよぴよ,ピヨピヨ,ピヨピヨ\n" }
+
+        it 'returns the same dictionary as the rows' do
+          expect(described_class.compile(StringIO.new(csv), model: model)).to eq(described_class.compile(rows, model: model))
+        end
+      end
+
+      context 'When a row has a context id out of the matrix' do
+        let(:rows) { [ [ "ぴよぴよ", 100000, 1285, -3000, "名詞" ] ] }
+
+        it 'raises ArgumentError' do
+          expect { described_class.compile(rows, model: model) }.to raise_error(ArgumentError)
+        end
+      end
+
+      context 'When a row has no cost' do
+        let(:rows) { [ "ぴよぴよ,1285,1285,,名詞" ] }
+
+        it 'raises ArgumentError' do
+          expect { described_class.compile(rows, model: model) }.to raise_error(ArgumentError)
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,46 @@
+require 'spec_helper'
+
+module Mecaby
+  describe Document, if: defined?(Mecaby::Document) do
+    let(:model) { Model.new("-d #{dict_dir.join('utf-8')}") }
+    subject(:document) { described_class.new(model, "太郎と花子。吾輩は猫である。名前はまだ無い。") }
+
+    its(:text) { should be_frozen }
+
+    it 'has the tokens of all the sentences with the offsets into the text' do
+      tokens = document.tokens
+      expect(tokens.surfaces.join).to eq(document.text)
+      expect(tokens.offset(tokens.size - 1)).to eq(document.text.bytesize - "。".bytesize)
+      expect(document.stats[:sentences]).to eq(3)
+    end
+
+    describe '#edit' do
+      context 'When a word in the second sentence is replaced' do
+        before { document.edit(9..9, "犬") }
+
+        its(:text) { should eq("太郎と花子。吾輩は犬である。名前はまだ無い。") }
+
+        it 're-analyzes only the sentence of the change' do
+          expect(document.stats[:reparsed_sentences]).to eq(1)
+          expect(document.tokens.surfaces).to eq(
+            model.create_tagger.parse_to_tokens(document.text).surfaces)
+        end
+      end
+
+      context 'When the terminator between the sentences is removed' do
+        before { document.edit(5...6, "、") }
+
+        it 'joins the sentences' do
+          expect(document.stats[:sentences]).to eq(2)
+          expect(document.tokens.surfaces.join).to eq(document.text)
+        end
+      end
+
+      context 'When the range is out of the text' do
+        it 'raises RangeError' do
+          expect { document.edit(100..101, "犬") }.to raise_error(RangeError)
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,79 @@
+require 'spec_helper'
+
+module Mecaby
+  describe Filter do
+    let(:tagger) { Tagger.new("-d #{dict_dir.join('utf-8')}") }
+    let(:input) { "吾輩は猫である" }
+
+    context 'When the filter is created with pos: "名詞"' do
+      subject(:filter) { described_class.new(pos: "名詞") }
+
+      it 'keeps only the nouns in the tokens' do
+        expect(tagger.parse_to_tokens(input, filter: filter).surfaces).to eq(%w[吾輩 猫])
+      end
+
+      it 'skips the other tokens in the node traversal' do
+        node = tagger.parse_to_node(input, filter: filter)
+        surfaces = []
+        surfaces << node.surface while (node = node.next) && !node.status_eos?
+        expect(surfaces).to eq(%w[吾輩 猫])
+      end
+
+      it 'gives the same result on the second parse from the posid cache' do
+        tagger.parse_to_tokens(input, filter: filter)
+        expect(tagger.parse_to_tokens(input, filter: filter).surfaces).to eq(%w[吾輩 猫])
+      end
+    end
+
+    context 'When the filter is created with a pos: prefix past the POS columns' do
+      subject(:filter) { described_class.new(pos: "動詞,自立,*,*,一段") }
+
+      it 'tells apart the tokens of the same posid' do
+        expect(tagger.parse_to_tokens("見た。書いた", filter: filter).surfaces).to eq(%w[見])
+      end
+    end
+
+    context 'When the filter is created with stopwords:' do
+      subject(:filter) { described_class.new(stopwords: %w[は で ある]) }
+
+      it 'drops the stopwords' do
+        expect(tagger.parse_to_tokens(input, filter: filter).surfaces).to eq(%w[吾輩 猫])
+      end
+
+      it 'applies to term_frequencies' do
+        expect(tagger.term_frequencies(input, fields: :surface, filter: filter)).to eq("吾輩" => 1, "猫" => 1)
+      end
+    end
+
+    describe '#accept?' do
+      subject(:filter) { described_class.new(pos: "助詞") }
+
+      it 'tells whether the node is accepted' do
+        node = tagger.parse_to_node(input).next
+        expect(filter.accept?(node)).to be_false
+        expect(filter.accept?(node.next)).to be_true
+      end
+
+      it 'raises Mecaby::Error on a node of the last parse in the node pool' do
+        tagger.node_pool = true
+        node = tagger.parse_to_node(input).next
+        tagger.parse("太郎と花子")
+        expect { filter.accept?(node) }.to raise_error(Mecaby::Error)
+      end
+    end
+
+    context 'When the filter is initialized again' do
+      it 'raises RuntimeError whatever the options are' do
+        filter = described_class.new(unknown: false)
+        expect { filter.send(:initialize, pos: "名詞") }.to raise_error(RuntimeError)
+        expect { described_class.new.send(:initialize) }.to raise_error(RuntimeError)
+      end
+    end
+
+    context 'When a filter: option is not a filter' do
+      it 'raises TypeError' do
+        expect { tagger.parse_to_tokens(input, filter: "名詞") }.to raise_error(TypeError)
+      end
+    end
+  end
+end
@@ -0,0 +1,121 @@
+require 'spec_helper'
+
+module Mecaby
+  describe Lattice do
+    let(:model) { Model.new("-d #{dict_dir.join('utf-8')}") }
+    let(:tagger) { model.create_tagger }
+    subject(:lattice) { model.create_lattice }
+
+    describe '#request_type' do
+      context 'When MARGINAL_PROB is added' do
+        before { lattice.add_request_type(Lattice::MARGINAL_PROB) }
+
+        it 'has MARGINAL_PROB' do
+          expect(lattice.has_request_type?(Lattice::MARGINAL_PROB)).to be_true
+        end
+
+        context 'and then removed' do
+          before { lattice.remove_request_type(Lattice::MARGINAL_PROB) }
+
+          it 'does not have MARGINAL_PROB' do
+            expect(lattice.has_request_type?(Lattice::MARGINAL_PROB)).to be_false
+          end
+        end
+      end
+    end
+
+    describe '#theta' do
+      before { lattice.theta = 0.5 }
+
+      its(:theta) { should be_within(1e-6).of(0.5) }
+    end
+
+    describe '#available?' do
+      context 'When the lattice is not parsed' do
+        it { should_not be_available }
+      end
+
+      context 'When the lattice is parsed' do
+        before do
+          lattice.sentence = "太郎と花子"
+          tagger.parse(lattice)
+        end
+
+        it { should be_available }
+
+        context 'and then cleared' do
+          before { lattice.clear }
+
+          it { should_not be_available }
+        end
+      end
+    end
+
+    describe '#set_sentence' do
+      context 'When the subject method is called with normalize: true' do
+        before { lattice.set_sentence("ＡＢＣ　ｶﾞ", normalize: true) }
+
+        its(:sentence) { should eq("abc ガ") }
+      end
+
+      context 'When the sentence has ﾜﾞ and ｦﾞ' do
+        before { lattice.set_sentence("ﾜﾞｦﾞ", normalize: true) }
+
+        its(:sentence) { should eq("ヷヺ") }
+      end
+    end
+
+    describe '#to_s' do
+      context 'When the subject method is called with into:' do
+        let(:buf) { "" }
+
+        before do
+          lattice.sentence = "太郎と花子"
+          tagger.parse(lattice)
+        end
+
+        it 'writes the result into the buffer' do
+          expect(lattice.to_s(into: buf)).to equal(buf)
+          expect(buf).to eq(lattice.to_s)
+        end
+
+        it 'appends the result with append: true' do
+          2.times { lattice.to_s(into: buf, append: true) }
+          expect(buf).to eq(lattice.to_s * 2)
+        end
+
+        context 'and the result is longer than the buffer is sized for' do
+          let(:model) { Model.new([ "-d #{dict_dir.join('utf-8')}", "--node-format=#{'%H' * 16}\\n" ]) }
+
+          before do
+            lattice.sentence = "太郎と花子" * 200
+            tagger.parse(lattice)
+          end
+
+          it 'grows the buffer' do
+            lattice.to_s(into: buf)
+            expect(buf.bytesize).to be > lattice.sentence.bytesize * 64
+            expect(buf).to eq(lattice.to_s)
+          end
+        end
+      end
+    end
+
+    describe '#bos_node' do
+      context 'When the lattice is parsed with MARGINAL_PROB' do
+        before do
+          lattice.request_type = Lattice::MARGINAL_PROB
+          lattice.sentence = "太郎と花子"
+          tagger.parse(lattice)
+        end
+
+        it 'gives the nodes with marginal probabilities' do
+          node = lattice.bos_node.next
+          expect(node.surface).to eq("太郎")
+          expect(node.prob).to be > 0.0
+          expect(lattice.z).to_not eq(0.0)
+        end
+      end
+    end
+  end
+end
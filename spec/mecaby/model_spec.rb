@@ -0,0 +1,282 @@
+require 'spec_helper'
+
+module Mecaby
+  describe Model do
+    subject(:model) { described_class.new("-d #{dict_dir.join('utf-8')}") }
+
+    describe '.new' do
+      context 'When the subject method is called with non-existing dictionary path' do
+        subject(:model) do
+          described_class.new("-d #{dict_dir.join('non-existing-dict')}")
+        end
+
+        it 'raises Mecaby::DictionaryNotFound' do
+          expect { subject }.to raise_error(Mecaby::DictionaryNotFound)
+        end
+      end
+
+      context 'When the subject method is called with nil' do
+        it 'raises TypeError' do
+          expect { described_class.new(nil) }.to raise_error(TypeError)
+        end
+      end
+
+      context 'When the subject method is called with prewarm: :touch' do
+        subject(:model) { described_class.new("-d #{dict_dir.join('utf-8')}", prewarm: :touch) }
+
+        it 'loads the model' do
+          expect(model.create_tagger.parse("太郎")).to include("太郎")
+        end
+      end
+    end
+
+    describe '.load_async' do
+      context 'When the subject method is called with a dictionary path' do
+        subject(:loader) { described_class.load_async("-d #{dict_dir.join('utf-8')}") }
+
+        it 'returns a loader which gives the model' do
+          expect(loader.join).to equal(loader)
+          expect(loader).to be_done
+          expect(loader.value).to be_a(described_class)
+          expect(loader.value).to equal(loader.value)
+          expect(loader.value.create_tagger.parse("太郎")).to include("太郎")
+        end
+      end
+
+      context 'When the subject method is called with non-existing dictionary path' do
+        subject(:loader) { described_class.load_async("-d #{dict_dir.join('non-existing-dict')}") }
+
+        it 'raises Mecaby::DictionaryNotFound from #value' do
+          expect { loader.value }.to raise_error(Mecaby::DictionaryNotFound)
+        end
+      end
+    end
+
+    describe '.shared' do
+      let(:dict) { dict_dir.join('utf-8') }
+
+      context 'When the subject method is called twice with the same argument' do
+        it 'returns the same model' do
+          expect(described_class.shared("-d #{dict}")).to equal(described_class.shared("-d #{dict}"))
+        end
+      end
+
+      context 'When the subject method is called with equivalent arguments' do
+        it 'returns the same model' do
+          model = described_class.shared("-d #{dict} -O wakati")
+          expect(described_class.shared("-Owakati --dicdir=#{dict}")).to equal(model)
+          expect(described_class.shared(['mecab', '-O', 'wakati', '-d', dict.to_s])).to equal(model)
+        end
+      end
+
+      context 'When the subject method is called with different arguments' do
+        it 'returns different models' do
+          model = described_class.shared("-d #{dict} -O wakati")
+          expect(described_class.shared("-d #{dict} -O yomi")).to_not equal(model)
+        end
+      end
+
+      context 'When a shared model is swapped' do
+        it 'raises RuntimeError and keeps both models' do
+          shared = described_class.shared("-d #{dict} -O wakati")
+          other = described_class.new("-d #{dict}")
+          expect { shared.swap(other) }.to raise_error(RuntimeError)
+          expect { other.swap(shared) }.to raise_error(RuntimeError)
+          expect(described_class.shared("-d #{dict} -O wakati")).to equal(shared)
+          expect(shared.create_tagger.parse("太郎と花子")).to eq("太郎 と 花子 \n")
+        end
+      end
+
+      context 'When the dictionary fails to load' do
+        let(:arg) { "-d #{dict_dir.join('non-existing-dict')}" }
+
+        it 'raises the error again on the next call' do
+          expect { described_class.shared(arg) }.to raise_error(Mecaby::DictionaryNotFound)
+          expect { described_class.shared(arg) }.to raise_error(Mecaby::DictionaryNotFound)
+          expect(described_class.shared_stats.keys.flatten.grep(/non-existing/)).to be_empty
+        end
+      end
+
+      context 'When several threads ask for different dictionaries' do
+        it 'returns a model for each of them' do
+          models = [ 'utf-8', 'sjis' ].map {|name| Thread.new { described_class.shared("-d #{dict_dir.join(name)}") } }.map(&:value)
+          expect(models.uniq.size).to eq(2)
+        end
+      end
+    end
+
+    describe '#stats' do
+      subject(:stats) { model.stats }
+
+      context 'When two taggers and a lattice are created from the model' do
+        before do
+          @taggers = [ model.create_tagger, model.create_tagger ]
+          @lattice = model.create_lattice
+        end
+
+        it { should eq(taggers: 2, lattices: 1) }
+      end
+    end
+
+    describe '#memory_report' do
+      subject(:report) { model.memory_report }
+
+      it 'includes the sizes of the mapped dictionary files' do
+        expect(report[:files].keys.map {|f| File.basename(f) }).to include("sys.dic", "matrix.bin")
+        expect(report[:mapped_bytes]).to eq(report[:files].values.inject(:+))
+      end
+
+      context 'When a lattice of the model is parsed' do
+        before do
+          lattice = model.create_lattice
+          lattice.sentence = "太郎と花子"
+          model.create_tagger.parse(lattice)
+        end
+
+        it 'reports the lattice high water mark' do
+          expect(report[:lattice_high_water_bytes]).to be > 0
+        end
+      end
+    end
+
+    describe '#prewarm' do
+      context 'When the subject method is called with mode: :willneed' do
+        subject(:report) { model.prewarm(mode: :willneed) }
+
+        it 'reports the bytes of the dictionary files' do
+          expect(report[:mode]).to eq(:willneed)
+          expect(report[:bytes]).to eq(model.memory_report[:mapped_bytes])
+          expect(report[:seconds]).to be >= 0
+        end
+      end
+
+      context 'When the subject method is called with mode: :mlock' do
+        subject(:report) { model.prewarm(mode: :mlock) }
+
+        it 'locks the files or reports why it could not' do
+          expect(report[:locked_bytes] == report[:bytes] || !report[:errors].empty?).to be_true
+          expect(model.memory_report[:locked_bytes]).to eq(report[:locked_bytes])
+        end
+      end
+
+      context 'When the subject method is called with an unknown mode' do
+        it 'raises ArgumentError' do
+          expect { model.prewarm(mode: :prefetch) }.to raise_error(ArgumentError)
+        end
+      end
+    end
+
+    describe 'ObjectSpace.memsize_of' do
+      it 'includes the mapped dictionary files' do
+        require 'objspace'
+        expect(ObjectSpace.memsize_of(model)).to be >= model.memory_report[:mapped_bytes]
+      end
+    end
+
+    describe '#score_many' do
+      let(:strings) { [ "太郎と花子", "花子" ] }
+
+      it 'returns the costs of the EOS nodes' do
+        tagger = model.create_tagger
+        expected = strings.map do |s|
+          node = tagger.parse_to_node(s)
+          node = node.next until node.status_eos?
+          node.cost
+        end
+        expect(model.score_many(strings)).to eq(expected)
+      end
+
+      context 'When the subject method is called with counts: true' do
+        it 'returns the costs with the numbers of tokens' do
+          expect(model.score_many(strings, counts: true).map(&:last)).to eq([3, 1])
+        end
+      end
+    end
+
+    describe '#parse_document' do
+      let(:sentences) { [ "太郎と花子。", "吾輩は猫である。", "名前はまだ無い！\n" ] * 200 }
+      let(:text) { sentences.join }
+
+      it 'returns the results of the sentences in order' do
+        tagger = model.create_tagger
+        expect(model.parse_document(text, threads: 4)).to eq(sentences.map {|s| tagger.parse(s) }.join)
+      end
+
+      context 'When the subject method is called with format: :tokens' do
+        subject(:tokens) { model.parse_document(text, threads: 4, format: :tokens) }
+
+        it 'returns the tokens with the offsets into the text' do
+          expect(tokens.surfaces.join).to eq(text.delete("\n"))
+          expect(text.byteslice(tokens.offset(-2), tokens.bytesize(-2))).to eq("無い")
+        end
+      end
+
+      context 'When the thread is interrupted' do
+        it 'stops between sentences and raises the exception' do
+          thread = Thread.new { model.parse_document(text * 500, threads: 2) }
+          sleep 0.1
+          started = Time.now
+          thread.raise(Interrupt)
+          expect { thread.join }.to raise_error(Interrupt)
+          expect(Time.now - started).to be < 1
+        end
+      end
+
+      context 'When the subject method is called with threads: 0' do
+        it 'raises ArgumentError' do
+          expect { model.parse_document(text, threads: 0) }.to raise_error(ArgumentError)
+        end
+      end
+    end
+
+    context 'When the model is shared by Ractors', if: defined?(Ractor) do
+      subject(:model) { Ractor.make_shareable(described_class.new("-d #{dict_dir.join('utf-8')} -O wakati")) }
+
+      it 'can be used to create taggers in each Ractor' do
+        ractors = 2.times.map do
+          Ractor.new(model) {|m| Mecaby::Tagger.new(m).parse("太郎と花子") }
+        end
+        expect(ractors.map(&:take)).to eq([ "太郎 と 花子 \n" ] * 2)
+      end
+    end
+
+    describe '#tagger_for_current_thread' do
+      context 'When the subject method is called twice in the same thread' do
+        it 'returns the same tagger' do
+          expect(model.tagger_for_current_thread).to equal(model.tagger_for_current_thread)
+        end
+      end
+
+      context 'When the subject method is called in another fiber of the thread' do
+        it 'returns the same tagger' do
+          tagger = model.tagger_for_current_thread
+          expect(Fiber.new { model.tagger_for_current_thread }.resume).to equal(tagger)
+        end
+      end
+
+      context 'When the subject method is called in another thread' do
+        it 'returns a different tagger' do
+          tagger = model.tagger_for_current_thread
+          other = Thread.new { model.tagger_for_current_thread }.value
+          expect(other).to_not equal(tagger)
+        end
+
+        it 'returns a tagger that can parse' do
+          result = Thread.new { model.tagger_for_current_thread.parse("太郎と花子") }.value
+          expect(result).to include("花子")
+        end
+      end
+    end
+
+    context 'When the heap is compacted', if: GC.respond_to?(:compact) do
+      it 'keeps the taggers and the nodes usable' do
+        tagger = model.create_tagger
+        node = tagger.parse_to_node("太郎と花子").next
+        GC.compact
+        expect(node.surface).to eq("太郎")
+        expect(node.pos).to eq("名詞")
+        expect(tagger.parse_to_node("吾輩は猫である").next.surface).to eq("吾輩")
+      end
+    end
+  end
+end
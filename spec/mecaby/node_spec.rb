@@ -0,0 +1,90 @@
+require 'spec_helper'
+
+module Mecaby
+  describe Node do
+    let(:tagger) { Tagger.new("-d #{dict_dir.join('utf-8')}") }
+
+    def nodes_of(input)
+      [].tap do |ary|
+        node = tagger.parse_to_node(input)
+        while node
+          ary << node unless node.status_bos? || node.status_eos?
+          node = node.next
+        end
+      end
+    end
+
+    describe '#feature' do
+      context 'When the node is the first token of "花子と花子"' do
+        subject(:feature) { nodes_of("花子と花子").first.feature }
+
+        it { should be_frozen }
+        it { should start_with('名詞') }
+      end
+
+      context 'When the same word appears twice in "花子と花子"' do
+        subject(:features) { nodes_of("花子と花子").values_at(0, 2).map(&:feature) }
+
+        it 'returns the same String object' do
+          expect(features[0]).to equal(features[1])
+        end
+      end
+    end
+
+    describe '#features' do
+      context 'When the node is the first token of "花子と花子"' do
+        subject(:features) { nodes_of("花子と花子").first.features }
+
+        it { should be_frozen }
+        it { should eq(nodes_of("花子と花子").first.feature.split(',')) }
+      end
+
+      context 'When the same word appears twice in "花子と花子"' do
+        subject(:features) { nodes_of("花子と花子").values_at(0, 2).map(&:features) }
+
+        it 'returns the same Array object' do
+          expect(features[0]).to equal(features[1])
+        end
+      end
+    end
+
+    describe '#pos, #base_form and #reading' do
+      context 'When the node is "食べ" in "寿司を食べた"' do
+        subject(:node) { nodes_of("寿司を食べた")[2] }
+
+        its(:pos) { should eq('動詞') }
+        its(:base_form) { should eq('食べる') }
+        its(:reading) { should eq('タベ') }
+      end
+
+      context 'When the feature fields are renamed' do
+        subject(:node) { nodes_of("寿司を食べた")[2] }
+        before { tagger.feature_fields = %w[pos a b c d e f base_form reading] }
+
+        its(:base_form) { should eq('タベ') }
+        its(:reading) { should eq('タベ') }
+      end
+
+      context 'When the feature fields are renamed through a tagger of a frozen model', if: defined?(Mecaby::Model) do
+        let(:model) { Model.new("-d #{dict_dir.join('utf-8')}").freeze }
+
+        it 'raises an error and keeps the fields of the model' do
+          fields = model.feature_fields
+          expect { model.create_tagger.feature_fields = %w[pos a b c d e f base_form reading] }.to raise_error(RuntimeError)
+          expect(model.feature_fields).to eq(fields)
+        end
+      end
+    end
+
+    describe '#length and #rlength' do
+      context 'When the node is "花子" after a space' do
+        subject(:node) { nodes_of("太郎 花子")[1] }
+
+        its(:length) { should eq("花子".bytesize) }
+        its(:rlength) { should eq(" 花子".bytesize) }
+        its(:stat) { should eq(0) }
+        it { should be_best }
+      end
+    end
+  end
+end
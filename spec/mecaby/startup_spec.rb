@@ -0,0 +1,14 @@
+require 'spec_helper'
+require 'rbconfig'
+
+describe "require 'mecaby'" do
+  subject(:loaded_features) do
+    lib_dir = spec_dir.join('..', 'lib').to_s
+    IO.popen([ RbConfig.ruby, "-I#{lib_dir}", '-e',
+               "require 'mecaby'; puts $LOADED_FEATURES" ], &:read).lines.map(&:chomp)
+  end
+
+  it 'does not load weakref' do
+    expect(loaded_features.grep(/weakref/)).to be_empty
+  end
+end
@@ -1,4 +1,50 @@
 require 'spec_helper'
+require 'json'
+
+# A minimal fiber scheduler which runs the ready fibers in turn and
+# waits for the readable IOs with IO.select.
+class MinimalScheduler
+  def initialize
+    @ready = []
+    @readable = {}
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+
+  def io_wait(io, events, timeout)
+    @readable[io] = Fiber.current
+    Fiber.yield
+    events
+  end
+
+  def kernel_sleep(duration = nil)
+    @ready << Fiber.current
+    Fiber.yield
+  end
+
+  def block(blocker, timeout = nil)
+    Fiber.yield
+  end
+
+  def unblock(blocker, fiber)
+    @ready << fiber
+  end
+
+  def close
+    until @ready.empty? && @readable.empty?
+      ready, @ready = @ready, []
+      ready.each(&:resume)
+      next if @readable.empty?
+
+      readable, = IO.select(@readable.keys, nil, nil, @ready.empty? ? nil : 0)
+      (readable || []).each {|io| @readable.delete(io).resume }
+    end
+  end
+end
 
 module Mecaby
   describe Tagger do
@@ -45,6 +91,187 @@ module Mecaby
           it { should eq("太郎 と 花子 \n") }
         end
       end
+
+      context 'When the subject method is called with "太郎と花子" and format: :json' do
+        let(:input) { "太郎と花子" }
+        subject { JSON.parse(tagger.parse(input, format: :json, fields: [:surface, :offset, :length])) }
+
+        it 'returns the tokens with the selected fields' do
+          expect(subject).to eq([
+            { "surface" => "太郎", "offset" => 0, "length" => 6 },
+            { "surface" => "と",   "offset" => 6, "length" => 3 },
+            { "surface" => "花子", "offset" => 9, "length" => 6 },
+          ])
+        end
+      end
+
+      context 'When the subject method is called with format: :json for a Shift_JIS dictionary' do
+        subject(:tagger) { described_class.new("-d #{dict_dir.join('sjis')}") }
+        let(:output) { tagger.parse("太郎と花子".encode(Encoding::Shift_JIS), format: :json, fields: [:surface, :pos]) }
+
+        it 'returns UTF-8 JSON' do
+          expect(output.encoding).to eq(Encoding::UTF_8)
+          expect(output).to be_valid_encoding
+          expect(JSON.parse(output).map {|t| t["surface"] }).to eq(%w[太郎 と 花子])
+          expect(JSON.parse(output).first["pos"]).to eq("名詞")
+        end
+      end
+
+      context 'When the subject method is called with format: :msgpack' do
+        subject { tagger.parse("太郎と花子", format: :msgpack, fields: [:surface]) }
+
+        it 'returns a binary string of an array of maps' do
+          expect(subject.encoding).to eq(Encoding::ASCII_8BIT)
+          expect(subject.getbyte(0)).to eq(0x93)
+        end
+      end
+
+      context 'When the tagger has the fast path' do
+        before { tagger.fast_path = { min_length: 8, feature: "名詞,一般,*,*,*,*,*" } }
+
+        let(:input) { "太郎とabcdefghijklmnと花子" }
+        subject { JSON.parse(tagger.parse(input, format: :json, fields: [:surface, :offset, :pos])) }
+
+        it 'emits the long ASCII run as a token with the feature' do
+          expect(subject.map {|t| t["surface"] }).to eq(%w[太郎 と abcdefghijklmn と 花子])
+          expect(subject[2]).to eq("surface" => "abcdefghijklmn", "offset" => 9, "pos" => "名詞")
+          expect(subject[3]["offset"]).to eq(23)
+        end
+      end
+
+      context 'When the fast path is set for a Shift_JIS dictionary' do
+        subject(:tagger) { described_class.new("-d #{dict_dir.join('sjis')}") }
+
+        it 'raises ArgumentError' do
+          expect { tagger.fast_path = { feature: "名詞,一般,*,*,*,*,*" } }.to raise_error(ArgumentError)
+        end
+      end
+
+      context 'When the subject method is called with normalize: true' do
+        let(:input) { "ＴＯＫＹＯとｶﾞｲﾄﾞ" }
+        subject { JSON.parse(tagger.parse(input, format: :json, fields: [:surface, :offset, :length], normalize: true)) }
+
+        it 'analyzes the normalized string with the offsets into the input' do
+          expect(subject.map {|t| t["surface"] }.join).to eq("tokyoとガイド")
+          expect(subject.last["offset"] + subject.last["length"]).to eq(input.bytesize)
+        end
+      end
+
+      context 'When the subject method is called with into:' do
+        let(:additional_args) { [ '-Owakati' ] }
+        let(:buf) { "previous" }
+
+        it 'writes the result into the buffer and returns it' do
+          expect(tagger.parse("太郎と花子", into: buf)).to equal(buf)
+          expect(buf).to eq("太郎 と 花子 \n")
+        end
+
+        it 'appends the result with append: true' do
+          tagger.parse("太郎と花子", into: buf, append: true)
+          tagger.parse("吾輩は猫である", into: buf, append: true)
+          expect(buf).to eq("previous太郎 と 花子 \n吾輩 は 猫 で ある \n")
+        end
+
+        it 'replaces contents longer than the result' do
+          buf.replace("x" * 100000)
+          expect(tagger.parse("太郎と花子", into: buf)).to eq("太郎 と 花子 \n")
+        end
+
+        it 'grows the buffer for a long result' do
+          input = "太郎と花子" * 2000
+          expect(tagger.parse(input, into: buf)).to eq(tagger.parse(input))
+        end
+
+        context 'and the result is longer than the buffer is sized for' do
+          let(:additional_args) { [ "--node-format=#{'%H' * 16}\\n" ] }
+          let(:input) { "太郎と花子" * 200 }
+
+          it 'grows the buffer and parses again' do
+            tagger.parse(input, into: buf)
+            expect(buf.bytesize).to be > input.bytesize * 16
+            expect(buf).to eq(tagger.parse(input))
+          end
+        end
+
+        it 'raises ArgumentError when the buffer is the input' do
+          input = "太郎と花子"
+          expect { tagger.parse(input, into: input) }.to raise_error(ArgumentError)
+          expect(input).to eq("太郎と花子")
+        end
+
+        it 'raises Encoding::CompatibilityError when appending to a buffer in another encoding' do
+          sjis = "ア".encode(Encoding::Shift_JIS)
+          expect { tagger.parse("太郎と花子", into: sjis, append: true) }.to raise_error(Encoding::CompatibilityError)
+        end
+
+        it 'raises ArgumentError with a structured format' do
+          expect { tagger.parse("太郎と花子", format: :json, into: buf) }.to raise_error(ArgumentError)
+        end
+      end
+
+      context 'When the subject method is called with an unknown format' do
+        it 'raises ArgumentError' do
+          expect { tagger.parse("太郎と花子", format: :xml) }.to raise_error(ArgumentError)
+        end
+      end
+    end
+
+    describe '#parse_async' do
+      context 'When the tagger is created with "-Owakati"' do
+        let(:additional_args) { [ '-Owakati' ] }
+
+        context 'the subject method is called with "太郎と花子"' do
+          let(:input) { "太郎と花子" }
+          subject { tagger.parse_async(input) }
+
+          it { should eq("太郎 と 花子 \n") }
+        end
+
+        context 'the subject method is called in several threads' do
+          let(:input) { "太郎と花子" }
+          subject { 4.times.map { Thread.new { described_class.new("-d #{dict_dir.join('utf-8')} -Owakati").parse_async(input) } }.map(&:value) }
+
+          it { should eq([ "太郎 と 花子 \n" ] * 4) }
+        end
+
+        context 'the subject method is called in a fiber of a scheduler', if: defined?(Fiber.set_scheduler) do
+          let(:input) { "太郎と花子。" * 20000 }
+
+          it 'lets another fiber run while the parse is in flight' do
+            events = []
+            Thread.new do
+              Fiber.set_scheduler(MinimalScheduler.new)
+              done = false
+              Fiber.schedule do
+                tagger.parse_async(input)
+                events << :parsed
+                done = true
+              end
+              Fiber.schedule do
+                until done
+                  events << :tick
+                  sleep 0
+                end
+              end
+            end.join
+
+            expect(events.first).to eq(:tick)
+            expect(events.last).to eq(:parsed)
+          end
+        end
+
+        context 'the thread is interrupted while the subject method is called' do
+          let(:input) { "太郎と花子。" * 2000 }
+
+          it 'raises the exception and leaves the tagger idle' do
+            thread = Thread.new { loop { tagger.parse_async(input) } }
+            sleep 0.1
+            thread.raise(Interrupt)
+            expect { thread.join }.to raise_error(Interrupt)
+            expect(tagger.parse_async("太郎と花子")).to eq("太郎 と 花子 \n")
+          end
+        end
+      end
     end
 
     describe '#nbest_parse' do
@@ -73,5 +300,57 @@ module Mecaby
       end
 
     end
+
+    describe '#term_frequencies' do
+      let(:input) { "猫が猫を見た" }
+
+      context 'When the subject method is called with pos_filter: "名詞"' do
+        subject { tagger.term_frequencies(input, pos_filter: "名詞") }
+
+        it { should eq("猫" => 2) }
+      end
+
+      context 'When the subject method is called with fields: [:base_form, :pos]' do
+        subject { tagger.term_frequencies(input, fields: [:base_form, :pos]) }
+
+        it 'counts the terms of the fields joined by "/"' do
+          expect(subject["猫/名詞"]).to eq(2)
+          expect(subject["見る/動詞"]).to eq(1)
+        end
+      end
+
+      context 'When the subject method is called with an unknown field' do
+        it 'raises ArgumentError' do
+          expect { tagger.term_frequencies(input, fields: :cost) }.to raise_error(ArgumentError)
+        end
+      end
+    end
+
+    describe '#term_frequencies_many' do
+      subject { tagger.term_frequencies_many([ "猫が猫を見た", "犬" ], pos_filter: "名詞") }
+
+      it { should eq([ { "猫" => 2 }, { "犬" => 1 } ]) }
+    end
+
+    describe '#parse_to_node' do
+      context 'When the tagger has the node pool' do
+        before { tagger.node_pool = true }
+
+        it 'reuses the nodes of the last parse' do
+          first = tagger.parse_to_node("太郎と花子").next
+          expect(first.surface).to eq("太郎")
+
+          second = tagger.parse_to_node("吾輩は猫である").next
+          expect(second).to equal(first)
+          expect(second.surface).to eq("吾輩")
+        end
+
+        it 'raises Mecaby::Error on a node of the last parse' do
+          node = tagger.parse_to_node("太郎と花子").next.next
+          tagger.parse("吾輩は猫である")
+          expect { node.surface }.to raise_error(Mecaby::Error)
+        end
+      end
+    end
   end
 end
@@ -0,0 +1,53 @@
+require 'spec_helper'
+
+module Mecaby
+  describe Tokens do
+    let(:tagger) { Tagger.new("-d #{dict_dir.join('utf-8')}") }
+    subject(:tokens) { tagger.parse_to_tokens("太郎と花子") }
+
+    its(:size) { should eq(3) }
+    its(:surfaces) { should eq(%w[太郎 と 花子]) }
+
+    it 'gives the fields of each token by index' do
+      expect(tokens.surface(2)).to eq("花子")
+      expect(tokens.surface(-1)).to eq("花子")
+      expect(tokens.offset(1)).to eq(6)
+      expect(tokens.bytesize(1)).to eq(3)
+      expect(tokens.pos(1)).to eq("助詞")
+      expect(tokens.surface(3)).to be_nil
+    end
+
+    context 'When the tagger parses another string' do
+      before do
+        tokens
+        tagger.parse_to_tokens("吾輩は猫である")
+      end
+
+      it 'keeps the tokens of the first string' do
+        expect(tokens.surfaces).to eq(%w[太郎 と 花子])
+      end
+    end
+
+    describe '#each' do
+      it 'yields the surface and the feature' do
+        expect(tokens.map {|surface, feature| surface }).to eq(%w[太郎 と 花子])
+      end
+    end
+
+    context 'When the tokens are taken from a lattice', if: defined?(Mecaby::Lattice) do
+      let(:model) { Model.new("-d #{dict_dir.join('utf-8')}") }
+      let(:lattice) { model.create_lattice }
+      subject(:tokens) do
+        lattice.sentence = "太郎と花子"
+        model.create_tagger.parse(lattice)
+        lattice.snapshot
+      end
+
+      it 'stays valid after the lattice is cleared' do
+        tokens
+        lattice.clear
+        expect(tokens.surfaces).to eq(%w[太郎 と 花子])
+      end
+    end
+  end
+end